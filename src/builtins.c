@@ -0,0 +1,149 @@
+#define _GNU_SOURCE // for getline
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "evalcache.h"
+
+static builtin_t *builtins;
+static int builtin_count;
+
+static object_t *builtin_print(runtime_t *rt, object_t **args, int argc)
+{
+    print_object(args[0]);
+    return args[0];
+}
+
+static object_t *builtin_println(runtime_t *rt, object_t **args, int argc)
+{
+    print_object(args[0]);
+    printf("\n");
+    return args[0];
+}
+
+static object_t *builtin_gets(runtime_t *rt, object_t **args, int argc)
+{
+    char *lineptr = NULL;
+#ifdef _WIN32
+    lineptr = (char *)malloc(1024);
+    gets(lineptr);
+#else
+    size_t n = 0;
+    size_t m = getline(&lineptr, &n, stdin);
+    lineptr[m - 1] = '\0';
+#endif
+    return create_string(rt, lineptr, 1);
+}
+
+static object_t *builtin_env(runtime_t *rt, object_t **args, int argc)
+{
+    return create_string(rt, getenv(args[0]->data), 0);
+}
+
+static void expect_type(const char *name, object_t *obj, object_type_t type)
+{
+    if (obj->type != type)
+    {
+        fprintf(stderr, "%s expects %s as argument %d given\n", name, type == OBJ_LIST ? "list" : "number", obj->type);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static object_t *builtin_len(runtime_t *rt, object_t **args, int argc)
+{
+    expect_type("len", args[0], OBJ_LIST);
+    object_t *obj = create_object(rt, OBJ_NUMBER);
+    obj->data = NUMBER_DATA(ARRAY(args[0])->count);
+    return obj;
+}
+
+static object_t *builtin_append(runtime_t *rt, object_t **args, int argc)
+{
+    expect_type("append", args[0], OBJ_LIST);
+    array_push(rt, args[0], args[1]);
+    return args[0];
+}
+
+static object_t *builtin_pop(runtime_t *rt, object_t **args, int argc)
+{
+    expect_type("pop", args[0], OBJ_LIST);
+    return array_pop(args[0]);
+}
+
+static object_t *builtin_insert(runtime_t *rt, object_t **args, int argc)
+{
+    expect_type("insert", args[0], OBJ_LIST);
+    expect_type("insert", args[1], OBJ_NUMBER);
+    array_insert(rt, args[0], NUMBER_VALUE(args[1]), args[2]);
+    return args[0];
+}
+
+static object_t *builtin_slice(runtime_t *rt, object_t **args, int argc)
+{
+    expect_type("slice", args[0], OBJ_LIST);
+    expect_type("slice", args[1], OBJ_NUMBER);
+    expect_type("slice", args[2], OBJ_NUMBER);
+    return array_slice(rt, args[0], NUMBER_VALUE(args[1]), NUMBER_VALUE(args[2]));
+}
+
+static object_t *builtin_eval(runtime_t *rt, object_t **args, int argc)
+{
+    eval_source(rt, (char *)args[0]->data);
+    return args[0];
+}
+
+void init_builtins(void)
+{
+    register_builtin("print", builtin_print, 1);
+    register_builtin("println", builtin_println, 1);
+    register_builtin("gets", builtin_gets, 0);
+    register_builtin("env", builtin_env, 1);
+    register_builtin("len", builtin_len, 1);
+    register_builtin("append", builtin_append, 2);
+    register_builtin("pop", builtin_pop, 1);
+    register_builtin("insert", builtin_insert, 3);
+    register_builtin("slice", builtin_slice, 3);
+    register_builtin("eval", builtin_eval, 1);
+}
+
+void release_builtins(void)
+{
+    free(builtins);
+    builtins = 0;
+    builtin_count = 0;
+}
+
+// returns the id calls are linked against
+int register_builtin(const char *name, builtin_fn_t fn, int min_argc)
+{
+    builtins = (builtin_t *)realloc(builtins, (builtin_count + 1) * sizeof(builtin_t));
+    builtins[builtin_count].name = intern(name);
+    builtins[builtin_count].fn = fn;
+    builtins[builtin_count].min_argc = min_argc;
+    return builtin_count++;
+}
+
+// returns -1 when name is not a builtin
+int find_builtin(char *name)
+{
+    for (int i = 0; i < builtin_count; i++)
+    {
+        if (builtins[i].name == name)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+object_t *call_builtin(runtime_t *rt, int id, object_t **args, int argc)
+{
+    builtin_t *b = &builtins[id];
+    if (argc < b->min_argc)
+    {
+        fprintf(stderr, "missing argument for %s\n", b->name);
+        exit(EXIT_FAILURE);
+    }
+    return b->fn(rt, args, argc);
+}
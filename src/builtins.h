@@ -0,0 +1,21 @@
+#ifndef builtins_h
+#define builtins_h
+
+#include "runtime.h"
+
+// native functions take their evaluated arguments and return a new value
+typedef object_t *(*builtin_fn_t)(runtime_t *rt, object_t **args, int argc);
+
+typedef struct {
+    char *name; // symbol
+    builtin_fn_t fn;
+    int min_argc;
+} builtin_t;
+
+void init_builtins(void);
+void release_builtins(void);
+int register_builtin(const char *name, builtin_fn_t fn, int min_argc);
+int find_builtin(char *name);
+object_t *call_builtin(runtime_t *rt, int id, object_t **args, int argc);
+
+#endif // builtins_h
@@ -0,0 +1,186 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "cache.h"
+#include "serialize.h"
+
+// bump whenever the tree or its encoding changes, entries written by other
+// versions are ignored
+#define CACHE_VERSION 2
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_hash;
+    uint64_t payload_hash;
+    uint32_t source_length;
+    uint32_t payload_length;
+} cache_header_t;
+
+#ifdef _WIN32
+bool load_cached_ast(parser_t *p)
+{
+    return false;
+}
+
+void save_cached_ast(parser_t *p)
+{
+}
+#else
+static bool cache_directory(char *dir, size_t size)
+{
+    const char *env = getenv("BETIK_CACHE_DIR");
+    if (env != 0 && env[0] != '\0')
+    {
+        return snprintf(dir, size, "%s", env) < size;
+    }
+    env = getenv("XDG_CACHE_HOME");
+    if (env != 0 && env[0] != '\0')
+    {
+        return snprintf(dir, size, "%s/betik", env) < size;
+    }
+    env = getenv("HOME");
+    if (env != 0 && env[0] != '\0')
+    {
+        return snprintf(dir, size, "%s/.cache/betik", env) < size;
+    }
+    return false;
+}
+
+static bool cache_path(uint64_t hash, char *path, size_t size)
+{
+    char dir[1024];
+    if (!cache_directory(dir, sizeof(dir)))
+    {
+        return false;
+    }
+    return snprintf(path, size, "%s/%016llx.btc", dir, (unsigned long long)hash) < size;
+}
+
+// creates the directory and its missing parents
+static void make_directories(char *path)
+{
+    for (char *c = path + 1; *c != '\0'; c++)
+    {
+        if (*c == '/')
+        {
+            *c = '\0';
+            mkdir(path, 0755);
+            *c = '/';
+        }
+    }
+    mkdir(path, 0755);
+}
+
+static bool read_cache_entry(parser_t *p, const char *data, size_t length, uint64_t hash)
+{
+    cache_header_t header;
+    if (length < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, "BTKC", 4) != 0 || header.version != CACHE_VERSION ||
+        header.source_hash != hash || header.source_length != p->source_length ||
+        header.payload_length != length - sizeof(header))
+    {
+        return false;
+    }
+    const char *payload = data + sizeof(header);
+    if (hash_bytes(payload, header.payload_length) != header.payload_hash)
+    {
+        return false;
+    }
+    reader_t r = {payload, header.payload_length, 0, false, 0, p->source, p->source_length};
+    if (!read_program(&r, p->ast) || r.pos != r.length)
+    {
+        // the nodes read so far are dropped, the program gets parsed again
+        p->ast->statement_list->count = 0;
+        p->ast->function_list->count = 0;
+        return false;
+    }
+    return true;
+}
+
+bool load_cached_ast(parser_t *p)
+{
+    char path[1100];
+    uint64_t hash = hash_bytes(p->source, p->source_length);
+    if (!cache_path(hash, path, sizeof(path)))
+    {
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == data)
+    {
+        return false;
+    }
+    bool loaded = read_cache_entry(p, data, st.st_size, hash);
+    munmap(data, st.st_size);
+    return loaded;
+}
+
+// written to a temporary file first so readers never see half an entry,
+// failures only mean the next run parses again
+void save_cached_ast(parser_t *p)
+{
+    char path[1100];
+    char tmp[1200];
+    uint64_t hash = hash_bytes(p->source, p->source_length);
+    if (!cache_path(hash, path, sizeof(path)))
+    {
+        return;
+    }
+
+    writer_t w = {0, 0, 0, 0, p->source};
+    write_program(&w, p->ast);
+
+    cache_header_t header;
+    memcpy(header.magic, "BTKC", 4);
+    header.version = CACHE_VERSION;
+    header.source_hash = hash;
+    header.payload_hash = hash_bytes(w.data, w.length);
+    header.source_length = p->source_length;
+    header.payload_length = w.length;
+
+    char dir[1024];
+    cache_directory(dir, sizeof(dir));
+    make_directories(dir);
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (f != 0)
+    {
+        bool written = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                       fwrite(w.data, 1, w.length, f) == w.length;
+        if (fclose(f) == 0 && written)
+        {
+            rename(tmp, path);
+        }
+        else
+        {
+            remove(tmp);
+        }
+    }
+    free(w.data);
+}
+#endif
@@ -0,0 +1,18 @@
+#ifndef cache_h
+#define cache_h
+
+#include <stdbool.h>
+
+#include "parser.h"
+
+// parsed programs are kept in a cache directory, one file per source keyed
+// by a hash of its text. BETIK_CACHE_DIR overrides the default location,
+// $XDG_CACHE_HOME/betik or ~/.cache/betik.
+//
+// load_cached_ast fills p->ast from the cache entry of p->source, it returns
+// false when there is no entry or the entry is stale or damaged.
+// save_cached_ast stores a freshly parsed, not yet resolved p->ast.
+bool load_cached_ast(parser_t *p);
+void save_cached_ast(parser_t *p);
+
+#endif // cache_h
@@ -1,7 +1,11 @@
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
 #include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "common.h"
 
@@ -14,7 +18,230 @@ char *duplicate_string(char *str)
     return result;
 }
 
-#define STACK_SIZE 1024
+typedef struct
+{
+    char **slots;
+    unsigned *hashes;
+    int slot_count;
+    int count;
+} symbol_table_t;
+
+static symbol_table_t symbols;
+
+// parse workers intern through a table of their own first and lock the
+// shared table only for names they have not seen yet
+static pthread_mutex_t symbols_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread symbol_table_t *local_symbols;
+static __thread jmp_buf *error_trap;
+static __thread char error_message[256];
+
+static unsigned hash_name(const char *str, int length)
+{
+    unsigned h = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        h = (h ^ (unsigned char)str[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void grow_symbols(symbol_table_t *t)
+{
+    int old_count = t->slot_count;
+    char **old_slots = t->slots;
+    unsigned *old_hashes = t->hashes;
+
+    t->slot_count = old_count ? old_count * 2 : 256;
+    t->slots = (char **)calloc(t->slot_count, sizeof(char *));
+    t->hashes = (unsigned *)malloc(t->slot_count * sizeof(unsigned));
+    for (int i = 0; i < old_count; i++)
+    {
+        if (old_slots[i] != 0)
+        {
+            unsigned h = old_hashes[i] & (t->slot_count - 1);
+            while (t->slots[h] != 0)
+            {
+                h = (h + 1) & (t->slot_count - 1);
+            }
+            t->slots[h] = old_slots[i];
+            t->hashes[h] = old_hashes[i];
+        }
+    }
+    free(old_slots);
+    free(old_hashes);
+}
+
+// returns the symbol of the name or the free slot it goes into
+static char **find_symbol(symbol_table_t *t, const char *str, int length, unsigned hash)
+{
+    if (t->count * 2 >= t->slot_count)
+    {
+        grow_symbols(t);
+    }
+    unsigned h = hash & (t->slot_count - 1);
+    while (t->slots[h] != 0)
+    {
+        char *sym = t->slots[h];
+        if (t->hashes[h] == hash && strncmp(sym, str, length) == 0 && sym[length] == '\0')
+        {
+            break;
+        }
+        h = (h + 1) & (t->slot_count - 1);
+    }
+    t->hashes[h] = hash;
+    return &t->slots[h];
+}
+
+static char *intern_shared(const char *str, int length, unsigned hash)
+{
+    char **slot = find_symbol(&symbols, str, length, hash);
+    if (0 == *slot)
+    {
+        char *sym = (char *)malloc(length + 1);
+        memcpy(sym, str, length);
+        sym[length] = '\0';
+        *slot = sym;
+        symbols.count++;
+    }
+    return *slot;
+}
+
+char *intern_length(const char *str, int length)
+{
+    unsigned hash = hash_name(str, length);
+    if (0 == local_symbols)
+    {
+        return intern_shared(str, length, hash);
+    }
+    char **slot = find_symbol(local_symbols, str, length, hash);
+    if (0 == *slot)
+    {
+        pthread_mutex_lock(&symbols_lock);
+        *slot = intern_shared(str, length, hash);
+        pthread_mutex_unlock(&symbols_lock);
+        local_symbols->count++;
+    }
+    return *slot;
+}
+
+void use_local_symbols(void)
+{
+    local_symbols = (symbol_table_t *)calloc(1, sizeof(symbol_table_t));
+}
+
+void release_local_symbols(void)
+{
+    free(local_symbols->slots);
+    free(local_symbols->hashes);
+    free(local_symbols);
+    local_symbols = 0;
+}
+
+char *intern(const char *str)
+{
+    assert(str);
+    return intern_length(str, strlen(str));
+}
+
+void release_symbols(void)
+{
+    for (int i = 0; i < symbols.slot_count; i++)
+    {
+        free(symbols.slots[i]);
+    }
+    free(symbols.slots);
+    free(symbols.hashes);
+    memset(&symbols, 0, sizeof(symbols));
+}
+
+void set_error_trap(jmp_buf *trap)
+{
+    error_trap = trap;
+}
+
+void syntax_error(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if (error_trap != 0)
+    {
+        vsnprintf(error_message, sizeof(error_message), format, args);
+        va_end(args);
+        longjmp(*error_trap, 1);
+    }
+    vfprintf(stderr, format, args);
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
+
+const char *syntax_error_message(void)
+{
+    return error_message;
+}
+
+double monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define SLAB_SIZE (64 * 1024)
+
+void init_pool(pool_t *p, unsigned item_size)
+{
+    // every record must be able to hold the free list link
+    if (item_size < sizeof(void *))
+    {
+        item_size = sizeof(void *);
+    }
+    p->item_size = (item_size + sizeof(void *) - 1) & ~(unsigned)(sizeof(void *) - 1);
+    p->free_list = NULL;
+    p->next = NULL;
+    p->end = NULL;
+    p->slabs = NULL;
+}
+
+void *pool_alloc(pool_t *p)
+{
+    if (p->free_list != NULL)
+    {
+        void *item = p->free_list;
+        p->free_list = *(void **)item;
+        return item;
+    }
+    if (p->next == NULL || p->next + p->item_size > p->end)
+    {
+        char *slab = (char *)malloc(SLAB_SIZE);
+        assert(slab);
+        *(void **)slab = p->slabs;
+        p->slabs = slab;
+        p->next = slab + sizeof(void *);
+        p->end = slab + SLAB_SIZE;
+    }
+    void *item = p->next;
+    p->next += p->item_size;
+    return item;
+}
+
+void pool_free(pool_t *p, void *item)
+{
+    *(void **)item = p->free_list;
+    p->free_list = item;
+}
+
+void destroy_pool(pool_t *p)
+{
+    while (p->slabs != NULL)
+    {
+        void *slab = p->slabs;
+        p->slabs = *(void **)slab;
+        free(slab);
+    }
+    init_pool(p, p->item_size);
+}
+
+#define STACK_SIZE 1024 // initial capacity, stacks grow on demand
 
 btk_stack_t *create_stack(unsigned item_length)
 {
@@ -25,6 +252,7 @@ btk_stack_t *create_stack(unsigned item_length)
     assert(s);
 
     s->top = 0;
+    s->capacity = STACK_SIZE;
     s->buffer = malloc(STACK_SIZE * item_length);
 
     assert(s->buffer != NULL);
@@ -49,8 +277,13 @@ void stack_push(btk_stack_t *s, void *item)
     assert(s);
     assert(s->buffer);
     assert(item);
-    assert(s->top < 1024);
 
+    if (s->top == s->capacity)
+    {
+        s->capacity *= 2;
+        s->buffer = realloc(s->buffer, s->capacity * s->item_length);
+        assert(s->buffer != NULL);
+    }
     unsigned char *ptr = (unsigned char *)s->buffer;
     ptr += s->item_length * s->top;
     memcpy(ptr, item, s->item_length);
@@ -76,6 +309,57 @@ int stack_get_count(btk_stack_t *s)
     return s->top;
 }
 
+vector_t *create_vector(void)
+{
+    vector_t *v = (vector_t *)malloc(sizeof(vector_t));
+    v->items = NULL;
+    v->count = 0;
+    v->capacity = 0;
+    return v;
+}
+
+void destroy_vector(vector_t *v)
+{
+    free(v->items);
+    free(v);
+}
+
+void vector_push(vector_t *v, void *item)
+{
+    if (v->count == v->capacity)
+    {
+        v->capacity = v->capacity ? v->capacity * 2 : 4;
+        v->items = (void **)realloc(v->items, v->capacity * sizeof(void *));
+        assert(v->items);
+    }
+    v->items[v->count++] = item;
+}
+
+void *vector_pop(vector_t *v)
+{
+    assert(v->count > 0);
+    return v->items[--v->count];
+}
+
+void *vector_get(vector_t *v, int index)
+{
+    assert(index >= 0 && index < v->count);
+    return v->items[index];
+}
+
+void vector_set(vector_t *v, int index, void *item)
+{
+    assert(index >= 0 && index < v->count);
+    v->items[index] = item;
+}
+
+int vector_count(vector_t *v)
+{
+    return v->count;
+}
+
+static pool_t listitem_pool = {sizeof(listitem_t)};
+
 list_t *create_list(void)
 {
     list_t *list;
@@ -84,6 +368,7 @@ list_t *create_list(void)
 
     list->item_count = 0;
     list->head = NULL;
+    list->tail = NULL;
 
     return list;
 }
@@ -97,7 +382,7 @@ void destroy_list(list_t *list)
     while (item != NULL)
     {
         nitem = item->next;
-        free(item);
+        pool_free(&listitem_pool, item);
         list->item_count--;
         item = nitem;
     }
@@ -107,10 +392,9 @@ void destroy_list(list_t *list)
 
 void list_insert(list_t *list, void *data)
 {
-    listitem_t *item;
     listitem_t *new_item;
 
-    new_item = (listitem_t *)malloc(sizeof(listitem_t));
+    new_item = (listitem_t *)pool_alloc(&listitem_pool);
     new_item->next = NULL;
     new_item->prev = NULL;
     new_item->data = data;
@@ -118,14 +402,13 @@ void list_insert(list_t *list, void *data)
     if (list->item_count == 0)
     {
         list->head = new_item;
+        list->tail = new_item;
         list->item_count = 1;
         return;
     }
-    // find last item
-    for (item = list->head; item->next != NULL; item = item->next)
-        ; // nothing
-    item->next = new_item;
-    new_item->prev = item;
+    list->tail->next = new_item;
+    new_item->prev = list->tail;
+    list->tail = new_item;
     list->item_count++;
 }
 
@@ -135,6 +418,10 @@ static void _remove_item(list_t *list, listitem_t *item)
     {
         list->head = item->next;
     }
+    if (item == list->tail)
+    {
+        list->tail = item->prev;
+    }
     if (item->prev != NULL)
     {
         item->prev->next = item->next;
@@ -143,7 +430,7 @@ static void _remove_item(list_t *list, listitem_t *item)
     {
         item->next->prev = item->prev;
     }
-    free(item);
+    pool_free(&listitem_pool, item);
     list->item_count--;
 }
 
@@ -225,3 +512,9 @@ int list_get_item_count(list_t *list)
 {
     return list->item_count;
 }
+
+// only valid once no list is in use anymore
+void release_list_items(void)
+{
+    destroy_pool(&listitem_pool);
+}
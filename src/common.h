@@ -1,11 +1,51 @@
 #ifndef common_h
 #define common_h
 
+#include <setjmp.h>
+
 char *duplicate_string(char *str);
 
+// symbols are unique copies of names, two names are equal when their
+// symbols are the same pointer. symbols live until release_symbols.
+char *intern(const char *str);
+char *intern_length(const char *str, int length);
+void release_symbols(void);
+
+// threads other than the main one intern only between these two calls,
+// see parse
+void use_local_symbols(void);
+void release_local_symbols(void);
+
+// reports a lexer or parser error and ends the program. a thread that set a
+// trap gets a longjmp to it instead, nothing is printed and the message is
+// kept for syntax_error_message.
+void set_error_trap(jmp_buf *trap);
+void syntax_error(const char *format, ...);
+const char *syntax_error_message(void);
+
+// seconds on a clock that only goes forward, for timing
+double monotonic_seconds(void);
+
+// fixed size records carved out of large slabs, freed records go to a free
+// list and are handed out again first. destroy_pool releases all slabs.
+typedef struct
+{
+    unsigned item_size;
+    void *free_list;
+    char *next; // bump pointer into the newest slab
+    char *end;
+    void *slabs; // chained through their first word
+} pool_t;
+
+void init_pool(pool_t *p, unsigned item_size);
+void *pool_alloc(pool_t *p);
+void pool_free(pool_t *p, void *item);
+void destroy_pool(pool_t *p);
+
 typedef struct
 {
     int top;
+    int capacity;
     void *buffer;
     unsigned item_length;
 } btk_stack_t;
@@ -16,6 +56,24 @@ void stack_push(btk_stack_t *s, void *item);
 const void *stack_pop(btk_stack_t *s);
 int stack_get_count(btk_stack_t *s);
 
+// growable array, the container used for everything that is built once and
+// then walked by index
+typedef struct
+{
+    void **items;
+    int count;
+    int capacity;
+} vector_t;
+
+vector_t *create_vector(void);
+void destroy_vector(vector_t *v);
+void vector_push(vector_t *v, void *item);
+void *vector_pop(vector_t *v);
+void *vector_get(vector_t *v, int index);
+void vector_set(vector_t *v, int index, void *item);
+int vector_count(vector_t *v);
+
+// doubly linked list for collections that remove items from the middle
 typedef struct _listitem_t
 {
     void *data;
@@ -27,6 +85,7 @@ typedef struct
 {
     int item_count;
     listitem_t *head;
+    listitem_t *tail;
 } list_t;
 
 list_t *create_list();
@@ -37,7 +96,6 @@ void list_remove_by_data(list_t *list, void *data);
 void *list_get_item(list_t *list, int item_index);
 void list_set_item(list_t *list, int item_index, void *data);
 int list_get_item_count(list_t *list);
-
-#define LAST_LIST_ITEM(lst) list_gem_item(lst, list_get_item_count(lst))
+void release_list_items(void);
 
 #endif
@@ -0,0 +1,643 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+
+#define MAX_OPERAND 0xffff
+
+typedef struct {
+    runtime_t *rt;
+    chunk_t *chunk;
+    bool in_function;
+    funcdef_t *fd; // 0 for the top level
+    vector_t *exit_jumps; // returns on the top level leave the current statement
+    int *constant_slots;
+    int constant_slot_count;
+} compiler_t;
+
+static void compile_block(compiler_t *c, block_t *b);
+static void compile_expression(compiler_t *c, expression_t *e);
+static void compile_statement(compiler_t *c, statement_t *s);
+static void compile_value(compiler_t *c, value_t *v);
+
+static void compile_error(const char *message)
+{
+    fprintf(stderr, "compile error: %s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+static chunk_t *create_chunk(runtime_t *rt)
+{
+    chunk_t *chunk = (chunk_t *)malloc(sizeof(chunk_t));
+    chunk->code_length = 0;
+    chunk->code_capacity = 64;
+    chunk->code = (unsigned char *)malloc(chunk->code_capacity);
+    chunk->constant_count = 0;
+    chunk->constant_capacity = 16;
+    chunk->constants = (object_t **)malloc(chunk->constant_capacity * sizeof(object_t *));
+    chunk->caches = 0;
+    chunk->cache_count = 0;
+    chunk->cache_capacity = 0;
+    chunk->loops = 0;
+    chunk->loop_count = 0;
+    chunk->loop_capacity = 0;
+    init_jit_site(&chunk->calls, 0, 0);
+    list_insert(rt->chunks, chunk);
+    return chunk;
+}
+
+// the constants stay on the heap until nothing refers to them
+void destroy_chunk(runtime_t *rt, chunk_t *chunk)
+{
+    list_remove_by_data(rt->chunks, chunk);
+    for (int i = 0; i < chunk->loop_count; i++)
+    {
+        release_jit_site(&chunk->loops[i]);
+    }
+    release_jit_site(&chunk->calls);
+    free(chunk->loops);
+    free(chunk->code);
+    free(chunk->constants);
+    free(chunk->caches);
+    free(chunk);
+}
+
+static void emit_byte(compiler_t *c, int byte)
+{
+    chunk_t *chunk = c->chunk;
+    if (chunk->code_length == chunk->code_capacity)
+    {
+        chunk->code_capacity *= 2;
+        chunk->code = (unsigned char *)realloc(chunk->code, chunk->code_capacity);
+    }
+    chunk->code[chunk->code_length++] = (unsigned char)byte;
+}
+
+static void emit_short(compiler_t *c, int value)
+{
+    if (value > MAX_OPERAND)
+    {
+        compile_error("operand out of range");
+    }
+    emit_byte(c, value & 0xff);
+    emit_byte(c, (value >> 8) & 0xff);
+}
+
+static void emit_op(compiler_t *c, opcode_t op, int operand)
+{
+    emit_byte(c, op);
+    emit_short(c, operand);
+}
+
+static int emit_jump(compiler_t *c, opcode_t op)
+{
+    emit_byte(c, op);
+    emit_byte(c, 0xff);
+    emit_byte(c, 0xff);
+    return c->chunk->code_length - 2;
+}
+
+static void patch_jump(compiler_t *c, int operand_offset)
+{
+    int distance = c->chunk->code_length - operand_offset - 2;
+    if (distance > MAX_OPERAND)
+    {
+        compile_error("jump too long");
+    }
+    c->chunk->code[operand_offset] = distance & 0xff;
+    c->chunk->code[operand_offset + 1] = (distance >> 8) & 0xff;
+}
+
+static int make_loop_site(compiler_t *c, int line)
+{
+    chunk_t *chunk = c->chunk;
+    if (chunk->loop_count > MAX_OPERAND)
+    {
+        compile_error("too many loops");
+    }
+    if (chunk->loop_count == chunk->loop_capacity)
+    {
+        chunk->loop_capacity = chunk->loop_capacity ? chunk->loop_capacity * 2 : 4;
+        chunk->loops = (jit_site_t *)realloc(chunk->loops, chunk->loop_capacity * sizeof(jit_site_t));
+    }
+    init_jit_site(&chunk->loops[chunk->loop_count], c->fd, line);
+    return chunk->loop_count++;
+}
+
+static void emit_loop(compiler_t *c, int loop_start, int line)
+{
+    emit_op(c, OP_LOOP, make_loop_site(c, line));
+    emit_short(c, c->chunk->code_length - loop_start + 2);
+}
+
+// string constants are symbols, so every constant compares by its data
+static unsigned hash_constant(object_type_t type, void *data)
+{
+    return ((unsigned)(intptr_t)data ^ (unsigned)type) * 2654435761u;
+}
+
+static int same_constant(object_t *obj, object_type_t type, void *data)
+{
+    return obj->type == type && obj->data == data;
+}
+
+static int append_constant(compiler_t *c, object_t *obj)
+{
+    chunk_t *chunk = c->chunk;
+    if (chunk->constant_count > MAX_OPERAND)
+    {
+        compile_error("too many constants");
+    }
+    if (chunk->constant_count == chunk->constant_capacity)
+    {
+        chunk->constant_capacity *= 2;
+        chunk->constants = (object_t **)realloc(chunk->constants, chunk->constant_capacity * sizeof(object_t *));
+    }
+    chunk->constants[chunk->constant_count] = obj;
+    return chunk->constant_count++;
+}
+
+static void grow_constant_slots(compiler_t *c)
+{
+    int old_count = c->constant_slot_count;
+    int *old_slots = c->constant_slots;
+
+    c->constant_slot_count = old_count ? old_count * 2 : 64;
+    c->constant_slots = (int *)calloc(c->constant_slot_count, sizeof(int));
+    for (int i = 0; i < old_count; i++)
+    {
+        if (old_slots[i] != 0)
+        {
+            object_t *obj = c->chunk->constants[old_slots[i] - 1];
+            unsigned h = hash_constant(obj->type, obj->data) & (c->constant_slot_count - 1);
+            while (c->constant_slots[h] != 0)
+            {
+                h = (h + 1) & (c->constant_slot_count - 1);
+            }
+            c->constant_slots[h] = old_slots[i];
+        }
+    }
+    free(old_slots);
+}
+
+// numbers and strings are immutable, so equal constants share one object
+static int make_constant(compiler_t *c, object_type_t type, void *data)
+{
+    if (c->chunk->constant_count * 2 >= c->constant_slot_count)
+    {
+        grow_constant_slots(c);
+    }
+    unsigned h = hash_constant(type, data) & (c->constant_slot_count - 1);
+    while (c->constant_slots[h] != 0)
+    {
+        object_t *obj = c->chunk->constants[c->constant_slots[h] - 1];
+        if (same_constant(obj, type, data))
+        {
+            return c->constant_slots[h] - 1;
+        }
+        h = (h + 1) & (c->constant_slot_count - 1);
+    }
+    object_t *obj = create_object(c->rt, type);
+    obj->data = data;
+    c->constant_slots[h] = append_constant(c, obj) + 1;
+    return c->constant_slots[h] - 1;
+}
+
+static int make_name(compiler_t *c, char *name)
+{
+    return make_constant(c, OBJ_STRING, name);
+}
+
+static int make_cache(compiler_t *c)
+{
+    chunk_t *chunk = c->chunk;
+    if (chunk->cache_count > MAX_OPERAND)
+    {
+        compile_error("too many property accesses");
+    }
+    if (chunk->cache_count == chunk->cache_capacity)
+    {
+        chunk->cache_capacity = chunk->cache_capacity ? chunk->cache_capacity * 2 : 8;
+        chunk->caches = (property_cache_t *)realloc(chunk->caches, chunk->cache_capacity * sizeof(property_cache_t));
+    }
+    memset(&chunk->caches[chunk->cache_count], 0, sizeof(property_cache_t));
+    return chunk->cache_count++;
+}
+
+static void emit_property_op(compiler_t *c, opcode_t op, char *name)
+{
+    emit_op(c, op, make_name(c, name));
+    emit_short(c, make_cache(c));
+}
+
+static void compile_get(compiler_t *c, address_t *address, char *name)
+{
+    if (DEPTH_NONE == address->depth)
+    {
+        emit_op(c, OP_GET_FUNCTION, make_name(c, name));
+    }
+    else if (DEPTH_GLOBAL == address->depth)
+    {
+        emit_op(c, OP_GET_GLOBAL, address->slot);
+    }
+    else if (0 == address->depth)
+    {
+        emit_op(c, OP_GET_LOCAL, address->slot);
+    }
+    else
+    {
+        emit_op(c, OP_GET_UPVALUE, address->slot);
+    }
+}
+
+static void compile_set(compiler_t *c, address_t *address)
+{
+    if (DEPTH_NONE == address->depth)
+    {
+        compile_error("invalid assignment");
+    }
+    else if (DEPTH_GLOBAL == address->depth)
+    {
+        emit_op(c, OP_SET_GLOBAL, address->slot);
+    }
+    else if (0 == address->depth)
+    {
+        emit_op(c, OP_SET_LOCAL, address->slot);
+    }
+    else
+    {
+        emit_op(c, OP_SET_UPVALUE, address->slot);
+    }
+}
+
+static void compile_arguments(compiler_t *c, vector_t *arguments)
+{
+    int argc = vector_count(arguments);
+    if (argc > 0xff)
+    {
+        compile_error("too many arguments");
+    }
+    for (int i = 0; i < argc; i++)
+    {
+        compile_expression(c, vector_get(arguments, i));
+    }
+}
+
+// calls are linked by the resolver, only calls of variables look anything
+// up at runtime
+static void compile_funccall(compiler_t *c, funccall_t *f)
+{
+    bool tail = f->tail && c->in_function;
+    if (CALL_DYNAMIC == f->kind)
+    {
+        compile_get(c, &f->address, f->function_name);
+        compile_arguments(c, f->arguments);
+        emit_byte(c, tail ? OP_TAIL_CALL_VALUE : OP_CALL_VALUE);
+    }
+    else
+    {
+        compile_arguments(c, f->arguments);
+        if (CALL_BUILTIN == f->kind)
+        {
+            emit_op(c, OP_CALL_BUILTIN, f->builtin);
+        }
+        else
+        {
+            emit_op(c, tail ? OP_TAIL_CALL_FUNCTION : OP_CALL_FUNCTION, make_constant(c, OBJ_FUNCTION, f->function));
+        }
+    }
+    emit_byte(c, vector_count(f->arguments));
+}
+
+static void compile_invoke(compiler_t *c, funccall_t *f)
+{
+    compile_arguments(c, f->arguments);
+    emit_property_op(c, OP_INVOKE, f->function_name);
+    emit_byte(c, vector_count(f->arguments));
+}
+
+// compiles one link after a dot, the base object is on the stack
+static void compile_property_link(compiler_t *c, value_t *v)
+{
+    if (VT_FUNCCALL == v->type)
+    {
+        compile_invoke(c, v->value);
+    }
+    else if (VT_LISTINDEX == v->type)
+    {
+        listindex_t *listindex = v->value;
+        emit_property_op(c, OP_GET_PROP, listindex->name);
+        compile_expression(c, listindex->index);
+        emit_byte(c, OP_INDEX);
+    }
+    else if (VT_IDENT == v->type)
+    {
+        emit_property_op(c, OP_GET_PROP, v->value);
+    }
+    else
+    {
+        compile_error("invalid property access");
+    }
+}
+
+static void compile_value(compiler_t *c, value_t *v)
+{
+    if (VT_CNUMBER == v->type)
+    {
+        emit_op(c, OP_CONST, make_constant(c, OBJ_NUMBER, v->value));
+    }
+    else if (VT_CSTRING == v->type)
+    {
+        emit_op(c, OP_CONST, make_constant(c, OBJ_STRING, v->value));
+    }
+    else if (VT_LIST == v->type)
+    {
+        vector_t *items = v->value;
+        for (int i = 0; i < vector_count(items); i++)
+        {
+            compile_value(c, vector_get(items, i));
+        }
+        emit_op(c, OP_NEW_LIST, vector_count(items));
+    }
+    else if (VT_LISTINDEX == v->type)
+    {
+        listindex_t *listindex = v->value;
+        compile_get(c, &listindex->address, listindex->name);
+        compile_expression(c, listindex->index);
+        emit_byte(c, OP_INDEX);
+    }
+    else if (VT_INLINE_OBJ == v->type)
+    {
+        inlineobj_t *iobj = v->value;
+        emit_byte(c, OP_NEW_OBJECT);
+        for (int i = 0; i < vector_count(iobj->keys); i++)
+        {
+            compile_expression(c, vector_get(iobj->values, i));
+            emit_op(c, OP_INIT_PROP, make_name(c, vector_get(iobj->keys, i)));
+        }
+    }
+    else if (VT_FUNCCALL == v->type)
+    {
+        compile_funccall(c, v->value);
+    }
+    else if (VT_INLINE_FUNC == v->type)
+    {
+        object_t *obj = create_object(c->rt, OBJ_FUNCTION);
+        obj->data = v->value;
+        emit_op(c, OP_CLOSURE, append_constant(c, obj));
+    }
+    else if (VT_EXPRESSION == v->type)
+    {
+        compile_expression(c, v->value);
+    }
+    else if (VT_IDENT == v->type)
+    {
+        compile_get(c, &v->address, v->value);
+        for (value_t *sub = v->subvalue; sub != 0; sub = sub->subvalue)
+        {
+            compile_property_link(c, sub);
+        }
+    }
+}
+
+// compiles everything but the last link of a property chain and returns it
+static value_t *compile_property_base(compiler_t *c, value_t *v)
+{
+    compile_get(c, &v->address, v->value);
+    for (v = v->subvalue; v->subvalue != 0; v = v->subvalue)
+    {
+        compile_property_link(c, v);
+    }
+    return v;
+}
+
+static void compile_assignment(compiler_t *c, value_t *target, expression_t *e)
+{
+    if (VT_IDENT == target->type && target->subvalue == 0)
+    {
+        compile_expression(c, e);
+        compile_set(c, &target->address);
+        return;
+    }
+    if (VT_LISTINDEX == target->type)
+    {
+        listindex_t *listindex = target->value;
+        compile_get(c, &listindex->address, listindex->name);
+        compile_expression(c, listindex->index);
+        compile_expression(c, e);
+        emit_byte(c, OP_SET_INDEX);
+        return;
+    }
+    if (VT_IDENT == target->type)
+    {
+        value_t *last = compile_property_base(c, target);
+        if (VT_IDENT == last->type)
+        {
+            compile_expression(c, e);
+            emit_property_op(c, OP_SET_PROP, last->value);
+            return;
+        }
+        if (VT_LISTINDEX == last->type)
+        {
+            listindex_t *listindex = last->value;
+            emit_property_op(c, OP_GET_PROP, listindex->name);
+            compile_expression(c, listindex->index);
+            compile_expression(c, e);
+            emit_byte(c, OP_SET_INDEX);
+            return;
+        }
+        compile_property_link(c, last);
+        emit_byte(c, OP_POP);
+        compile_expression(c, e);
+        return;
+    }
+    // assigning to a temporary has no visible effect
+    compile_value(c, target);
+    emit_byte(c, OP_POP);
+    compile_expression(c, e);
+}
+
+static void compile_binary_op(compiler_t *c, token_type_t tok)
+{
+    switch (tok)
+    {
+    case TT_OP_ADD:
+        emit_byte(c, OP_ADD);
+        break;
+    case TT_OP_SUB:
+        emit_byte(c, OP_SUB);
+        break;
+    case TT_OP_MUL:
+        emit_byte(c, OP_MUL);
+        break;
+    case TT_OP_DIV:
+        emit_byte(c, OP_DIV);
+        break;
+    case TT_OP_GT:
+        emit_byte(c, OP_GT);
+        break;
+    case TT_OP_GTE:
+        emit_byte(c, OP_GTE);
+        break;
+    case TT_OP_LT:
+        emit_byte(c, OP_LT);
+        break;
+    case TT_OP_LTE:
+        emit_byte(c, OP_LTE);
+        break;
+    case TT_OP_EQUAL:
+        emit_byte(c, OP_EQUAL);
+        break;
+    case TT_OP_NOTEQUAL:
+        emit_byte(c, OP_NOTEQUAL);
+        break;
+    default:
+        emit_byte(c, OP_BINARY);
+        emit_byte(c, tok);
+    }
+}
+
+// expressions have no precedence, operators apply from left to right and
+// an assignment is always the last operator
+static void compile_expression(compiler_t *c, expression_t *e)
+{
+    int value_count = vector_count(e->values);
+    int last = value_count - 1;
+
+    if (value_count == 2 && (token_type_t)(intptr_t)vector_get(e->binaryops, 0) == TT_OP_ASSIGN)
+    {
+        compile_assignment(c, vector_get(e->values, 0), ((value_t *)vector_get(e->values, 1))->value);
+        return;
+    }
+    compile_value(c, vector_get(e->values, 0));
+    for (int i = 1; i < value_count; i++)
+    {
+        token_type_t tok = (token_type_t)(intptr_t)vector_get(e->binaryops, i - 1);
+        if (TT_OP_ASSIGN == tok && i == last)
+        {
+            emit_byte(c, OP_POP);
+            compile_value(c, vector_get(e->values, i));
+            break;
+        }
+        compile_value(c, vector_get(e->values, i));
+        compile_binary_op(c, tok);
+    }
+}
+
+static void compile_if(compiler_t *c, ifstatement_t *is)
+{
+    compile_expression(c, is->expression);
+    int else_jump = emit_jump(c, OP_JUMP_IF_FALSE);
+    compile_block(c, is->block);
+    if (is->else_block != 0)
+    {
+        int end_jump = emit_jump(c, OP_JUMP);
+        patch_jump(c, else_jump);
+        compile_block(c, is->else_block);
+        patch_jump(c, end_jump);
+    }
+    else
+    {
+        patch_jump(c, else_jump);
+    }
+}
+
+static void compile_while(compiler_t *c, whilestatement_t *ws)
+{
+    int loop_start = c->chunk->code_length;
+    compile_expression(c, ws->expression);
+    int exit_jump = emit_jump(c, OP_JUMP_IF_FALSE);
+    compile_block(c, ws->block);
+    emit_loop(c, loop_start, ws->expression->line_number);
+    patch_jump(c, exit_jump);
+}
+
+static void compile_statement(compiler_t *c, statement_t *s)
+{
+    if (s->type == ST_EXPRESSION)
+    {
+        compile_expression(c, s->value);
+        emit_byte(c, OP_POP);
+    }
+    else if (s->type == ST_WHILE)
+    {
+        compile_while(c, s->value);
+    }
+    else if (s->type == ST_IF)
+    {
+        compile_if(c, s->value);
+    }
+    else if (s->type == ST_RETURN)
+    {
+        compile_expression(c, s->value);
+        if (c->in_function)
+        {
+            emit_byte(c, OP_RETURN);
+        }
+        else
+        {
+            emit_byte(c, OP_POP);
+            vector_push(c->exit_jumps, (void *)(intptr_t)emit_jump(c, OP_JUMP));
+        }
+    }
+    else if (s->type == ST_PRINT)
+    {
+        compile_expression(c, s->value);
+        emit_byte(c, OP_PRINT);
+    }
+}
+
+static void compile_block(compiler_t *c, block_t *b)
+{
+    for (int i = 0; i < vector_count(b->statements); i++)
+    {
+        compile_statement(c, vector_get(b->statements, i));
+    }
+}
+
+static void init_compiler(compiler_t *c, runtime_t *rt, funcdef_t *fd)
+{
+    c->rt = rt;
+    c->chunk = create_chunk(rt);
+    c->in_function = fd != 0;
+    c->fd = fd;
+    c->exit_jumps = create_vector();
+    c->constant_slots = 0;
+    c->constant_slot_count = 0;
+}
+
+static chunk_t *finish_compiler(compiler_t *c)
+{
+    // falling off the end of a function returns 0
+    emit_op(c, OP_CONST, make_constant(c, OBJ_NUMBER, 0));
+    emit_byte(c, OP_RETURN);
+    destroy_vector(c->exit_jumps);
+    free(c->constant_slots);
+    return c->chunk;
+}
+
+chunk_t *compile_script(runtime_t *rt, vector_t *statements)
+{
+    compiler_t c;
+    init_compiler(&c, rt, 0);
+    for (int i = 0; i < vector_count(statements); i++)
+    {
+        compile_statement(&c, vector_get(statements, i));
+        while (vector_count(c.exit_jumps) > 0)
+        {
+            patch_jump(&c, (int)(intptr_t)vector_pop(c.exit_jumps));
+        }
+    }
+    return finish_compiler(&c);
+}
+
+chunk_t *compile_function(runtime_t *rt, funcdef_t *fd)
+{
+    compiler_t c;
+    init_compiler(&c, rt, fd);
+    init_jit_site(&c.chunk->calls, fd, fd->line_number);
+    compile_block(&c, fd->block);
+    return finish_compiler(&c);
+}
@@ -0,0 +1,85 @@
+#ifndef compiler_h
+#define compiler_h
+
+#include "jit.h"
+#include "parser.h"
+#include "runtime.h"
+
+// operands are 16 bit little endian unless noted otherwise
+typedef enum {
+    OP_CONST,         // constant
+    OP_POP,
+    OP_GET_LOCAL,     // slot
+    OP_SET_LOCAL,     // slot, setters leave the value on the stack
+    OP_GET_UPVALUE,   // capture index
+    OP_SET_UPVALUE,   // capture index
+    OP_GET_GLOBAL,    // slot
+    OP_SET_GLOBAL,    // slot
+    OP_GET_FUNCTION,  // name constant of a top level function
+    OP_GET_PROP,      // name constant, cache, obj -> value
+    OP_SET_PROP,      // name constant, cache, obj value -> value
+    OP_INIT_PROP,     // name constant, obj value -> obj
+    OP_INDEX,         // list index -> value
+    OP_SET_INDEX,     // list index value -> value
+    OP_NEW_OBJECT,
+    OP_NEW_LIST,      // element count
+    OP_CLOSURE,       // function constant
+    OP_CALL_BUILTIN,  // builtin id, 8 bit argument count
+    OP_CALL_FUNCTION, // function constant, 8 bit argument count
+    OP_CALL_VALUE,    // 8 bit argument count, callee below the arguments
+    OP_INVOKE,        // name constant, cache, 8 bit argument count
+    OP_TAIL_CALL_FUNCTION, // like OP_CALL_FUNCTION, the callee replaces the caller
+    OP_TAIL_CALL_VALUE,    // like OP_CALL_VALUE, the callee replaces the caller
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_GT,
+    OP_GTE,
+    OP_LT,
+    OP_LTE,
+    OP_EQUAL,
+    OP_NOTEQUAL,
+    OP_BINARY,        // 8 bit token type, for the rarely used operators
+    // the operators above rewrite themselves into these once they saw the
+    // types of their operands, and back when the types change
+    OP_ADD_NUMBER,
+    OP_SUB_NUMBER,
+    OP_MUL_NUMBER,
+    OP_GT_NUMBER,
+    OP_GTE_NUMBER,
+    OP_LT_NUMBER,
+    OP_LTE_NUMBER,
+    OP_EQUAL_NUMBER,
+    OP_NOTEQUAL_NUMBER,
+    OP_ADD_STRING,
+    OP_EQUAL_STRING,
+    OP_NOTEQUAL_STRING,
+    OP_JUMP,          // forward offset
+    OP_JUMP_IF_FALSE, // forward offset, pops the condition
+    OP_LOOP,          // loop site, backward offset
+    OP_PRINT,
+    OP_RETURN,
+} opcode_t;
+
+typedef struct _chunk_t {
+    unsigned char *code;
+    int code_length;
+    int code_capacity;
+    object_t **constants;
+    int constant_count;
+    int constant_capacity;
+    property_cache_t *caches; // inline caches of the property instructions
+    int cache_count;
+    int cache_capacity;
+    jit_site_t *loops;  // the while loops, counted by their OP_LOOP
+    int loop_count;
+    int loop_capacity;
+    jit_site_t calls;   // of the function the chunk is the body of
+} chunk_t;
+
+chunk_t *compile_script(runtime_t *rt, vector_t *statements);
+chunk_t *compile_function(runtime_t *rt, funcdef_t *fd);
+void destroy_chunk(runtime_t *rt, chunk_t *chunk);
+
+#endif // compiler_h
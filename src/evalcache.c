@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "evalcache.h"
+#include "serialize.h"
+#include "vm.h"
+
+#define EVAL_CACHE_SIZE 64
+
+typedef struct {
+    char *source; // 0 for a free entry
+    int length;
+    uint64_t hash;
+    funcdef_t *fd;  // function the snippet runs in, 0 on the top level
+    parser_t *parser;
+    chunk_t *chunk; // 0 for the tree walker
+    unsigned last_used;
+    int running;    // evals of the snippet under way, it is not evicted then
+} eval_entry_t;
+
+typedef struct _eval_cache_t {
+    eval_entry_t entries[EVAL_CACHE_SIZE];
+    unsigned clock;
+} eval_cache_t;
+
+static eval_entry_t *find_entry(eval_cache_t *c, const char *source, int length, uint64_t hash, funcdef_t *fd)
+{
+    for (int i = 0; i < EVAL_CACHE_SIZE; i++)
+    {
+        eval_entry_t *e = &c->entries[i];
+        if (e->source != 0 && e->hash == hash && e->fd == fd && e->length == length &&
+            memcmp(e->source, source, length) == 0)
+        {
+            return e;
+        }
+    }
+    return 0;
+}
+
+// the functions the snippet defined stay, they belong to the program now
+static void evict(runtime_t *rt, eval_entry_t *e)
+{
+    vector_t *statements = e->parser->ast->statement_list;
+    for (int i = 0; i < vector_count(statements); i++)
+    {
+        free_statement(vector_get(statements, i));
+    }
+    release_parser(e->parser);
+    free(e->parser);
+    if (e->chunk != 0)
+    {
+        destroy_chunk(rt, e->chunk);
+    }
+    free(e->source);
+    memset(e, 0, sizeof(eval_entry_t));
+}
+
+// a free entry or the least recently used one that is not running, 0 when
+// every entry is running
+static eval_entry_t *take_entry(runtime_t *rt, eval_cache_t *c)
+{
+    eval_entry_t *oldest = 0;
+    for (int i = 0; i < EVAL_CACHE_SIZE; i++)
+    {
+        eval_entry_t *e = &c->entries[i];
+        if (0 == e->source)
+        {
+            return e;
+        }
+        if (0 == e->running && (0 == oldest || e->last_used < oldest->last_used))
+        {
+            oldest = e;
+        }
+    }
+    if (oldest != 0)
+    {
+        evict(rt, oldest);
+    }
+    return oldest;
+}
+
+void eval_source(runtime_t *rt, const char *source)
+{
+    if (0 == rt->eval_cache)
+    {
+        rt->eval_cache = (eval_cache_t *)calloc(1, sizeof(eval_cache_t));
+    }
+    eval_cache_t *c = rt->eval_cache;
+    int length = strlen(source);
+    uint64_t hash = hash_bytes(source, length);
+    funcdef_t *fd = rt->current_scope->fd;
+
+    eval_entry_t *e = find_entry(c, source, length, hash, fd);
+    if (0 == e)
+    {
+        parser_t *p = (parser_t *)malloc(sizeof(parser_t));
+        init_parser(p, source, length);
+        parse(p);
+        resolve_in_scope(rt, p->ast);
+        e = take_entry(rt, c);
+        if (0 == e)
+        {
+            rt->execute(rt, p->ast->statement_list);
+            release_parser(p);
+            free(p);
+            return;
+        }
+        // the tree keeps no pointers into the text, it was parsed eagerly
+        e->source = (char *)malloc(length + 1);
+        memcpy(e->source, source, length + 1);
+        e->length = length;
+        e->hash = hash;
+        e->fd = fd;
+        e->parser = p;
+        p->source = e->source;
+        if (rt->stack != 0)
+        {
+            e->chunk = compile_script(rt, p->ast->statement_list);
+        }
+    }
+    e->last_used = ++c->clock;
+    e->running++;
+    if (e->chunk != 0)
+    {
+        vm_execute(rt, e->chunk);
+    }
+    else
+    {
+        rt->execute(rt, e->parser->ast->statement_list);
+    }
+    e->running--;
+}
+
+void destroy_eval_cache(runtime_t *rt)
+{
+    eval_cache_t *c = rt->eval_cache;
+    if (0 == c)
+    {
+        return;
+    }
+    for (int i = 0; i < EVAL_CACHE_SIZE; i++)
+    {
+        if (c->entries[i].source != 0)
+        {
+            evict(rt, &c->entries[i]);
+        }
+    }
+    free(c);
+    rt->eval_cache = 0;
+}
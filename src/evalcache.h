@@ -0,0 +1,13 @@
+#ifndef evalcache_h
+#define evalcache_h
+
+#include "runtime.h"
+
+// eval'd snippets are parsed, resolved and, for the vm, compiled once and
+// then kept in a small cache of the runtime. an entry is keyed by the text of
+// the snippet and the function it runs in, which decides how its names
+// resolve. the least recently used entry makes room for a new one.
+void eval_source(runtime_t *rt, const char *source);
+void destroy_eval_cache(runtime_t *rt);
+
+#endif // evalcache_h
@@ -0,0 +1,228 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "gc.h"
+
+#define MIN_NEXT_GC (1024 * 1024)
+
+// objects that are marked but not traced yet
+static object_t **gray;
+static int gray_count;
+static int gray_capacity;
+
+static void mark_object(object_t *obj)
+{
+    if (0 == obj || (obj->gc_flags & GC_MARKED))
+    {
+        return;
+    }
+    obj->gc_flags |= GC_MARKED;
+    if (gray_count == gray_capacity)
+    {
+        gray_capacity = gray_capacity ? gray_capacity * 2 : 256;
+        gray = (object_t **)realloc(gray, gray_capacity * sizeof(object_t *));
+    }
+    gray[gray_count++] = obj;
+}
+
+// the closure of a running function keeps the cells its scope uses
+static void mark_scope(runtime_t *rt, scope_t *s)
+{
+    if (s != 0 && s->gc_cycle != rt->gc_cycle)
+    {
+        s->gc_cycle = rt->gc_cycle;
+        for (int i = 0; i < s->slot_count; i++)
+        {
+            mark_object(s->slots[i]->obj);
+        }
+        mark_object(s->closure);
+    }
+}
+
+static int upvalue_count(object_t *obj)
+{
+    return obj->upvalues != 0 ? vector_count(((funcdef_t *)obj->data)->captures) : 0;
+}
+
+static void trace_object(runtime_t *rt, object_t *obj)
+{
+    if (OBJ_LIST == obj->type)
+    {
+        array_t *array = ARRAY(obj);
+        for (int i = 0; i < array->count; i++)
+        {
+            mark_object(array->items[i]);
+        }
+    }
+    for (int i = 0; i < obj->shape->slot_count; i++)
+    {
+        mark_object(obj->slots[i]->obj);
+    }
+    for (int i = 0; i < upvalue_count(obj); i++)
+    {
+        mark_object(obj->upvalues[i]->obj);
+    }
+}
+
+static void mark_roots(runtime_t *rt)
+{
+    mark_scope(rt, rt->global_scope);
+    mark_scope(rt, rt->current_scope);
+    scope_t **frames = (scope_t **)rt->scopes->buffer;
+    for (int i = 0; i < stack_get_count(rt->scopes); i++)
+    {
+        mark_scope(rt, frames[i]);
+    }
+    for (int i = 0; i < rt->temp_count; i++)
+    {
+        mark_object(rt->temp_blocks[i / TEMP_BLOCK_SIZE][i % TEMP_BLOCK_SIZE].obj);
+    }
+    for (int i = 0; i < rt->stack_top; i++)
+    {
+        mark_object(rt->stack[i]);
+    }
+    for (listitem_t *item = rt->chunks->head; item != 0; item = item->next)
+    {
+        chunk_t *chunk = item->data;
+        for (int i = 0; i < chunk->constant_count; i++)
+        {
+            mark_object(chunk->constants[i]);
+        }
+    }
+}
+
+static size_t object_size(object_t *obj)
+{
+    size_t size = sizeof(object_t);
+    size += obj->shape->slot_count * (sizeof(variable_t) + sizeof(variable_t *));
+    if (OBJ_LIST == obj->type)
+    {
+        size += sizeof(array_t) + ARRAY(obj)->capacity * sizeof(object_t *);
+    }
+    else if (obj->gc_flags & GC_OWNS_DATA)
+    {
+        size += strlen(obj->data) + 1;
+    }
+    return size + upvalue_count(obj) * sizeof(variable_t *);
+}
+
+// closures release their cells unless the whole runtime goes away
+static void free_object(runtime_t *rt, object_t *obj, int release_cells)
+{
+    if (OBJ_LIST == obj->type)
+    {
+        free(ARRAY(obj)->items);
+        free(obj->data);
+    }
+    else if (obj->gc_flags & GC_OWNS_DATA)
+    {
+        free(obj->data);
+    }
+    for (int i = 0; i < obj->shape->slot_count; i++)
+    {
+        pool_free(&rt->variable_pool, obj->slots[i]);
+    }
+    free(obj->slots);
+    for (int i = 0; release_cells && i < upvalue_count(obj); i++)
+    {
+        release_upvalue(rt, obj->upvalues[i]);
+    }
+    free(obj->upvalues);
+    pool_free(&rt->object_pool, obj);
+}
+
+void init_heap(runtime_t *rt, size_t heap_limit)
+{
+    rt->chunks = create_list();
+    rt->heap = 0;
+    rt->heap_bytes = 0;
+    rt->heap_limit = heap_limit;
+    rt->next_gc = heap_limit != 0 && heap_limit < MIN_NEXT_GC ? heap_limit : MIN_NEXT_GC;
+    rt->gc_cycle = 0;
+    memset(&rt->gc_stats, 0, sizeof(gc_stats_t));
+}
+
+void collect_garbage(runtime_t *rt)
+{
+    clock_t start = clock();
+    size_t live_bytes = 0;
+
+    if (rt->heap_bytes > rt->gc_stats.peak_bytes)
+    {
+        rt->gc_stats.peak_bytes = rt->heap_bytes;
+    }
+    rt->gc_cycle++;
+    mark_roots(rt);
+    while (gray_count > 0)
+    {
+        trace_object(rt, gray[--gray_count]);
+    }
+
+    object_t **link = &rt->heap;
+    while (*link != 0)
+    {
+        object_t *obj = *link;
+        if (obj->gc_flags & GC_MARKED)
+        {
+            obj->gc_flags &= ~GC_MARKED;
+            live_bytes += object_size(obj);
+            link = &obj->next;
+        }
+        else
+        {
+            *link = obj->next;
+            free_object(rt, obj, 1);
+            rt->gc_stats.freed_objects++;
+        }
+    }
+    rt->heap_bytes = live_bytes;
+    if (rt->heap_limit != 0 && live_bytes > rt->heap_limit)
+    {
+        fprintf(stderr, "out of memory: %zu bytes live, heap limit is %zu\n", live_bytes, rt->heap_limit);
+        exit(EXIT_FAILURE);
+    }
+    rt->next_gc = live_bytes * 2 > MIN_NEXT_GC ? live_bytes * 2 : MIN_NEXT_GC;
+    if (rt->heap_limit != 0 && rt->next_gc > rt->heap_limit)
+    {
+        rt->next_gc = rt->heap_limit;
+    }
+
+    double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+    rt->gc_stats.collections++;
+    rt->gc_stats.total_pause += pause;
+    if (pause > rt->gc_stats.max_pause)
+    {
+        rt->gc_stats.max_pause = pause;
+    }
+}
+
+void destroy_heap(runtime_t *rt)
+{
+    while (rt->heap != 0)
+    {
+        object_t *obj = rt->heap;
+        rt->heap = obj->next;
+        free_object(rt, obj, 0);
+    }
+    destroy_list(rt->chunks);
+    free(gray);
+    gray = 0;
+    gray_count = 0;
+    gray_capacity = 0;
+}
+
+void print_gc_stats(runtime_t *rt, FILE *f)
+{
+    gc_stats_t *stats = &rt->gc_stats;
+    if (rt->heap_bytes > stats->peak_bytes)
+    {
+        stats->peak_bytes = rt->heap_bytes;
+    }
+    fprintf(f, "gc: %d collections, %zu objects freed\n", stats->collections, stats->freed_objects);
+    fprintf(f, "gc: pause total %.3f ms, max %.3f ms, average %.3f ms\n",
+            stats->total_pause * 1000, stats->max_pause * 1000,
+            stats->collections ? stats->total_pause * 1000 / stats->collections : 0.0);
+    fprintf(f, "gc: %zu bytes in use, %zu bytes peak\n", rt->heap_bytes, stats->peak_bytes);
+}
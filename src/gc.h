@@ -0,0 +1,24 @@
+#ifndef gc_h
+#define gc_h
+
+#include <stdio.h>
+
+#include "runtime.h"
+
+// collections only run at safe points, where every live object is reachable
+// from the scopes, the temporaries, the vm stack or the constants of a chunk
+#define GC_SAFE_POINT(rt)                     \
+    do                                        \
+    {                                         \
+        if ((rt)->heap_bytes >= (rt)->next_gc) \
+        {                                     \
+            collect_garbage(rt);              \
+        }                                     \
+    } while (0)
+
+void init_heap(runtime_t *rt, size_t heap_limit);
+void collect_garbage(runtime_t *rt);
+void destroy_heap(runtime_t *rt);
+void print_gc_stats(runtime_t *rt, FILE *f);
+
+#endif // gc_h
@@ -1,16 +1,34 @@
 #define _GNU_SOURCE // for readline
+#include <ctype.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "builtins.h"
 #include "common.h"
+#include "compiler.h"
+#include "evalcache.h"
+#include "gc.h"
 #include "interpreter.h"
+#include "resolver.h"
 #include "runtime.h"
+#include "snapshot.h"
+#include "vm.h"
+
+static engine_t engine = ENGINE_VM;
+static size_t heap_limit = 0;
+static size_t stack_limit = 64 * 1024 * 1024;
+static bool gc_stats = false;
+static const char *snapshot_out = 0;
 
 static variable_t *int_block(runtime_t *rt, block_t *b);
+static int int_condition(runtime_t *rt, expression_t *e);
 static variable_t *int_expression(runtime_t *rt, expression_t *e);
 static variable_t *int_funccall(runtime_t *rt, funccall_t *f);
 static variable_t *int_if(runtime_t *rt, ifstatement_t *is);
+static int int_list_index(runtime_t *rt, variable_t *list, listindex_t *listindex);
+static variable_t *int_property(runtime_t *rt, variable_t *base, value_t *v);
 static variable_t *int_statement(runtime_t *rt, statement_t *s);
 static variable_t *int_value(runtime_t *rt, value_t *v);
 static variable_t *int_while(runtime_t *rt, whilestatement_t *ws);
@@ -18,9 +36,9 @@ static variable_t *int_while(runtime_t *rt, whilestatement_t *ws);
 static variable_t *int_block(runtime_t *rt, block_t *b)
 {
     variable_t *var = 0;
-    for (int i = 0; i < list_get_item_count(b->statements); i++)
+    for (int i = 0; i < vector_count(b->statements); i++)
     {
-        var = int_statement(rt, list_get_item(b->statements, i));
+        var = int_statement(rt, vector_get(b->statements, i));
         if (var != 0)
         {
             return var;
@@ -29,203 +47,245 @@ static variable_t *int_block(runtime_t *rt, block_t *b)
     return var;
 }
 
+// list elements are not variables, x[i] = v and o.x[i] = v store into the list
+static variable_t *int_store_element(runtime_t *rt, value_t *target, value_t *value)
+{
+    listindex_t *listindex;
+    variable_t *list;
+    if (VT_LISTINDEX == target->type)
+    {
+        listindex = target->value;
+        list = lookup_variable(rt, &listindex->address);
+    }
+    else
+    {
+        variable_t *base = lookup_variable(rt, &target->address);
+        value_t *last = target->subvalue;
+        for (; last->subvalue != 0; last = last->subvalue)
+        {
+            base = int_property(rt, base, last);
+        }
+        listindex = last->value;
+        create_temporary(rt, base->obj);
+        list = cached_property(rt, base->obj, listindex->name, last->cache);
+    }
+    int index = int_list_index(rt, list, listindex);
+    array_set(list->obj, index, int_value(rt, value)->obj);
+    return create_temporary(rt, create_object(rt, OBJ_NUMBER));
+}
+
+static bool is_element_target(value_t *v)
+{
+    if (VT_IDENT == v->type && v->subvalue != 0)
+    {
+        while (v->subvalue != 0)
+        {
+            v = v->subvalue;
+        }
+    }
+    return VT_LISTINDEX == v->type;
+}
+
+// runs the i-th operator of e in the form picked for the operand types it
+// saw last. a failed guard picks again, operators without a specialized form
+// for their types stay with binary_op.
+static variable_t *int_binary_op(runtime_t *rt, expression_t *e, int i, variable_t *var1, variable_t *var2, token_type_t tok)
+{
+    if (0 == e->quick)
+    {
+        e->quick = (unsigned char *)calloc(vector_count(e->binaryops), 1);
+    }
+    quick_op_t q = (quick_op_t)e->quick[i];
+    if (q > QUICK_GENERIC)
+    {
+        object_t *obj = quick_op(rt, q, var1->obj, var2->obj);
+        if (obj != 0)
+        {
+            return create_temporary(rt, obj);
+        }
+        q = QUICK_NONE;
+    }
+    if (QUICK_NONE == q)
+    {
+        e->quick[i] = (unsigned char)quicken_op(var1->obj, var2->obj, tok);
+    }
+    return create_temporary(rt, binary_op(rt, var1->obj, var2->obj, tok));
+}
+
 static variable_t *int_expression(runtime_t *rt, expression_t *e)
 {
-    value_t *v0 = (value_t *)list_get_item(e->values, 0);
-    variable_t *var0 = int_value(rt, v0);
+    value_t *v0 = (value_t *)vector_get(e->values, 0);
+    variable_t *var0;
+    bool is_assignment = vector_count(e->values) == 2 &&
+                         TT_OP_ASSIGN == (token_type_t)vector_get(e->binaryops, 0);
+    if (is_assignment && is_element_target(v0))
+    {
+        return int_store_element(rt, v0, vector_get(e->values, 1));
+    }
+    if (is_assignment && VT_IDENT == v0->type && v0->subvalue == 0)
+    {
+        var0 = lookup_variable(rt, &v0->address);
+    }
+    else
+    {
+        var0 = int_value(rt, v0);
+    }
     variable_t *var = var0;
 
-    for (int i = 1; i < list_get_item_count(e->values); i++)
+    for (int i = 1; i < vector_count(e->values); i++)
     {
         value_t *v;
         variable_t *var1;
 
-        v = (value_t *)list_get_item(e->values, i);
+        v = (value_t *)vector_get(e->values, i);
         var1 = int_value(rt, v);
-        token_type_t tok = (token_type_t)list_get_item(e->binaryops, i - 1);
+        token_type_t tok = (token_type_t)vector_get(e->binaryops, i - 1);
 
-        var = call_variable_op(rt, var, var1, tok);
+        if (TT_OP_ASSIGN == tok)
+        {
+            var = call_variable_op(rt, var, var1, tok);
+        }
+        else
+        {
+            var = int_binary_op(rt, e, i - 1, var, var1, tok);
+        }
     }
     return var;
 }
 
-static variable_t *call_funcdef(runtime_t *rt, funccall_t *f, funcdef_t *fd, scope_t *scope, variable_t *this_var)
-{
-    variable_t *var = 0;
-
-    scope_t *sc = create_scope(rt);
+// a tail call returns this in place of a value, the pending call waits in
+// tail_scope for call_funcdef to run it
+static variable_t tail_call;
+static scope_t *tail_scope;
 
-    if (0 != scope)
+// creates the scope of a call and binds the arguments, which run in the
+// scope of the caller. the new scope is on the scope stack meanwhile so the
+// collector sees the arguments bound so far.
+static scope_t *enter_call(runtime_t *rt, funccall_t *f, funcdef_t *fd, object_t *closure, variable_t *this_var)
+{
+    check_native_stack(rt);
+    if (0 == fd->locals)
     {
-        for (int i = 0; i < list_get_item_count(scope->variables); i++)
-        {
-            variable_t *v = list_get_item(scope->variables, i);
-            if (strcmp(v->name, "this") != 0)
-            {
-                list_insert(sc->variables, v);
-            }
-        }
+        prepare_function(rt, fd);
     }
-
-    stack_push(rt->scopes, sc);
-    scope_t *prevsc = rt->current_scope;
-    rt->current_scope = sc;
-
-    if (list_get_item_count(fd->parameters) != list_get_item_count(f->arguments))
+    if (vector_count(fd->parameters) != vector_count(f->arguments))
     {
         fprintf(stderr, "argument count mismatch\n");
         exit(EXIT_FAILURE);
     }
-    for (int j = 0; j < list_get_item_count(fd->parameters); j++)
+    scope_t *sc = create_scope(rt, fd, closure);
+    stack_push(rt->scopes, &sc);
+    for (int j = 0; j < vector_count(fd->parameters); j++)
     {
-        vardecl_t *vd = list_get_item(fd->parameters, j);
-        variable_t *va = create_variable(rt, vd->name);
-
-        scope_t *tmpscope;
-        tmpscope = rt->current_scope;
-        rt->current_scope = prevsc;
-        variable_t *vtmp = int_expression(rt, list_get_item(f->arguments, j));
-        rt->current_scope = tmpscope;
-
-        va->obj = vtmp->obj;
+        vardecl_t *vd = vector_get(fd->parameters, j);
+        sc->slots[vd->slot]->obj = int_expression(rt, vector_get(f->arguments, j))->obj;
     }
-    if (this_var != 0)
+    if (this_var != 0 && fd->this_slot >= 0)
     {
-        variable_t *varthis = create_variable(rt, "this");
-        varthis->obj = this_var->obj;
+        sc->slots[fd->this_slot]->obj = this_var->obj;
     }
-    var = int_block(rt, fd->block);
+    return sc;
+}
 
+static void leave_scope(runtime_t *rt, scope_t *sc)
+{
     sc->reference_count -= 1;
     if (sc->reference_count == 0)
     {
-        destroy_scope(sc);
+        destroy_scope(rt, sc);
     }
     stack_pop(rt->scopes);
-    rt->current_scope = prevsc;
-
-    return var;
 }
 
-static void do_print(variable_t *var)
+static variable_t *call_funcdef(runtime_t *rt, funccall_t *f, funcdef_t *fd, object_t *closure, variable_t *this_var)
 {
-    if (OBJ_NUMBER == var->obj->type)
+    int mark = rt->temp_count;
+    scope_t *sc = enter_call(rt, f, fd, closure, this_var);
+    scope_t *prevsc = rt->current_scope;
+    rt->current_scope = sc;
+    variable_t *var = int_block(rt, fd->block);
+
+    // the callee of a tail call takes over the scope stack entry and the C
+    // frame of this call, tail recursion runs in constant space
+    while (&tail_call == var)
+    {
+        release_temporaries(rt, mark);
+        leave_scope(rt, sc);
+        sc = tail_scope;
+        stack_push(rt->scopes, &sc);
+        rt->current_scope = sc;
+        var = int_block(rt, sc->fd->block);
+    }
+
+    // hand the result to the caller in a temporary of its own
+    if (var != 0)
     {
-        printf("%d", (int)var->obj->data);
+        object_t *result = var->obj;
+        release_temporaries(rt, mark);
+        var = create_temporary(rt, result);
     }
-    else if (OBJ_STRING == var->obj->type)
+    else
     {
-        printf("%s", (char *)var->obj->data);
+        release_temporaries(rt, mark);
     }
+    leave_scope(rt, sc);
+    rt->current_scope = prevsc;
+
+    return var;
 }
 
-static variable_t *int_funccall(runtime_t *rt, funccall_t *f)
+// the function a call by name runs, closure is the object holding it if any
+static funcdef_t *find_callee(runtime_t *rt, funccall_t *f, object_t **closure)
 {
-    variable_t *var;
-
-    if (strcmp(f->function_name, "print") == 0)
+    *closure = 0;
+    if (CALL_FUNCTION == f->kind)
     {
-        var = int_expression(rt, list_get_item(f->arguments, 0));
-        do_print(var);
-        return var;
+        return f->function;
     }
-    if (strcmp(f->function_name, "println") == 0)
+    variable_t *var = lookup_variable(rt, &f->address);
+    if (0 == var->obj)
     {
-        var = int_expression(rt, list_get_item(f->arguments, 0));
-        do_print(var);
-        printf("\n");
-        return var;
-    }
-    if (strcmp(f->function_name, "gets") == 0)
-    {
-        variable_t *v = create_variable(rt, "#");
-        v->obj = create_object(rt, OBJ_STRING);
-        char *lineptr = NULL;
-#ifdef _WIN32
-        lineptr = (char *)malloc(1024);
-        gets(lineptr);
-#else
-        size_t n = 0;
-        size_t m = getline(&lineptr, &n, stdin);
-        lineptr[m - 1] = '\0';
-#endif
-        v->obj->data = lineptr;
-        return v;
-    }
-    if (strcmp(f->function_name, "env") == 0)
-    {
-        var = int_expression(rt, list_get_item(f->arguments, 0));
-        variable_t *v = create_variable(rt, "#");
-        v->obj = create_object(rt, OBJ_STRING);
-        v->obj->data = getenv(var->obj->data);
-        return v;
-    }
-    if (strcmp(f->function_name, "len") == 0)
-    {
-        var = int_expression(rt, list_get_item(f->arguments, 0));
-        if (var->obj->type != OBJ_LIST)
+        // a function eval defined after the call was linked
+        funcdef_t *fd = DEPTH_GLOBAL == f->address.depth ? find_function(rt, f->function_name) : 0;
+        if (0 == fd)
         {
-            fprintf(stderr, "len expects list as argument %d given\n", var->obj->type);
+            fprintf(stderr, "no such function: %s\n", f->function_name);
             exit(EXIT_FAILURE);
         }
-        variable_t *v = create_variable(rt, "#");
-        v->obj = create_object(rt, OBJ_NUMBER);
-        v->obj->data = (void *)list_get_item_count(var->obj->data);
-        return v;
-    }
-    if (strcmp(f->function_name, "eval") == 0)
-    {
-        var = int_expression(rt, list_get_item(f->arguments, 0));
-        parser_t *p = (parser_t *)malloc(sizeof(parser_t));
-        init_parser(p, (char *)var->obj->data);
-        parse(p);
-
-        // merge functions to current runtime
-        for (int i = 0; i < list_get_item_count(p->ast->function_list); i++)
-        {
-            list_insert(rt->ast->function_list, list_get_item(p->ast->function_list, i));
-        }
-
-        for (int i = 0; i < list_get_item_count(p->ast->statement_list); i++)
-        {
-            int_statement(rt, list_get_item(p->ast->statement_list, i));
-        }
-        release_parser(p);
-        free(p);
-
-        variable_t *v = create_variable(rt, "#");
-        v->obj = create_object(rt, OBJ_STRING);
-        v->obj->data = var->obj->data;
-        return v;
+        return fd;
     }
+    *closure = var->obj;
+    return (funcdef_t *)var->obj->data;
+}
 
-    for (int i = 0; i < list_get_item_count(rt->ast->function_list); i++)
+static variable_t *int_funccall(runtime_t *rt, funccall_t *f)
+{
+    if (CALL_BUILTIN == f->kind)
     {
-        funcdef_t *fd = list_get_item(rt->ast->function_list, i);
-        if (strcmp(f->function_name, fd->name) == 0)
+        int argc = vector_count(f->arguments);
+        object_t *args[argc + 1];
+        for (int i = 0; i < argc; i++)
         {
-            return call_funcdef(rt, f, fd, 0, 0);
+            // temporaries keep the arguments alive while the others run
+            args[i] = create_temporary(rt, int_expression(rt, vector_get(f->arguments, i))->obj)->obj;
         }
+        return create_temporary(rt, call_builtin(rt, f->builtin, args, argc));
     }
-    var = get_variable(rt, f->function_name);
-    if (0 == var)
-    {
-        fprintf(stderr, "no such function: %s\n", f->function_name);
-        exit(EXIT_FAILURE);
-    }
-    else
+    object_t *closure;
+    funcdef_t *fd = find_callee(rt, f, &closure);
+    if (f->tail)
     {
-        funcdef_t *fd = (funcdef_t *)var->obj->data;
-        scope_t *scope = (scope_t *)var->obj->scope;
-        return call_funcdef(rt, f, fd, scope, 0);
+        tail_scope = enter_call(rt, f, fd, closure, 0);
+        stack_pop(rt->scopes);
+        return &tail_call;
     }
+    return call_funcdef(rt, f, fd, closure, 0);
 }
 
 static variable_t *int_if(runtime_t *rt, ifstatement_t *is)
 {
-    variable_t *var = int_expression(rt, is->expression);
     variable_t *rv = 0;
-    if ((int)var->obj->data)
+    if (int_condition(rt, is->expression))
     {
         rv = int_block(rt, is->block);
     }
@@ -239,6 +299,8 @@ static variable_t *int_if(runtime_t *rt, ifstatement_t *is)
 static variable_t *int_statement(runtime_t *rt, statement_t *s)
 {
     variable_t *var = 0;
+    int mark = rt->temp_count;
+    GC_SAFE_POINT(rt);
     if (s->type == ST_EXPRESSION)
     {
         int_expression(rt, s->value);
@@ -257,66 +319,88 @@ static variable_t *int_statement(runtime_t *rt, statement_t *s)
     }
     else if (s->type == ST_PRINT)
     {
-        do_print(int_expression(rt, s->value));
+        print_object(int_expression(rt, s->value)->obj);
+    }
+    if (var == 0)
+    {
+        release_temporaries(rt, mark);
     }
     return var;
 }
 
+// one link of a property chain, base is the object before the dot
+// keeps the list alive while the index expression runs
+static int int_list_index(runtime_t *rt, variable_t *list, listindex_t *listindex)
+{
+    create_temporary(rt, list->obj);
+    variable_t *index = int_expression(rt, listindex->index);
+    if (0 == list->obj || OBJ_LIST != list->obj->type || OBJ_NUMBER != index->obj->type)
+    {
+        fprintf(stderr, "invalid list index\n");
+        exit(EXIT_FAILURE);
+    }
+    return NUMBER_VALUE(index->obj);
+}
+
+static variable_t *int_property(runtime_t *rt, variable_t *base, value_t *v)
+{
+    if (VT_FUNCCALL == v->type)
+    {
+        funccall_t *fc = v->value;
+        // the cells handed out below belong to base->obj, keep it alive
+        // while the rest of the expression runs
+        create_temporary(rt, base->obj);
+        variable_t *vp = cached_property(rt, base->obj, fc->function_name, v->cache);
+        return call_funcdef(rt, fc, vp->obj->data, vp->obj, base);
+    }
+    if (VT_LISTINDEX == v->type)
+    {
+        listindex_t *listindex = v->value;
+        create_temporary(rt, base->obj);
+        variable_t *list = cached_property(rt, base->obj, listindex->name, v->cache);
+        int index = int_list_index(rt, list, listindex);
+        return create_temporary(rt, array_get(list->obj, index));
+    }
+    create_temporary(rt, base->obj);
+    return cached_property(rt, base->obj, (char *)v->value, v->cache);
+}
+
 static variable_t *int_value(runtime_t *rt, value_t *v)
 {
     variable_t *var = NULL;
 
     if (VT_CNUMBER == v->type)
     {
-        var = create_variable(rt, "#");
-        var->obj = create_object(rt, OBJ_NUMBER);
-        var->obj->reference_count += 1;
+        var = create_temporary(rt, create_object(rt, OBJ_NUMBER));
         var->obj->data = v->value;
     }
     else if (VT_CSTRING == v->type)
     {
-        var = create_variable(rt, "#");
-        var->obj = create_object(rt, OBJ_STRING);
-        var->obj->reference_count += 1;
+        var = create_temporary(rt, create_object(rt, OBJ_STRING));
         var->obj->data = v->value;
     }
     else if (VT_LIST == v->type)
     {
-        var = create_variable(rt, "#");
-        var->obj = create_object(rt, OBJ_LIST);
-        var->obj->reference_count += 1;
-        var->obj->data = create_list();
-        for (int i = 0; i < list_get_item_count((list_t *)v->value); i++)
+        var = create_temporary(rt, create_list_object(rt, vector_count(v->value)));
+        for (int i = 0; i < vector_count((vector_t *)v->value); i++)
         {
-            list_insert((list_t *)var->obj->data, int_value(rt, list_get_item(v->value, i)));
+            array_push(rt, var->obj, int_value(rt, vector_get(v->value, i))->obj);
         }
     }
     else if (VT_LISTINDEX == v->type)
     {
         listindex_t *listindex = (listindex_t *)v->value;
-        var = get_variable(rt, listindex->name);
-        if (0 == var)
-        {
-        }
-        else
-        {
-            variable_t *v = int_expression(rt, listindex->index);
-            if (OBJ_NUMBER == v->obj->type)
-            {
-                return list_get_item(var->obj->data, (int)v->obj->data);
-            }
-        }
+        var = lookup_variable(rt, &listindex->address);
+        int index = int_list_index(rt, var, listindex);
+        return create_temporary(rt, array_get(var->obj, index));
     }
     else if (VT_INLINE_OBJ == v->type)
     {
-        var = create_variable(rt, "#");
-        var->obj = create_object(rt, OBJ_BASE);
-        var->obj->reference_count = 1;
-        var->obj->data = 0;
+        var = create_temporary(rt, create_object(rt, OBJ_BASE));
         inlineobj_t *iobj = v->value;
-        for (int i = 0; i < list_get_item_count(iobj->keys); i++)
+        for (int i = 0; i < vector_count(iobj->keys); i++)
         {
-            set_property(rt, var->obj, list_get_item(iobj->keys, i), int_expression(rt, list_get_item(iobj->values, i)));
+            set_property(rt, var->obj, vector_get(iobj->keys, i), int_expression(rt, vector_get(iobj->values, i)));
         }
         return var;
     }
@@ -326,13 +410,7 @@ static variable_t *int_value(runtime_t *rt, value_t *v)
     }
     else if (VT_INLINE_FUNC == v->type)
     {
-        var = create_variable(rt, "#");
-        var->obj = create_object(rt, OBJ_FUNCTION);
-        var->obj->reference_count = 1;
-        var->obj->data = v->value;
-        var->obj->scope = rt->current_scope;
-        rt->current_scope->reference_count += 1;
-        return var;
+        return create_temporary(rt, create_closure(rt, v->value));
     }
     else if (VT_EXPRESSION == v->type)
     {
@@ -340,79 +418,257 @@ static variable_t *int_value(runtime_t *rt, value_t *v)
     }
     else if (VT_IDENT == v->type)
     {
-        var = get_variable(rt, (char *)v->value);
-        if (0 == var)
+        var = DEPTH_NONE == v->address.depth ? 0 : lookup_variable(rt, &v->address);
+        funcdef_t *fd;
+        if ((0 == var || (0 == var->obj && DEPTH_GLOBAL == v->address.depth)) &&
+            0 != (fd = find_function(rt, v->value)))
         {
-            for (int i = 0; i < list_get_item_count(rt->ast->function_list); i++)
-            {
-                funcdef_t *f = list_get_item(rt->ast->function_list, i);
-                if (strcmp((char *)v->value, f->name) == 0)
-                {
-                    var = create_variable(rt, (char *)v->value);
-                    var->obj = create_object(rt, OBJ_FUNCTION);
-                    var->obj->reference_count = 1;
-                    var->obj->data = f;
-                    return var;
-                }
-            }
-            var = create_variable(rt, (char *)v->value);
+            var = create_temporary(rt, create_object(rt, OBJ_FUNCTION));
+            var->obj->data = fd;
+            return var;
         }
-        else
+        for (value_t *sub = v->subvalue; sub != 0; sub = sub->subvalue)
         {
-            if (v->subvalue != 0)
-            {
-                if (v->subvalue->type != VT_FUNCCALL)
-                {
-                    variable_t *subvar = int_value(rt, v->subvalue);
-                    return get_property(rt, var, subvar->name);
-                }
-                else
-                {
-                    funccall_t *fc = v->subvalue->value;
-                    variable_t *vp = get_property(rt, var, fc->function_name);
-                    return call_funcdef(rt, fc, vp->obj->data, 0, var);
-                }
-            }
+            var = int_property(rt, var, sub);
         }
     }
     return var;
 }
 
+static int int_condition(runtime_t *rt, expression_t *e)
+{
+    int mark = rt->temp_count;
+    variable_t *var = int_expression(rt, e);
+    int cond = (int)var->obj->data;
+    release_temporaries(rt, mark);
+    return cond;
+}
+
 static variable_t *int_while(runtime_t *rt, whilestatement_t *ws)
 {
-    variable_t *var = int_expression(rt, ws->expression);
     variable_t *rv = 0;
 
-    while ((int)var->obj->data)
+    while (int_condition(rt, ws->expression))
     {
         rv = int_block(rt, ws->block);
         if (rv != 0)
         {
             return rv;
         }
-        var = int_expression(rt, ws->expression);
     }
     return rv;
 }
 
-void interpret(parser_t *p)
+static void int_statements(runtime_t *rt, vector_t *statements)
+{
+    for (int i = 0; i < vector_count(statements); i++)
+    {
+        int_statement(rt, vector_get(statements, i));
+    }
+}
+
+void set_engine(engine_t e)
+{
+    engine = e;
+}
+
+void set_heap_limit(size_t bytes)
+{
+    heap_limit = bytes;
+}
+
+void set_stack_limit(size_t bytes)
+{
+    stack_limit = bytes;
+}
+
+void set_gc_stats(bool enabled)
+{
+    gc_stats = enabled;
+}
+
+void set_snapshot_out(const char *path)
+{
+    snapshot_out = path;
+}
+
+static runtime_t *create_runtime(ast_t *ast)
 {
     runtime_t *rt = (runtime_t *)malloc(sizeof(runtime_t));
+    char native_stack_base;
 
+    init_pools(rt);
     rt->scopes = create_stack(sizeof(scope_t *));
-    rt->global_scope = create_scope(rt);
+    rt->empty_shape = create_shape();
+    rt->global_scope = create_scope(rt, 0, 0);
     rt->current_scope = rt->global_scope;
-    stack_push(rt->scopes, rt->current_scope);
-    rt->ast = p->ast;
+    stack_push(rt->scopes, &rt->current_scope);
+    rt->ast = ast;
+    grow_global_scope(rt);
+    rt->temp_blocks = 0;
+    rt->temp_block_count = 0;
+    rt->temp_count = 0;
+    rt->stack = 0;
+    rt->stack_top = 0;
+    rt->frames = 0;
+    rt->stack_limit = stack_limit;
+    init_native_stack(rt, &native_stack_base);
+    rt->eval_cache = 0;
+    init_heap(rt, heap_limit);
+
+    if (ENGINE_TREE == engine)
+    {
+        rt->execute = int_statements;
+    }
+    else
+    {
+        init_vm(rt);
+        rt->execute = vm_run;
+    }
+    return rt;
+}
 
-    for (int i = 0; i < list_get_item_count(p->ast->statement_list); i++)
+static void destroy_runtime(runtime_t *rt)
+{
+    destroy_eval_cache(rt);
+    if (rt->stack != 0)
     {
-        int_statement(rt, list_get_item(p->ast->statement_list, i));
+        release_vm(rt);
     }
     while (stack_get_count(rt->scopes) > 0)
     {
-        scope_t *sc = (scope_t *)stack_pop(rt->scopes);
-        destroy_scope(sc);
+        scope_t *sc = *(scope_t **)stack_pop(rt->scopes);
+        destroy_scope(rt, sc);
+    }
+    destroy_stack(rt->scopes);
+    if (gc_stats)
+    {
+        print_gc_stats(rt, stderr);
     }
+    print_jit_stats(stderr);
+    destroy_heap(rt);
+    destroy_temporaries(rt);
+    destroy_shape(rt->empty_shape);
+    destroy_pools(rt);
     free(rt);
 }
+
+void interpret(parser_t *p)
+{
+    runtime_t *rt = create_runtime(p->ast);
+    rt->execute(rt, p->ast->statement_list);
+    if (snapshot_out != 0)
+    {
+        save_snapshot(rt, snapshot_out);
+    }
+    destroy_runtime(rt);
+}
+
+// the entry is called like eval'd code would call it, so it is linked the
+// same way whether it is a top level function or a global holding a closure
+static void call_entry(runtime_t *rt, const char *entry)
+{
+    char source[256];
+    if (snprintf(source, sizeof(source), "%s()", entry) >= sizeof(source))
+    {
+        fprintf(stderr, "invalid entry function: %s\n", entry);
+        exit(EXIT_FAILURE);
+    }
+    for (const char *c = entry; *c != '\0'; c++)
+    {
+        if (!isalnum((unsigned char)*c) && *c != '_')
+        {
+            fprintf(stderr, "invalid entry function: %s\n", entry);
+            exit(EXIT_FAILURE);
+        }
+    }
+    parser_t *p = (parser_t *)malloc(sizeof(parser_t));
+    init_parser(p, source, strlen(source));
+    parse(p);
+    resolve_in_scope(rt, p->ast);
+    rt->execute(rt, p->ast->statement_list);
+    release_parser(p);
+    free(p);
+}
+
+void interpret_snapshot(const char *image, const char *entry)
+{
+    parser_t *p = (parser_t *)malloc(sizeof(parser_t));
+    init_parser(p, "", 0);
+    snapshot_t *s = open_snapshot(image, p->ast);
+    resolve(p->ast);
+    runtime_t *rt = create_runtime(p->ast);
+    restore_snapshot(s, rt);
+    close_snapshot(s);
+    call_entry(rt, entry);
+    destroy_runtime(rt);
+    release_parser(p);
+    free(p);
+}
+
+struct _stream_t {
+    parser_t program; // functions defined so far and the global names
+    runtime_t *rt;
+    int line;         // line the unread input starts on
+};
+
+stream_t *open_stream(void)
+{
+    stream_t *s = (stream_t *)malloc(sizeof(stream_t));
+    init_parser(&s->program, "", 0);
+    resolve(s->program.ast);
+    s->rt = create_runtime(s->program.ast);
+    s->line = 1;
+    return s;
+}
+
+// every item runs like eval'd code, its statements are freed right after
+static void run_item(runtime_t *rt, ast_t *item)
+{
+    resolve_in_scope(rt, item);
+    rt->execute(rt, item->statement_list);
+    for (int i = 0; i < vector_count(item->statement_list); i++)
+    {
+        free_statement(vector_get(item->statement_list, i));
+    }
+    item->statement_list->count = 0;
+    item->function_list->count = 0;
+}
+
+bool run_input(stream_t *s, const char *source, int length, bool *incomplete)
+{
+    parser_t p;
+    init_parser(&p, source, length);
+    bool parsed = parse_input(&p, incomplete);
+    if (parsed)
+    {
+        run_item(s->rt, p.ast);
+    }
+    release_parser(&p);
+    return parsed;
+}
+
+int run_stream(stream_t *s, const char *source, int length, bool at_end)
+{
+    parser_t p;
+    int used = 0;
+    init_parser(&p, source, length);
+    if (begin_items(&p, s->line, at_end))
+    {
+        while (parse_item(&p, at_end))
+        {
+            run_item(s->rt, p.ast);
+            used = parsed_length(&p, &s->line);
+        }
+        end_items(&p);
+    }
+    release_parser(&p);
+    return used;
+}
+
+void close_stream(stream_t *s)
+{
+    destroy_runtime(s->rt);
+    release_parser(&s->program);
+    free(s);
+}
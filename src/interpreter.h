@@ -1,8 +1,43 @@
 #ifndef interpreter_h
 #define interpreter_h
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "parser.h"
 
+typedef enum {
+    ENGINE_VM,
+    ENGINE_TREE,
+} engine_t;
+
+void set_engine(engine_t e);
+void set_heap_limit(size_t bytes);
+// bytes the call frames may take before a stack overflow
+void set_stack_limit(size_t bytes);
+void set_gc_stats(bool enabled);
+// when set, interpret writes a snapshot image once the top level ran
+void set_snapshot_out(const char *path);
 void interpret(parser_t *p);
 
+// restores a program and its heap from a snapshot image and calls the entry
+// function of it without arguments
+void interpret_snapshot(const char *image, const char *entry);
+
+// runs a program while it is still being read, one top level statement or
+// function at a time. run_stream runs the complete items at the start of
+// source and returns how many bytes they took, the rest has to be passed
+// again together with more input. at_end says no more input follows.
+typedef struct _stream_t stream_t;
+
+stream_t *open_stream(void);
+int run_stream(stream_t *s, const char *source, int length, bool at_end);
+void close_stream(stream_t *s);
+
+// runs a whole piece of source in the runtime of the stream, for the repl.
+// false on a syntax error, which is not printed but kept for
+// syntax_error_message. incomplete then tells whether the source ended
+// before the error showed, more input may fix it.
+bool run_input(stream_t *s, const char *source, int length, bool *incomplete);
+
 #endif // interpreter_h
@@ -0,0 +1,1254 @@
+#define _GNU_SOURCE // for MAP_ANONYMOUS and clock_gettime
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "compiler.h"
+#include "jit.h"
+
+#define JIT_THRESHOLD 1000  // back jumps or calls before a region gets compiled
+#define JIT_MAX_FAILURES 64 // failed checks before a region stays in the vm
+#define JIT_MAX_VARIABLES 256
+
+typedef enum {
+    VAR_LOCAL,
+    VAR_GLOBAL,
+    VAR_UPVALUE,
+} variable_kind_t;
+
+typedef struct {
+    variable_kind_t kind;
+    int index;
+    bool written;
+} jit_variable_t;
+
+struct _jit_code_t {
+    // the machine code uses these
+    int64_t iterations; // back jumps of a loop or calls of a function in machine code
+    char *bail_rsp;     // where a function call that ran out of stack returns to
+    char *stack_floor;
+
+    void *entry;          // 0 while the region is not compiled
+    size_t mapped;
+    const char *rejected; // why the region stays in the vm
+    bool is_function;
+    jit_variable_t *variables; // what a loop uses, the globals a function reads
+    int variable_count;
+    funcdef_t *fd;
+    int line;
+    int bytecode_length;
+    int code_length;
+
+    // statistics
+    int64_t entries;
+    int64_t guard_failures;
+    int64_t bails;
+    double native_time;
+    double *warmup; // seconds between runs of the site in the vm before compiling
+    int warmup_count;
+    double last_jump;
+    double vm_iteration; // the median of them
+    struct _jit_code_t *next;
+};
+
+static jit_mode_t mode = JIT_ON;
+static jit_code_t *regions; // for print_jit_stats, in the order they got hot
+static jit_code_t *last_region;
+
+void set_jit_mode(jit_mode_t m)
+{
+    mode = m;
+}
+
+void init_jit_site(jit_site_t *site, funcdef_t *fd, int line)
+{
+    site->count = JIT_OFF == mode ? JIT_NEVER : -JIT_THRESHOLD;
+    site->code = 0;
+    site->fd = fd;
+    site->line = line;
+}
+
+static void unmap_code(jit_code_t *code);
+
+void release_jit_site(jit_site_t *site)
+{
+    jit_code_t *code = site->code;
+    if (0 == code)
+    {
+        return;
+    }
+    unmap_code(code);
+    free(code->variables);
+    code->variables = 0;
+    free(code->warmup);
+    code->warmup = 0;
+    if (mode != JIT_STATS)
+    {
+        free(code);
+    }
+    site->code = 0;
+}
+
+static const char *region_owner(jit_code_t *code)
+{
+    if (0 == code->fd)
+    {
+        return "the top level";
+    }
+    return code->fd->name[0] == '#' ? "closure" : code->fd->name;
+}
+
+// the estimate compares the machine code against what the same work took in
+// the vm while the region warmed up: the median time of a back jump of a
+// loop, of a call of a function up to its next one. the latter also holds
+// what a caller does between calls, which a recursive function has little of.
+static double saved_time(jit_code_t *code)
+{
+    if (0 == code->vm_iteration)
+    {
+        return 0;
+    }
+    return code->iterations * code->vm_iteration - code->native_time;
+}
+
+void print_jit_stats(FILE *f)
+{
+    if (mode != JIT_STATS)
+    {
+        return;
+    }
+    int compiled = 0;
+    int rejected = 0;
+    double saved = 0;
+    while (regions != 0)
+    {
+        jit_code_t *code = regions;
+        regions = code->next;
+        char name[256];
+        if (code->is_function)
+        {
+            snprintf(name, sizeof(name), "function %s at line %d", region_owner(code), code->line);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "loop at line %d of %s", code->line, region_owner(code));
+        }
+        if (code->rejected != 0)
+        {
+            fprintf(f, "jit: %s stays in the vm: %s\n", name, code->rejected);
+            rejected++;
+        }
+        else if (code->code_length > 0)
+        {
+            double region_saved = saved_time(code);
+            fprintf(f, "jit: %s, %d bytes of bytecode to %d bytes of machine code\n",
+                    name, code->bytecode_length, code->code_length);
+            if (code->is_function)
+            {
+                fprintf(f, "jit:   %lld calls, %lld in machine code, %lld failed checks, %lld bailouts",
+                        (long long)code->entries, (long long)code->iterations, (long long)code->guard_failures,
+                        (long long)code->bails);
+            }
+            else
+            {
+                fprintf(f, "jit:   %lld entries, %lld iterations, %lld failed checks",
+                        (long long)code->entries, (long long)code->iterations, (long long)code->guard_failures);
+            }
+            fprintf(f, ", %.3f ms native, about %.3f ms saved\n", code->native_time * 1000, region_saved * 1000);
+            compiled++;
+            saved += region_saved;
+        }
+        free(code->warmup);
+        free(code);
+    }
+    last_region = 0;
+    fprintf(f, "jit: %d regions compiled, %d left in the vm, about %.3f ms saved\n", compiled, rejected, saved * 1000);
+}
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+static double now(void)
+{
+#ifdef _WIN32
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static jit_code_t *create_region(jit_site_t *site, bool is_function, int bytecode_length)
+{
+    jit_code_t *code = (jit_code_t *)calloc(1, sizeof(jit_code_t));
+    code->is_function = is_function;
+    code->fd = site->fd;
+    code->line = site->line;
+    code->bytecode_length = bytecode_length;
+    if (JIT_STATS == mode)
+    {
+        if (0 == last_region)
+        {
+            regions = code;
+        }
+        else
+        {
+            last_region->next = code;
+        }
+        last_region = code;
+    }
+    return code;
+}
+
+// values are ints kept zero extended in 64 bit slots, a local of a function
+// call that has no value yet holds this
+#define UNDEFINED INT64_MIN
+
+typedef int64_t (*loop_entry_t)(int64_t *values, jit_code_t *code);
+typedef int64_t (*function_entry_t)(int64_t *args, int64_t *globals, jit_code_t *code);
+
+typedef enum {
+    TARGET_BYTECODE, // a label of the region
+    TARGET_EXIT,     // leaves a loop for the bytecode offset
+    TARGET_UNDEFINED, // reports the local with the slot
+    TARGET_DIVISION,
+    TARGET_BAIL,
+    TARGET_BODY,
+} target_kind_t;
+
+typedef struct {
+    int at; // rel32 to patch
+    target_kind_t kind;
+    int value;
+} fixup_t;
+
+typedef struct {
+    unsigned char *code;
+    int length;
+    int capacity;
+    jit_code_t *region;
+    chunk_t *chunk;
+    funcdef_t *fd; // 0 for a loop
+    int start;     // bytecode range of the region
+    int end;
+    int *labels;   // machine code offset by bytecode offset, -1 until emitted
+    int *depths;   // operand stack depth there
+    fixup_t *fixups;
+    int fixup_count;
+    int fixup_capacity;
+    int depth;     // operands, the top one is in eax and the rest on the stack
+    int body;      // start of a function body
+    int init_locals;
+    bool *parameters; // slots of a function that are parameters
+    const char *rejected;
+} jit_compiler_t;
+
+static void undefined_variable(const char *name)
+{
+    fprintf(stderr, "undefined variable: %s\n", name);
+    exit(EXIT_FAILURE);
+}
+
+static void division_by_zero(void)
+{
+    fprintf(stderr, "Division by zero\n");
+    exit(EXIT_FAILURE);
+}
+
+static void emit(jit_compiler_t *c, const char *bytes, int n)
+{
+    if (c->length + n > c->capacity)
+    {
+        c->capacity = c->capacity ? c->capacity * 2 + n : 256 + n;
+        c->code = (unsigned char *)realloc(c->code, c->capacity);
+    }
+    memcpy(c->code + c->length, bytes, n);
+    c->length += n;
+}
+
+static void emit_int32(jit_compiler_t *c, int32_t value)
+{
+    emit(c, (const char *)&value, 4);
+}
+
+static void emit_int64(jit_compiler_t *c, int64_t value)
+{
+    emit(c, (const char *)&value, 8);
+}
+
+static void emit_pointer(jit_compiler_t *c, const char *op, int n, void *p)
+{
+    emit(c, op, n);
+    emit_int64(c, (int64_t)(intptr_t)p);
+}
+
+// an opcode with a rel32 operand to a target that is patched in the end
+static void emit_branch(jit_compiler_t *c, const char *op, int n, target_kind_t kind, int value)
+{
+    emit(c, op, n);
+    if (c->fixup_count == c->fixup_capacity)
+    {
+        c->fixup_capacity = c->fixup_capacity ? c->fixup_capacity * 2 : 32;
+        c->fixups = (fixup_t *)realloc(c->fixups, c->fixup_capacity * sizeof(fixup_t));
+    }
+    c->fixups[c->fixup_count].at = c->length;
+    c->fixups[c->fixup_count].kind = kind;
+    c->fixups[c->fixup_count].value = value;
+    c->fixup_count++;
+    emit_int32(c, 0);
+}
+
+static void reject(jit_compiler_t *c, const char *reason)
+{
+    if (0 == c->rejected)
+    {
+        c->rejected = reason;
+    }
+}
+
+static int find_variable(jit_compiler_t *c, variable_kind_t kind, int index)
+{
+    jit_code_t *region = c->region;
+    for (int i = 0; i < region->variable_count; i++)
+    {
+        if (region->variables[i].kind == kind && region->variables[i].index == index)
+        {
+            return i;
+        }
+    }
+    if (region->variable_count == JIT_MAX_VARIABLES)
+    {
+        reject(c, "too many variables");
+        return 0;
+    }
+    if (0 == region->variables)
+    {
+        region->variables = (jit_variable_t *)malloc(JIT_MAX_VARIABLES * sizeof(jit_variable_t));
+    }
+    jit_variable_t *v = &region->variables[region->variable_count];
+    v->kind = kind;
+    v->index = index;
+    v->written = false;
+    return region->variable_count++;
+}
+
+// pushes the operand in eax to make room for another one
+static void spill(jit_compiler_t *c)
+{
+    if (c->depth > 0)
+    {
+        emit(c, "\x50", 1); // push rax
+    }
+    c->depth++;
+}
+
+static void emit_constant(jit_compiler_t *c, int value)
+{
+    spill(c);
+    emit(c, "\xb8", 1); // mov eax, imm32
+    emit_int32(c, value);
+}
+
+// variables of a loop and locals of a function are slots at rbx
+static void emit_load(jit_compiler_t *c, int slot)
+{
+    spill(c);
+    emit(c, "\x8b\x83", 2); // mov eax, [rbx + disp32]
+    emit_int32(c, slot * 8);
+}
+
+static void emit_store(jit_compiler_t *c, int slot)
+{
+    emit(c, "\x48\x89\x83", 3); // mov [rbx + disp32], rax
+    emit_int32(c, slot * 8);
+}
+
+// a local of a function other than a parameter may still be undefined
+static void emit_load_local(jit_compiler_t *c, int slot)
+{
+    if (c->parameters[slot])
+    {
+        emit_load(c, slot);
+        return;
+    }
+    spill(c);
+    emit(c, "\x48\x8b\x83", 3); // mov rax, [rbx + disp32]
+    emit_int32(c, slot * 8);
+    emit(c, "\x48\x85\xc0", 3); // test rax, rax
+    emit_branch(c, "\x0f\x88", 2, TARGET_UNDEFINED, slot); // js
+}
+
+// the globals a function reads do not change while it runs, they are slots
+// at r12
+static void emit_load_global(jit_compiler_t *c, int index)
+{
+    spill(c);
+    emit(c, "\x41\x8b\x84\x24", 4); // mov eax, [r12 + disp32]
+    emit_int32(c, index * 8);
+}
+
+// leaves the left operand in eax and the right one in ecx
+static void emit_operands(jit_compiler_t *c)
+{
+    emit(c, "\x89\xc1", 2); // mov ecx, eax
+    emit(c, "\x58", 1);     // pop rax
+    c->depth--;
+}
+
+static void emit_compare(jit_compiler_t *c, char setcc)
+{
+    emit_operands(c);
+    emit(c, "\x39\xc8", 2); // cmp eax, ecx
+    char set[3] = {0x0f, setcc, (char)0xc0};
+    emit(c, set, 3);            // setcc al
+    emit(c, "\x0f\xb6\xc0", 3); // movzx eax, al
+}
+
+static void emit_division(jit_compiler_t *c)
+{
+    emit_operands(c);
+    emit(c, "\x85\xc9", 2); // test ecx, ecx
+    emit_branch(c, "\x0f\x84", 2, TARGET_DIVISION, 0);
+    // int_min / -1 wraps instead of trapping
+    emit(c, "\x83\xf9\xff", 3); // cmp ecx, -1
+    emit(c, "\x75\x04", 2);     // jne idiv
+    emit(c, "\xf7\xd8", 2);     // neg eax
+    emit(c, "\xeb\x03", 2);     // jmp done
+    emit(c, "\x99", 1);         // cdq
+    emit(c, "\xf7\xf9", 2);     // idiv ecx
+}
+
+// jumps need the operand stack at the statement level, where the compiler
+// puts them
+static void emit_jump(jit_compiler_t *c, const char *op, int n, int target)
+{
+    if (c->depth != 0)
+    {
+        reject(c, "jump inside an expression");
+        return;
+    }
+    if (target < c->start || target >= c->end)
+    {
+        if (0 == c->fd)
+        {
+            emit_branch(c, op, n, TARGET_EXIT, target);
+            return;
+        }
+        reject(c, "jump out of the function");
+        return;
+    }
+    emit_branch(c, op, n, TARGET_BYTECODE, target);
+}
+
+static void emit_function_return(jit_compiler_t *c)
+{
+    emit(c, "\x48\x8b\x5d\xf8", 4); // mov rbx, [rbp - 8]
+    emit(c, "\x48\x89\xec", 3);     // mov rsp, rbp
+    emit(c, "\x5d", 1);             // pop rbp
+    emit(c, "\xc3", 1);             // ret
+}
+
+static bool self_call(jit_compiler_t *c, funcdef_t *callee, int argc)
+{
+    if (0 == c->fd || callee != c->fd)
+    {
+        reject(c, "calls");
+        return false;
+    }
+    if (argc != vector_count(c->fd->parameters) || argc > c->depth)
+    {
+        reject(c, "argument count mismatch");
+        return false;
+    }
+    return true;
+}
+
+// the arguments are on the stack, the first one deepest. the callee reads
+// them through rdi.
+static void emit_call(jit_compiler_t *c, int argc)
+{
+    int stacked = c->depth;
+    if (c->depth > 0)
+    {
+        emit(c, "\x50", 1); // push rax
+    }
+    emit(c, "\x48\x89\xe7", 3); // mov rdi, rsp
+    int pad = stacked % 2 ? 8 : 0;
+    if (pad)
+    {
+        emit(c, "\x48\x83\xec\x08", 4); // sub rsp, 8
+    }
+    emit(c, "\xe8", 1); // call body
+    emit_int32(c, c->body - (c->length + 4));
+    if (argc * 8 + pad > 0)
+    {
+        emit(c, "\x48\x81\xc4", 3); // add rsp, imm32
+        emit_int32(c, argc * 8 + pad);
+    }
+    c->depth = stacked - argc + 1;
+}
+
+static void emit_tail_call(jit_compiler_t *c, int argc)
+{
+    if (c->depth != argc)
+    {
+        reject(c, "tail call inside an expression");
+        return;
+    }
+    if (c->depth > 0)
+    {
+        emit(c, "\x50", 1); // push rax
+    }
+    for (int i = 0; i < argc; i++)
+    {
+        vardecl_t *vd = vector_get(c->fd->parameters, i);
+        emit(c, "\x48\x8b\x8c\x24", 4); // mov rcx, [rsp + disp32]
+        emit_int32(c, (argc - 1 - i) * 8);
+        emit(c, "\x48\x89\x8b", 3); // mov [rbx + disp32], rcx
+        emit_int32(c, vd->slot * 8);
+    }
+    if (argc > 0)
+    {
+        emit(c, "\x48\x81\xc4", 3); // add rsp, imm32
+        emit_int32(c, argc * 8);
+    }
+    emit(c, "\xe9", 1); // jmp init_locals
+    emit_int32(c, c->init_locals - (c->length + 4));
+    // the return the compiler puts after it is never reached
+    c->depth = 1;
+}
+
+static int read_short(unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+// translates the bytecode of the region, the first unsupported instruction
+// rejects it
+static void compile_instructions(jit_compiler_t *c)
+{
+    unsigned char *code = c->chunk->code;
+    object_t **constants = c->chunk->constants;
+    bool in_function = c->fd != 0;
+    int pos = c->start;
+
+    while (pos < c->end && 0 == c->rejected)
+    {
+        unsigned char *ip = code + pos;
+        c->labels[pos - c->start] = c->length;
+        c->depths[pos - c->start] = c->depth;
+        switch (*ip)
+        {
+        case OP_CONST:
+        {
+            object_t *obj = constants[read_short(ip + 1)];
+            if (OBJ_NUMBER != obj->type)
+            {
+                reject(c, "strings");
+                break;
+            }
+            emit_constant(c, NUMBER_VALUE(obj));
+            pos += 3;
+            break;
+        }
+        case OP_POP:
+            if (c->depth > 1)
+            {
+                emit(c, "\x58", 1); // pop rax
+            }
+            c->depth--;
+            pos += 1;
+            break;
+        case OP_GET_LOCAL:
+            if (in_function)
+            {
+                emit_load_local(c, read_short(ip + 1));
+            }
+            else
+            {
+                emit_load(c, find_variable(c, VAR_LOCAL, read_short(ip + 1)));
+            }
+            pos += 3;
+            break;
+        case OP_SET_LOCAL:
+            if (in_function)
+            {
+                emit_store(c, read_short(ip + 1));
+            }
+            else
+            {
+                int v = find_variable(c, VAR_LOCAL, read_short(ip + 1));
+                c->region->variables[v].written = true;
+                emit_store(c, v);
+            }
+            pos += 3;
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        {
+            if (in_function)
+            {
+                reject(c, "captured variables");
+                break;
+            }
+            int v = find_variable(c, VAR_UPVALUE, read_short(ip + 1));
+            if (OP_SET_UPVALUE == *ip)
+            {
+                c->region->variables[v].written = true;
+                emit_store(c, v);
+            }
+            else
+            {
+                emit_load(c, v);
+            }
+            pos += 3;
+            break;
+        }
+        case OP_GET_GLOBAL:
+        {
+            int v = find_variable(c, VAR_GLOBAL, read_short(ip + 1));
+            if (in_function)
+            {
+                emit_load_global(c, v);
+            }
+            else
+            {
+                emit_load(c, v);
+            }
+            pos += 3;
+            break;
+        }
+        case OP_SET_GLOBAL:
+        {
+            if (in_function)
+            {
+                reject(c, "global assignment");
+                break;
+            }
+            int v = find_variable(c, VAR_GLOBAL, read_short(ip + 1));
+            c->region->variables[v].written = true;
+            emit_store(c, v);
+            pos += 3;
+            break;
+        }
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+            emit_operands(c);
+            emit(c, "\x01\xc8", 2); // add eax, ecx
+            pos += 1;
+            break;
+        case OP_SUB:
+        case OP_SUB_NUMBER:
+            emit_operands(c);
+            emit(c, "\x29\xc8", 2); // sub eax, ecx
+            pos += 1;
+            break;
+        case OP_MUL:
+        case OP_MUL_NUMBER:
+            emit_operands(c);
+            emit(c, "\x0f\xaf\xc1", 3); // imul eax, ecx
+            pos += 1;
+            break;
+        case OP_DIV:
+            emit_division(c);
+            pos += 1;
+            break;
+        case OP_GT:
+        case OP_GT_NUMBER:
+            emit_compare(c, (char)0x9f); // setg
+            pos += 1;
+            break;
+        case OP_GTE:
+        case OP_GTE_NUMBER:
+            emit_compare(c, (char)0x9d); // setge
+            pos += 1;
+            break;
+        case OP_LT:
+        case OP_LT_NUMBER:
+            emit_compare(c, (char)0x9c); // setl
+            pos += 1;
+            break;
+        case OP_LTE:
+        case OP_LTE_NUMBER:
+            emit_compare(c, (char)0x9e); // setle
+            pos += 1;
+            break;
+        case OP_EQUAL:
+        case OP_EQUAL_NUMBER:
+            emit_compare(c, (char)0x94); // sete
+            pos += 1;
+            break;
+        case OP_NOTEQUAL:
+        case OP_NOTEQUAL_NUMBER:
+            emit_compare(c, (char)0x95); // setne
+            pos += 1;
+            break;
+        case OP_JUMP:
+            pos += 3;
+            emit_jump(c, "\xe9", 1, pos + read_short(ip + 1));
+            c->depth = 0;
+            break;
+        case OP_JUMP_IF_FALSE:
+            pos += 3;
+            emit(c, "\x85\xc0", 2); // test eax, eax
+            c->depth--;
+            emit_jump(c, "\x0f\x84", 2, pos + read_short(ip + 1)); // jz
+            break;
+        case OP_LOOP:
+            pos += 5;
+            if (JIT_STATS == mode && !in_function && pos == c->end)
+            {
+                emit(c, "\x49\xff\x85", 3); // inc qword [r13 + iterations]
+                emit_int32(c, offsetof(jit_code_t, iterations));
+            }
+            emit_jump(c, "\xe9", 1, pos - read_short(ip + 3));
+            c->depth = 0;
+            break;
+        case OP_RETURN:
+            if (!in_function)
+            {
+                reject(c, "return");
+                break;
+            }
+            if (c->depth != 1)
+            {
+                reject(c, "return inside an expression");
+                break;
+            }
+            emit_function_return(c);
+            c->depth = 0;
+            pos += 1;
+            break;
+        case OP_CALL_FUNCTION:
+        case OP_TAIL_CALL_FUNCTION:
+        {
+            int argc = ip[3];
+            if (!self_call(c, constants[read_short(ip + 1)]->data, argc))
+            {
+                break;
+            }
+            if (OP_TAIL_CALL_FUNCTION == *ip)
+            {
+                emit_tail_call(c, argc);
+            }
+            else
+            {
+                emit_call(c, argc);
+            }
+            pos += 4;
+            break;
+        }
+        case OP_GET_FUNCTION:
+        case OP_CLOSURE:
+        case OP_CALL_BUILTIN:
+        case OP_CALL_VALUE:
+        case OP_INVOKE:
+        case OP_TAIL_CALL_VALUE:
+            reject(c, "calls");
+            break;
+        case OP_GET_PROP:
+        case OP_SET_PROP:
+        case OP_INIT_PROP:
+        case OP_NEW_OBJECT:
+            reject(c, "objects");
+            break;
+        case OP_INDEX:
+        case OP_SET_INDEX:
+        case OP_NEW_LIST:
+            reject(c, "lists");
+            break;
+        case OP_PRINT:
+            reject(c, "print");
+            break;
+        case OP_ADD_STRING:
+        case OP_EQUAL_STRING:
+        case OP_NOTEQUAL_STRING:
+            reject(c, "strings");
+            break;
+        default:
+            reject(c, "operators");
+            break;
+        }
+        if (c->depth < 0)
+        {
+            reject(c, "operand stack underflow");
+        }
+    }
+}
+
+// the code a fixup leads to when it is not a label of the region
+static int emit_stub(jit_compiler_t *c, fixup_t *f)
+{
+    int at = c->length;
+    switch (f->kind)
+    {
+    case TARGET_EXIT:
+        emit(c, "\xb8", 1); // mov eax, imm32
+        emit_int32(c, f->value);
+        emit(c, "\x41\x5d\x5b\x5d\xc3", 5); // pop r13, pop rbx, pop rbp, ret
+        break;
+    case TARGET_UNDEFINED:
+        emit(c, "\x48\x83\xe4\xf0", 4); // and rsp, -16
+        emit_pointer(c, "\x48\xbf", 2, c->fd->locals->items[f->value]); // mov rdi, name
+        emit_pointer(c, "\x48\xb8", 2, (void *)undefined_variable);      // mov rax, imm64
+        emit(c, "\xff\xd0", 2);                                          // call rax
+        break;
+    case TARGET_DIVISION:
+        emit(c, "\x48\x83\xe4\xf0", 4);
+        emit_pointer(c, "\x48\xb8", 2, (void *)division_by_zero);
+        emit(c, "\xff\xd0", 2);
+        break;
+    case TARGET_BAIL:
+        // back to the entry with -1, the call runs again in the vm
+        emit(c, "\x49\x8b\xa5", 3); // mov rsp, [r13 + bail_rsp]
+        emit_int32(c, offsetof(jit_code_t, bail_rsp));
+        emit(c, "\x48\xc7\xc0\xff\xff\xff\xff", 7); // mov rax, -1
+        emit(c, "\xc3", 1);
+        break;
+    default:
+        break;
+    }
+    return at;
+}
+
+static void resolve_fixups(jit_compiler_t *c)
+{
+    int fixup_count = c->fixup_count;
+    int *stubs = (int *)malloc(fixup_count * sizeof(int));
+    for (int i = 0; i < fixup_count && 0 == c->rejected; i++)
+    {
+        fixup_t *f = &c->fixups[i];
+        int target = -1;
+        if (TARGET_BYTECODE == f->kind)
+        {
+            target = c->labels[f->value - c->start];
+            if (target < 0 || c->depths[f->value - c->start] != 0)
+            {
+                reject(c, "unexpected jump target");
+                break;
+            }
+        }
+        else if (TARGET_BODY == f->kind)
+        {
+            target = c->body;
+        }
+        else
+        {
+            // stubs are shared by the fixups that lead to the same place
+            for (int j = 0; j < i; j++)
+            {
+                if (c->fixups[j].kind == f->kind && c->fixups[j].value == f->value)
+                {
+                    target = stubs[j];
+                    break;
+                }
+            }
+            if (target < 0)
+            {
+                target = emit_stub(c, f);
+            }
+        }
+        stubs[i] = target;
+        int32_t rel = target - (f->at + 4);
+        memcpy(c->code + f->at, &rel, 4);
+    }
+    free(stubs);
+}
+
+static void unmap_code(jit_code_t *code)
+{
+    if (code->entry != 0)
+    {
+        munmap(code->entry, code->mapped);
+        code->entry = 0;
+    }
+}
+
+static void map_code(jit_compiler_t *c)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (c->length + page - 1) / page * page;
+    void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == p)
+    {
+        reject(c, "no executable memory");
+        return;
+    }
+    memcpy(p, c->code, c->length);
+    if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(p, size);
+        reject(c, "no executable memory");
+        return;
+    }
+    c->region->entry = p;
+    c->region->mapped = size;
+    c->region->code_length = c->length;
+}
+
+static void init_compiler(jit_compiler_t *c, jit_code_t *region, chunk_t *chunk, funcdef_t *fd, int start, int end)
+{
+    memset(c, 0, sizeof(jit_compiler_t));
+    c->region = region;
+    c->chunk = chunk;
+    c->fd = fd;
+    c->start = start;
+    c->end = end;
+    c->labels = (int *)malloc((end - start) * sizeof(int));
+    c->depths = (int *)malloc((end - start) * sizeof(int));
+    for (int i = 0; i < end - start; i++)
+    {
+        c->labels[i] = -1;
+    }
+}
+
+static void finish_compiler(jit_compiler_t *c)
+{
+    if (0 == c->rejected)
+    {
+        resolve_fixups(c);
+    }
+    if (0 == c->rejected)
+    {
+        map_code(c);
+    }
+    if (c->rejected != 0)
+    {
+        c->region->rejected = c->rejected;
+    }
+    free(c->code);
+    free(c->labels);
+    free(c->depths);
+    free(c->fixups);
+    free(c->parameters);
+}
+
+// entered with the variables in rdi and the region in rsi, returns the
+// bytecode offset the loop exits to
+static void compile_loop(jit_code_t *region, chunk_t *chunk, int start, int end)
+{
+    jit_compiler_t c;
+    init_compiler(&c, region, chunk, 0, start, end);
+    emit(&c, "\x55", 1);             // push rbp
+    emit(&c, "\x48\x89\xe5", 3);     // mov rbp, rsp
+    emit(&c, "\x53\x41\x55", 3);     // push rbx, push r13
+    emit(&c, "\x48\x89\xfb", 3);     // mov rbx, rdi
+    emit(&c, "\x49\x89\xf5", 3);     // mov r13, rsi
+    compile_instructions(&c);
+    finish_compiler(&c);
+}
+
+// the entry saves what the body changes and remembers where to go back to
+// when the calls run out of stack. the body gets its arguments through rdi,
+// a frame with the locals at rbx and the globals at r12.
+static void compile_function_region(jit_code_t *region, funcdef_t *fd)
+{
+    chunk_t *chunk = fd->chunk;
+    jit_compiler_t c;
+    init_compiler(&c, region, chunk, fd, 0, chunk->code_length);
+    int slot_count = vector_count(fd->locals);
+    int argc = vector_count(fd->parameters);
+    c.parameters = (bool *)calloc(slot_count + 1, sizeof(bool));
+    for (int i = 0; i < argc; i++)
+    {
+        c.parameters[((vardecl_t *)vector_get(fd->parameters, i))->slot] = true;
+    }
+
+    emit(&c, "\x55\x53\x41\x54\x41\x55", 6); // push rbp, push rbx, push r12, push r13
+    emit(&c, "\x48\x83\xec\x08", 4);         // sub rsp, 8
+    emit(&c, "\x49\x89\xf4", 3);             // mov r12, rsi
+    emit(&c, "\x49\x89\xd5", 3);             // mov r13, rdx
+    emit(&c, "\x48\x8d\x44\x24\xf8", 5);     // lea rax, [rsp - 8]
+    emit(&c, "\x49\x89\x85", 3);             // mov [r13 + bail_rsp], rax
+    emit_int32(&c, offsetof(jit_code_t, bail_rsp));
+    emit_branch(&c, "\xe8", 1, TARGET_BODY, 0); // call body
+    emit(&c, "\x48\x83\xc4\x08", 4);            // add rsp, 8
+    emit(&c, "\x41\x5d\x41\x5c\x5b\x5d\xc3", 7); // pop r13, pop r12, pop rbx, pop rbp, ret
+
+    c.body = c.length;
+    int frame = slot_count * 8;
+    if (frame % 16 == 0)
+    {
+        frame += 8;
+    }
+    emit(&c, "\x55", 1);         // push rbp
+    emit(&c, "\x48\x89\xe5", 3); // mov rbp, rsp
+    emit(&c, "\x53", 1);         // push rbx
+    emit(&c, "\x48\x81\xec", 3); // sub rsp, frame
+    emit_int32(&c, frame);
+    emit(&c, "\x49\x3b\xa5", 3); // cmp rsp, [r13 + stack_floor]
+    emit_int32(&c, offsetof(jit_code_t, stack_floor));
+    emit_branch(&c, "\x0f\x82", 2, TARGET_BAIL, 0); // jb
+    emit(&c, "\x48\x89\xe3", 3);                    // mov rbx, rsp
+    for (int i = 0; i < argc; i++)
+    {
+        emit(&c, "\x48\x8b\x87", 3); // mov rax, [rdi + disp32]
+        emit_int32(&c, (argc - 1 - i) * 8);
+        emit_store(&c, ((vardecl_t *)vector_get(fd->parameters, i))->slot);
+    }
+    c.init_locals = c.length;
+    if (JIT_STATS == mode)
+    {
+        emit(&c, "\x49\xff\x85", 3); // inc qword [r13 + iterations]
+        emit_int32(&c, offsetof(jit_code_t, iterations));
+    }
+    if (argc < slot_count)
+    {
+        emit(&c, "\x48\xb8", 2); // mov rax, UNDEFINED
+        emit_int64(&c, UNDEFINED);
+        for (int i = 0; i < slot_count; i++)
+        {
+            if (!c.parameters[i])
+            {
+                emit_store(&c, i);
+            }
+        }
+    }
+    compile_instructions(&c);
+    finish_compiler(&c);
+}
+
+static void check_failed(jit_code_t *code, jit_site_t *site)
+{
+    if (++code->guard_failures >= JIT_MAX_FAILURES)
+    {
+        site->count = JIT_NEVER;
+    }
+}
+
+static int compare_seconds(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// what timing a back jump adds to it
+static double timing_overhead(void)
+{
+    static double overhead = -1;
+    if (overhead < 0)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            double t = now();
+            double elapsed = now() - t;
+            if (overhead < 0 || elapsed < overhead)
+            {
+                overhead = elapsed;
+            }
+        }
+    }
+    return overhead;
+}
+
+// --jit=stats times the runs of a loop or function in the vm before compiling
+// it, true once it has enough of them
+static bool warm_up(jit_code_t *code, jit_site_t *site)
+{
+    double t = now();
+    if (0 == code->warmup)
+    {
+        code->warmup = (double *)malloc(JIT_THRESHOLD * sizeof(double));
+    }
+    else
+    {
+        code->warmup[code->warmup_count++] = t - code->last_jump;
+    }
+    if (code->warmup_count == JIT_THRESHOLD)
+    {
+        qsort(code->warmup, code->warmup_count, sizeof(double), compare_seconds);
+        code->vm_iteration = code->warmup[code->warmup_count / 2] - timing_overhead();
+        return true;
+    }
+    site->count = -1;
+    code->last_jump = now();
+    return false;
+}
+
+static variable_t *resolve_variable(runtime_t *rt, jit_variable_t *v, variable_t **slots, variable_t **upvalues)
+{
+    if (VAR_LOCAL == v->kind)
+    {
+        return slots[v->index];
+    }
+    if (VAR_UPVALUE == v->kind)
+    {
+        return upvalues[v->index];
+    }
+    return rt->global_scope->slots[v->index];
+}
+
+static bool is_number(object_t *obj)
+{
+    return obj != 0 && OBJ_NUMBER == obj->type;
+}
+
+unsigned char *jit_loop(runtime_t *rt, chunk_t *chunk, jit_site_t *site, unsigned char *start, unsigned char *end,
+                        variable_t **slots, variable_t **upvalues)
+{
+    if (JIT_OFF == mode)
+    {
+        site->count = JIT_NEVER;
+        return start;
+    }
+    jit_code_t *code = site->code;
+    if (0 == code)
+    {
+        code = site->code = create_region(site, false, (int)(end - start));
+    }
+    if (0 == code->entry && 0 == code->rejected)
+    {
+        if (JIT_STATS == mode && !warm_up(code, site))
+        {
+            return start;
+        }
+        compile_loop(code, chunk, (int)(start - chunk->code), (int)(end - chunk->code));
+    }
+    if (0 == code->entry)
+    {
+        site->count = JIT_NEVER;
+        return start;
+    }
+    site->count = -1;
+
+    variable_t *vars[JIT_MAX_VARIABLES];
+    int64_t values[JIT_MAX_VARIABLES];
+    for (int i = 0; i < code->variable_count; i++)
+    {
+        vars[i] = resolve_variable(rt, &code->variables[i], slots, upvalues);
+        if (!is_number(vars[i]->obj))
+        {
+            check_failed(code, site);
+            return start;
+        }
+        for (int j = 0; j < i; j++)
+        {
+            if (vars[j] == vars[i])
+            {
+                check_failed(code, site);
+                return start;
+            }
+        }
+        values[i] = (uint32_t)NUMBER_VALUE(vars[i]->obj);
+    }
+
+    double t = JIT_STATS == mode ? now() : 0;
+    int64_t exit = ((loop_entry_t)code->entry)(values, code);
+    if (JIT_STATS == mode)
+    {
+        code->native_time += now() - t;
+    }
+    code->entries++;
+
+    for (int i = 0; i < code->variable_count; i++)
+    {
+        if (code->variables[i].written && (int)values[i] != NUMBER_VALUE(vars[i]->obj))
+        {
+            object_t *obj = create_object(rt, OBJ_NUMBER);
+            obj->data = NUMBER_DATA((int)values[i]);
+            vars[i]->obj = obj;
+        }
+    }
+    return chunk->code + exit;
+}
+
+bool jit_call(runtime_t *rt, funcdef_t *fd, object_t *this_obj, object_t **args, int argc, object_t **result)
+{
+    jit_site_t *site = &fd->chunk->calls;
+    if (JIT_OFF == mode)
+    {
+        site->count = JIT_NEVER;
+        return false;
+    }
+    jit_code_t *code = site->code;
+    if (0 == code)
+    {
+        code = site->code = create_region(site, true, fd->chunk->code_length);
+    }
+    if (0 == code->entry && 0 == code->rejected)
+    {
+        if (JIT_STATS == mode && !warm_up(code, site))
+        {
+            return false;
+        }
+        compile_function_region(code, fd);
+    }
+    if (0 == code->entry)
+    {
+        site->count = JIT_NEVER;
+        return false;
+    }
+    site->count = -1;
+    if (argc != vector_count(fd->parameters) || (this_obj != 0 && fd->this_slot >= 0))
+    {
+        return false;
+    }
+
+    int64_t native_args[256];
+    int64_t globals[JIT_MAX_VARIABLES];
+    for (int i = 0; i < argc; i++)
+    {
+        if (!is_number(args[i]))
+        {
+            check_failed(code, site);
+            return false;
+        }
+        native_args[argc - 1 - i] = (uint32_t)NUMBER_VALUE(args[i]);
+    }
+    for (int i = 0; i < code->variable_count; i++)
+    {
+        variable_t *var = rt->global_scope->slots[code->variables[i].index];
+        if (!is_number(var->obj))
+        {
+            check_failed(code, site);
+            return false;
+        }
+        globals[i] = (uint32_t)NUMBER_VALUE(var->obj);
+    }
+    code->stack_floor = (char *)((uintptr_t)rt->native_stack_base - rt->native_stack_limit);
+
+    double t = JIT_STATS == mode ? now() : 0;
+    int64_t value = ((function_entry_t)code->entry)(native_args, globals, code);
+    if (JIT_STATS == mode)
+    {
+        code->native_time += now() - t;
+    }
+    if (value < 0)
+    {
+        // too deep for the C stack, the vm takes the calls from now on
+        code->bails++;
+        site->count = JIT_NEVER;
+        return false;
+    }
+    code->entries++;
+    *result = create_object(rt, OBJ_NUMBER);
+    (*result)->data = NUMBER_DATA((int)value);
+    return true;
+}
+#else
+static void unmap_code(jit_code_t *code)
+{
+}
+
+unsigned char *jit_loop(runtime_t *rt, chunk_t *chunk, jit_site_t *site, unsigned char *start, unsigned char *end,
+                        variable_t **slots, variable_t **upvalues)
+{
+    site->count = JIT_NEVER;
+    return start;
+}
+
+bool jit_call(runtime_t *rt, funcdef_t *fd, object_t *this_obj, object_t **args, int argc, object_t **result)
+{
+    fd->chunk->calls.count = JIT_NEVER;
+    return false;
+}
+#endif
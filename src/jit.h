@@ -0,0 +1,63 @@
+#ifndef jit_h
+#define jit_h
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "runtime.h"
+
+// a baseline compiler from vm bytecode to x86-64 machine code. the vm counts
+// how often each while loop jumps back and each function gets called, a loop
+// or function that gets hot is compiled when all it does is compute with
+// numbers: variables, number constants, arithmetic, comparisons, branches
+// and, in a function, calls of the function itself. anything else keeps it in
+// the vm. values in machine code are plain ints, the variables a region reads
+// are checked to hold numbers each time it is entered and a region whose
+// check fails runs in the vm instead.
+//
+// a loop is entered at its back jump and runs in machine code until it exits,
+// the variables it wrote are stored back then. a function runs a whole call,
+// calls of itself included.
+
+typedef enum {
+    JIT_OFF,
+    JIT_ON,
+    JIT_STATS, // like JIT_ON, the regions get reported on exit
+} jit_mode_t;
+
+typedef struct _jit_code_t jit_code_t;
+
+// a loop or function the vm counts runs of, it has the jit look at it once
+// count reached 0
+typedef struct {
+    int count;
+    jit_code_t *code; // 0 until it got hot
+    funcdef_t *fd;    // function the site is in, 0 on the top level
+    int line;
+} jit_site_t;
+
+// the count of a site that stays in the vm, it is not counted any further
+#define JIT_NEVER INT_MIN
+
+// counts a run of the site, true when the jit should look at it
+#define JIT_TICK(site) ((site)->count != JIT_NEVER && ++(site)->count >= 0)
+
+void set_jit_mode(jit_mode_t m);
+void init_jit_site(jit_site_t *site, funcdef_t *fd, int line);
+// the statistics of the region outlive it
+void release_jit_site(jit_site_t *site);
+
+// runs the loop from start to end of chunk, the vm is at its back jump with
+// the operand stack at the statement level. returns where the vm goes on,
+// start when the loop stays in the vm.
+unsigned char *jit_loop(runtime_t *rt, struct _chunk_t *chunk, jit_site_t *site, unsigned char *start, unsigned char *end,
+                        variable_t **slots, variable_t **upvalues);
+
+// runs a call of fd, false when it has to run in the vm
+bool jit_call(runtime_t *rt, funcdef_t *fd, object_t *this_obj, object_t **args, int argc, object_t **result);
+
+// reports the regions that got hot when the mode is JIT_STATS
+void print_jit_stats(FILE *f);
+
+#endif // jit_h
@@ -1,46 +1,410 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
+#include "builtins.h"
+#include "cache.h"
 #include "parser.h"
 #include "interpreter.h"
+#include "jit.h"
+#include "repl.h"
+#include "resolver.h"
+#include "runtime.h"
 
-static void run_buffer(char *buf)
+#define STREAM_CHUNK (64 * 1024)
+
+static bool use_cache = true;
+static int parse_threads = 0; // 0 for one per processor
+static bool parse_pipeline = false;
+static bool parse_stats = false;
+
+static void run_buffer(const char *buf, int length)
 {
     parser_t *p = (parser_t *)malloc(sizeof(parser_t));
-    init_parser(p, buf);
-    parse(p);
+    init_parser(p, buf, length);
+    p->lazy = true;
+    p->threads = parse_threads;
+    p->pipeline = parse_pipeline;
+    p->stats = parse_stats;
+    if (!use_cache || !load_cached_ast(p))
+    {
+        parse(p);
+        if (use_cache)
+        {
+            save_cached_ast(p);
+        }
+    }
+    resolve(p->ast);
     interpret(p);
     release_parser(p);
     free(p);
 }
 
-static void run_file(char *filename)
+#ifdef _WIN32
+static char *load_file(char *filename, int *length)
 {
-    char *src;
-
     FILE *f = fopen(filename, "rb");
+    if (0 == f)
+    {
+        fprintf(stderr, "can not open %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
     fseek(f, 0, SEEK_END);
-    int filesize = ftell(f);
+    *length = ftell(f);
     fseek(f, 0, SEEK_SET);
-    src = (char *)malloc(filesize + 1);
-    if (fread(src, 1, filesize, f) != filesize)
+    char *src = (char *)malloc(*length + 1);
+    if (fread(src, 1, *length, f) != *length)
     {
-        return;
+        fprintf(stderr, "can not read %s\n", filename);
+        exit(EXIT_FAILURE);
     }
     fclose(f);
-    src[filesize] = '\0';
-    run_buffer(src);
+    return src;
+}
+
+static void unload_file(char *src, int length)
+{
     free(src);
 }
+#else
+// the script is mapped read-only, tokens refer to the mapping and only
+// names and string literals are copied out of it
+static char *load_file(char *filename, int *length)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "can not open %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    *length = (int)st.st_size;
+    if (0 == st.st_size)
+    {
+        close(fd);
+        return "";
+    }
+    void *src = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == src)
+    {
+        fprintf(stderr, "can not read %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    return src;
+}
+
+static void unload_file(char *src, int length)
+{
+    if (length > 0)
+    {
+        munmap(src, length);
+    }
+}
+#endif
+
+static void run_file(char *filename)
+{
+    int length;
+    char *src = load_file(filename, &length);
+    run_buffer(src, length);
+    unload_file(src, length);
+}
+
+static int read_chunk(FILE *f, char *buf, int size)
+{
+#ifdef _WIN32
+    return (int)fread(buf, 1, size, f);
+#else
+    // unlike fread this returns what a pipe has so far without waiting
+    // for the whole chunk
+    return (int)read(fileno(f), buf, size);
+#endif
+}
+
+// runs the input while it is read, only the part that is not run yet is
+// kept in memory. "-" is stdin.
+static void stream_file(char *filename)
+{
+    FILE *f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+    if (0 == f)
+    {
+        fprintf(stderr, "can not open %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    stream_t *s = open_stream();
+    int capacity = 2 * STREAM_CHUNK;
+    char *buf = (char *)malloc(capacity);
+    int length = 0;
+    int retry_length = 0;
+    bool at_end = false;
+    while (!at_end)
+    {
+        if (capacity - length < STREAM_CHUNK)
+        {
+            capacity *= 2;
+            buf = (char *)realloc(buf, capacity);
+        }
+        int n = read_chunk(f, buf + length, capacity - length);
+        if (n < 0)
+        {
+            fprintf(stderr, "can not read %s\n", filename);
+            exit(EXIT_FAILURE);
+        }
+        at_end = 0 == n;
+        length += n;
+        if (length < retry_length && !at_end)
+        {
+            continue;
+        }
+        int used = run_stream(s, buf, length, at_end);
+        memmove(buf, buf + used, length - used);
+        length -= used;
+        // an item spanning many chunks is only parsed again once the input
+        // read for it doubled, which keeps reading it linear
+        retry_length = length > STREAM_CHUNK ? 2 * length : 0;
+    }
+    close_stream(s);
+    free(buf);
+    if (f != stdin)
+    {
+        fclose(f);
+    }
+}
+
+// lexes the file over and over for about a second and reports the throughput
+static void bench_lexer(char *filename)
+{
+    int length;
+    char *src = load_file(filename, &length);
+    int runs = 0;
+    int token_count = 0;
+    clock_t start = clock();
+    clock_t elapsed;
+    do
+    {
+        tokenizer_t t;
+        init_tokenizer(&t, src, length);
+        token_count = t.token_count;
+        release_tokenizer(&t);
+        runs++;
+        elapsed = clock() - start;
+    } while (elapsed < CLOCKS_PER_SEC);
+    double seconds = (double)elapsed / CLOCKS_PER_SEC;
+    printf("%d bytes, %d tokens, %d runs, %.1f MB/s, %.1f Mtokens/s\n",
+           length, token_count, runs,
+           (double)length * runs / seconds / (1024 * 1024),
+           (double)token_count * runs / seconds / 1e6);
+    unload_file(src, length);
+}
+
+static int processor_count(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#else
+    return 1;
+#endif
+}
+
+static void usage(char *program)
+{
+    printf("usage: %s [--tree] [--heap-limit=SIZE] [--stack-limit=SIZE] [--gc-stats] [--jit=MODE] [--no-cache] [--parse-threads=N] [--parse-pipeline] [--parse-stats] [--bench-lexer] [--snapshot-out=IMAGE] FILE\n", program);
+    printf("       %s [--tree] [--heap-limit=SIZE] [--stack-limit=SIZE] [--gc-stats] [--jit=MODE] [--stream] FILE|-\n", program);
+    printf("       %s [--tree] [--heap-limit=SIZE] [--stack-limit=SIZE] [--gc-stats] [--jit=MODE] --snapshot-in=IMAGE [--entry=NAME]\n", program);
+    printf("       %s [--tree] [--heap-limit=SIZE] [--stack-limit=SIZE] [--gc-stats] [--jit=MODE] -i\n", program);
+    printf("  --tree                run with the tree walking interpreter instead of the vm\n");
+    printf("  --heap-limit=SIZE     fail when more than SIZE bytes stay live, K, M and G suffixes work\n");
+    printf("  --stack-limit=SIZE    fail with a stack overflow when calls take more than SIZE bytes, 64M by default\n");
+    printf("  --gc-stats            print garbage collector statistics on exit\n");
+    printf("  --jit=MODE            on compiles hot numeric loops and functions of the vm to machine code,\n");
+    printf("                        off keeps them in the vm, stats also reports them on exit. on by default\n");
+    printf("  --no-cache            always parse FILE, do not read or write the parse cache\n");
+    printf("  --parse-threads=N     parse big files on N threads, one per processor by default\n");
+    printf("  --parse-pipeline      lex FILE on a thread of its own while parsing it\n");
+    printf("  --parse-stats         print lexer and parser throughput when FILE gets parsed\n");
+    printf("  --bench-lexer         only tokenize FILE repeatedly and print the lexer throughput\n");
+    printf("  --stream              run FILE one top level statement at a time while reading it, - reads stdin\n");
+    printf("  -i                    read statements from stdin and run them one by one\n");
+    printf("  --snapshot-out=IMAGE  run the top level of FILE, then save its functions and heap to IMAGE\n");
+    printf("  --snapshot-in=IMAGE   start from IMAGE instead of a script and call its entry function\n");
+    printf("  --entry=NAME          entry function of --snapshot-in, main by default\n");
+}
+
+// returns 0 for a malformed size
+static size_t parse_size(char *str)
+{
+    char *end;
+    size_t size = strtoul(str, &end, 10);
+    if (end == str)
+    {
+        return 0;
+    }
+    if (*end == 'k' || *end == 'K')
+    {
+        size *= 1024;
+        end++;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+        size *= 1024 * 1024;
+        end++;
+    }
+    else if (*end == 'g' || *end == 'G')
+    {
+        size *= 1024 * 1024 * 1024;
+        end++;
+    }
+    return *end == '\0' ? size : 0;
+}
 
 int main(int argc, char *argv[])
 {
-    if (argc == 1)
+    char *filename = 0;
+    char *snapshot_in = 0;
+    char *entry = "main";
+    bool lexer_benchmark = false;
+    bool stream = false;
+    bool repl = false;
+
+    for (int i = 1; i < argc; i++)
     {
-        printf("usage: %s FILE\n", argv[0]);
+        if (strcmp(argv[i], "--tree") == 0)
+        {
+            set_engine(ENGINE_TREE);
+        }
+        else if (strncmp(argv[i], "--heap-limit=", 13) == 0)
+        {
+            size_t limit = parse_size(argv[i] + 13);
+            if (0 == limit)
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            set_heap_limit(limit);
+        }
+        else if (strncmp(argv[i], "--stack-limit=", 14) == 0)
+        {
+            size_t limit = parse_size(argv[i] + 14);
+            if (0 == limit)
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            set_stack_limit(limit);
+        }
+        else if (strcmp(argv[i], "--gc-stats") == 0)
+        {
+            set_gc_stats(true);
+        }
+        else if (strcmp(argv[i], "--jit=off") == 0)
+        {
+            set_jit_mode(JIT_OFF);
+        }
+        else if (strcmp(argv[i], "--jit=on") == 0)
+        {
+            set_jit_mode(JIT_ON);
+        }
+        else if (strcmp(argv[i], "--jit=stats") == 0)
+        {
+            set_jit_mode(JIT_STATS);
+        }
+        else if (strcmp(argv[i], "--no-cache") == 0)
+        {
+            use_cache = false;
+        }
+        else if (strncmp(argv[i], "--parse-threads=", 16) == 0)
+        {
+            parse_threads = atoi(argv[i] + 16);
+            if (parse_threads < 1)
+            {
+                usage(argv[0]);
+                return 2;
+            }
+        }
+        else if (strcmp(argv[i], "--parse-pipeline") == 0)
+        {
+            parse_pipeline = true;
+        }
+        else if (strcmp(argv[i], "--parse-stats") == 0)
+        {
+            parse_stats = true;
+        }
+        else if (strcmp(argv[i], "-i") == 0)
+        {
+            repl = true;
+        }
+        else if (strcmp(argv[i], "--stream") == 0)
+        {
+            stream = true;
+        }
+        else if (strcmp(argv[i], "--bench-lexer") == 0)
+        {
+            lexer_benchmark = true;
+        }
+        else if (strncmp(argv[i], "--snapshot-out=", 15) == 0 && argv[i][15] != '\0')
+        {
+            set_snapshot_out(argv[i] + 15);
+        }
+        else if (strncmp(argv[i], "--snapshot-in=", 14) == 0 && argv[i][14] != '\0')
+        {
+            snapshot_in = argv[i] + 14;
+        }
+        else if (strncmp(argv[i], "--entry=", 8) == 0 && argv[i][8] != '\0')
+        {
+            entry = argv[i] + 8;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] != '\0')
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        else
+        {
+            filename = argv[i];
+        }
+    }
+    if (repl ? filename != 0 || snapshot_in != 0 : (0 == filename) == (0 == snapshot_in))
+    {
+        usage(argv[0]);
         return 2;
     }
-    run_file(argv[1]);
+    if (0 == parse_threads)
+    {
+        parse_threads = processor_count();
+    }
+    init_symbols();
+    init_builtins();
+    if (repl)
+    {
+        run_repl();
+    }
+    else if (snapshot_in != 0)
+    {
+        interpret_snapshot(snapshot_in, entry);
+    }
+    else if (lexer_benchmark)
+    {
+        bench_lexer(filename);
+    }
+    else if (stream || strcmp(filename, "-") == 0)
+    {
+        stream_file(filename);
+    }
+    else
+    {
+        run_file(filename);
+    }
+    release_builtins();
+    release_symbols();
+    release_list_items();
     return 0;
 }
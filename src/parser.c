@@ -1,16 +1,22 @@
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include "parser.h"
 
+// sources smaller than this are parsed on the calling thread, bigger ones
+// are split into parts of about PARSE_PART_SIZE bytes
+#define PARALLEL_PARSE_MIN (1024 * 1024)
+#define PARSE_PART_SIZE (256 * 1024)
+
 #define IS_END_OF_BLOCK_TOKEN(t) ((t == TT_END) || (t == TT_ELSE) || (t == TT_DEF) || (t == TT_EOF))
 
 static block_t *parse_block(parser_t *p);
 static expression_t *parse_expression(parser_t *p);
 static funcdef_t *parse_funcdef(parser_t *p, bool is_inline);
 static ifstatement_t *parse_if(parser_t *p);
-static list_t *parse_list(parser_t *p);
+static vector_t *parse_list(parser_t *p);
 static inlineobj_t *parse_object(parser_t *p);
 static statement_t *parse_statement(parser_t *p);
 static value_t *parse_value(parser_t *p);
@@ -24,14 +30,12 @@ static void _expect(parser_t *p, int expected_token, const char *file, int line)
 {
     if (p->t->token_type != expected_token)
     {
-        fprintf(stderr,
-                "expect failed on line %d, expecting %d found %d:%s\n",
-                p->t->line_number,
-                expected_token,
-                p->t->token_type,
-                p->t->token_value.str_val);
-        fprintf(stderr, "at %s:%d\n", file, line);
-        exit(EXIT_FAILURE);
+        syntax_error("expect failed on line %d, expecting %d found %d:%s\nat %s:%d\n",
+                     p->t->line_number,
+                     expected_token,
+                     p->t->token_type,
+                     p->t->symbol != 0 ? p->t->symbol : "",
+                     file, line);
     }
 }
 
@@ -46,28 +50,36 @@ static int _match(parser_t *p, token_type_t tok, const char *file, int line)
     return 1;
 }
 
-void init_parser(parser_t *p, char *source)
+void init_parser(parser_t *p, const char *source, int length)
 {
-    p->t = (tokenizer_t *)malloc(sizeof(tokenizer_t));
-    init_tokenizer(p->t, source);
+    p->source = source;
+    p->source_length = length;
+    p->t = 0;
+    p->lazy = false;
+    p->threads = 1;
+    p->pipeline = false;
+    p->stats = false;
     p->ast = (ast_t *)malloc(sizeof(ast_t));
-    p->ast->statement_list = create_list();
-    p->ast->function_list = create_list();
+    p->ast->statement_list = create_vector();
+    p->ast->function_list = create_vector();
+    p->ast->globals = 0;
 }
 
 void release_parser(parser_t *p)
 {
-    destroy_list(p->ast->function_list);
-    destroy_list(p->ast->statement_list);
+    destroy_vector(p->ast->function_list);
+    destroy_vector(p->ast->statement_list);
+    if (p->ast->globals != 0)
+    {
+        destroy_vector(p->ast->globals);
+    }
     free(p->ast);
-    release_tokenizer(p->t);
-    free(p->t);
 }
 
 static block_t *parse_block(parser_t *p)
 {
     block_t *block = (block_t *)malloc(sizeof(block_t));
-    block->statements = create_list();
+    block->statements = create_vector();
     while (1)
     {
         token_type_t tok;
@@ -80,7 +92,7 @@ static block_t *parse_block(parser_t *p)
         else
         {
             unget_token(p->t);
-            list_insert(block->statements, parse_statement(p));
+            vector_push(block->statements, parse_statement(p));
         }
     }
     return block;
@@ -89,9 +101,10 @@ static block_t *parse_block(parser_t *p)
 static expression_t *parse_expression(parser_t *p)
 {
     expression_t *expression = (expression_t *)malloc(sizeof(expression_t));
-    expression->values = create_list();
-    expression->binaryops = create_list();
-    expression->unaryops = create_list();
+    expression->values = create_vector();
+    expression->binaryops = create_vector();
+    expression->unaryops = create_vector();
+    expression->quick = 0;
     expression->line_number = p->t->line_number;
     while (1)
     {
@@ -102,7 +115,8 @@ static expression_t *parse_expression(parser_t *p)
             value->type = VT_EXPRESSION;
             value->value = parse_expression(p);
             value->subvalue = 0;
-            list_insert(expression->values, value);
+            value->cache = 0;
+            vector_push(expression->values, value);
             match(p, TT_OP_PCLOSE);
         }
         else
@@ -113,26 +127,27 @@ static expression_t *parse_expression(parser_t *p)
                 {
                     tok = TT_OP_UNARYSUB;
                 }
-                list_insert(expression->unaryops, (void *)tok);
+                vector_push(expression->unaryops, (void *)tok);
             }
             else
             {
-                list_insert(expression->unaryops, (void *)TT_NOP);
+                vector_push(expression->unaryops, (void *)TT_NOP);
                 unget_token(p->t);
             }
-            list_insert(expression->values, parse_value(p));
+            vector_push(expression->values, parse_value(p));
         }
         tok = get_token(p->t);
         if (TOK_IS_BINARY_OP(tok))
         {
-            list_insert(expression->binaryops, (void *)tok);
+            vector_push(expression->binaryops, (void *)tok);
             if (TT_OP_ASSIGN == tok)
             {
                 value_t *value = (value_t *)malloc(sizeof(value_t));
                 value->type = VT_EXPRESSION;
                 value->value = parse_expression(p);
                 value->subvalue = 0;
-                list_insert(expression->values, value);
+                value->cache = 0;
+                vector_push(expression->values, value);
                 break;
             }
         }
@@ -145,17 +160,51 @@ static expression_t *parse_expression(parser_t *p)
     return expression;
 }
 
+// skips to the end that closes the body and keeps the source in between,
+// syntax errors inside the body show up when it is parsed
+static void scan_body(parser_t *p, funcdef_t *fd)
+{
+    // the token itself may be gone once more tokens were read
+    int offset = peek_token(p->t)->offset;
+    int line = peek_token(p->t)->line;
+    int depth = 1;
+    while (depth > 0)
+    {
+        token_type_t tok = get_token(p->t);
+        if (TT_DEF == tok || TT_IF == tok || TT_WHILE == tok)
+        {
+            depth++;
+        }
+        else if (TT_END == tok)
+        {
+            depth--;
+        }
+        else if (TT_EOF == tok || TT_UNKNOWN == tok)
+        {
+            expect(p, TT_END);
+        }
+    }
+    fd->body = p->source + offset;
+    fd->body_length = last_token(p->t)->offset - offset;
+    fd->body_line = line;
+}
+
 static funcdef_t *parse_funcdef(parser_t *p, bool is_inline)
 {
     funcdef_t *funcdef = (funcdef_t *)malloc(sizeof(funcdef_t));
     funcdef->line_number = p->t->line_number;
+    funcdef->locals = 0;
+    funcdef->captures = 0;
+    funcdef->captured = 0;
+    funcdef->this_slot = -1;
+    funcdef->chunk = 0;
     match(p, TT_DEF);
     if (!is_inline)
     {
         match(p, TT_IDENT);
-        strcpy(funcdef->name, p->t->token_value.str_val);
+        funcdef->name = p->t->symbol;
     }
-    funcdef->parameters = create_list();
+    funcdef->parameters = create_vector();
     token_type_t tok = get_token(p->t);
     if (TT_OP_POPEN == tok)
     {
@@ -165,7 +214,7 @@ static funcdef_t *parse_funcdef(parser_t *p, bool is_inline)
             unget_token(p->t);
             do
             {
-                list_insert(funcdef->parameters, parse_vardecl(p));
+                vector_push(funcdef->parameters, parse_vardecl(p));
                 get_token(p->t);
             } while (TT_OP_COMMA == p->t->token_type);
         }
@@ -175,18 +224,48 @@ static funcdef_t *parse_funcdef(parser_t *p, bool is_inline)
     {
         unget_token(p->t);
     }
-    funcdef->block = parse_block(p);
-    match(p, TT_END);
+    funcdef->body = 0;
+    funcdef->body_length = 0;
+    funcdef->body_line = 0;
+    if (p->lazy)
+    {
+        scan_body(p, funcdef);
+        funcdef->block = 0;
+    }
+    else
+    {
+        funcdef->block = parse_block(p);
+        match(p, TT_END);
+    }
     return funcdef;
 }
 
+void parse_function_body(funcdef_t *fd)
+{
+    parser_t p;
+    tokenizer_t t;
+    init_tokenizer_at(&t, fd->body, fd->body_length, fd->body_line);
+    p.source = fd->body;
+    p.source_length = fd->body_length;
+    p.t = &t;
+    p.ast = 0;
+    p.lazy = true;
+    p.threads = 1;
+    p.pipeline = false;
+    p.stats = false;
+    fd->block = parse_block(&p);
+    match(&p, TT_EOF);
+    release_tokenizer(&t);
+    fd->body = 0;
+}
+
 static funccall_t *parse_funccall(parser_t *p)
 {
     funccall_t *funccall = (funccall_t *)malloc(sizeof(funccall_t));
-    funccall->arguments = create_list();
+    funccall->arguments = create_vector();
 
     match(p, TT_IDENT);
-    strcpy(funccall->function_name, p->t->token_value.str_val);
+    funccall->function_name = p->t->symbol;
     match(p, TT_OP_POPEN);
     token_type_t tok = get_token(p->t);
     if (TT_OP_PCLOSE == tok)
@@ -197,7 +276,7 @@ static funccall_t *parse_funccall(parser_t *p)
     unget_token(p->t);
     do
     {
-        list_insert(funccall->arguments, parse_expression(p));
+        vector_push(funccall->arguments, parse_expression(p));
         tok = get_token(p->t);
     } while (TT_OP_COMMA == tok);
     expect(p, TT_OP_PCLOSE);
@@ -224,16 +303,16 @@ static ifstatement_t *parse_if(parser_t *p)
     return ifstatement;
 }
 
-static list_t *parse_list(parser_t *p)
+static vector_t *parse_list(parser_t *p)
 {
-    list_t *list = create_list();
+    vector_t *list = create_vector();
 
     match(p, TT_OP_BOPEN);
     token_type_t tok = get_token(p->t);
     while (TT_OP_BCLOSE != tok)
     {
         unget_token(p->t);
-        list_insert(list, parse_value(p));
+        vector_push(list, parse_value(p));
         tok = get_token(p->t);
         if (TT_OP_BCLOSE == tok)
         {
@@ -249,17 +328,17 @@ static inlineobj_t *parse_object(parser_t *p)
 {
     inlineobj_t *obj = (inlineobj_t *)malloc(sizeof(inlineobj_t));
 
-    obj->keys = create_list();
-    obj->values = create_list();
+    obj->keys = create_vector();
+    obj->values = create_vector();
 
     match(p, TT_OP_COPEN);
 
     token_type_t tok = get_token(p->t);
     while (tok == TT_STRING)
     {
-        list_insert(obj->keys, duplicate_string(p->t->token_value.str_val));
+        vector_push(obj->keys, p->t->symbol);
         match(p, TT_OP_COLON);
-        list_insert(obj->values, parse_expression(p));
+        vector_push(obj->values, parse_expression(p));
         tok = get_token(p->t);
         if (tok != TT_OP_COMMA)
         {
@@ -310,23 +389,24 @@ static value_t *parse_value(parser_t *p)
 {
     value_t *value = (value_t *)malloc(sizeof(value_t));
     value->subvalue = 0;
+    value->cache = 0;
     token_type_t tok = get_token(p->t);
     if (TT_NUMBER == tok)
     {
         value->type = VT_CNUMBER;
-        value->value = p->t->token_value.int_val;
+        value->value = p->t->int_val;
     }
     else if (TT_STRING == tok)
     {
         value->type = VT_CSTRING;
-        value->value = duplicate_string(p->t->token_value.str_val);
+        value->value = p->t->symbol;
     }
     else if (TT_DEF == tok)
     {
         value->type = VT_INLINE_FUNC;
         unget_token(p->t);
         funcdef_t *fd = parse_funcdef(p, true);
-        strcpy(fd->name, "#");
+        fd->name = intern("#");
         value->value = fd;
     }
     else if (TT_OP_BOPEN == tok)
@@ -357,7 +437,7 @@ static value_t *parse_value(parser_t *p)
             unget_token(p->t);
             tok = get_token(p->t);
             listindex_t *listindex = (listindex_t *)malloc(sizeof(listindex_t));
-            listindex->name = duplicate_string(p->t->token_value.str_val);
+            listindex->name = p->t->symbol;
             value->type = VT_LISTINDEX;
             match(p, TT_OP_BOPEN);
             value->value = listindex;
@@ -370,7 +450,7 @@ static value_t *parse_value(parser_t *p)
             unget_token(p->t); // IDENT
             tok = get_token(p->t);
             value->type = VT_IDENT;
-            value->value = duplicate_string(p->t->token_value.str_val);
+            value->value = p->t->symbol;
             match(p, TT_OP_DOT);
             match(p, TT_IDENT);
             unget_token(p->t);
@@ -382,13 +462,12 @@ static value_t *parse_value(parser_t *p)
             unget_token(p->t);
             tok = get_token(p->t);
             value->type = VT_IDENT;
-            value->value = duplicate_string(p->t->token_value.str_val);
+            value->value = p->t->symbol;
         }
     }
     else
     {
-        fprintf(stderr, "unknown value type:%d\n", tok);
-        exit(EXIT_FAILURE);
+        syntax_error("unknown value type:%d\n", tok);
     }
     return value;
 }
@@ -397,7 +476,7 @@ static vardecl_t *parse_vardecl(parser_t *p)
 {
     vardecl_t *vardecl = (vardecl_t *)malloc(sizeof(vardecl_t));
     get_token(p->t);
-    strcpy(vardecl->name, p->t->token_value.str_val);
+    vardecl->name = p->t->symbol;
 
     return vardecl;
 }
@@ -412,7 +491,7 @@ static whilestatement_t *parse_while(parser_t *p)
     return whilestmt;
 }
 
-void parse(parser_t *p)
+static void parse_items(parser_t *p)
 {
     token_type_t tok = get_token(p->t);
     while (TT_EOF != tok)
@@ -420,14 +499,537 @@ void parse(parser_t *p)
         if (TT_DEF == tok)
         {
             unget_token(p->t);
-            list_insert(p->ast->function_list, parse_funcdef(p, false));
+            vector_push(p->ast->function_list, parse_funcdef(p, false));
         }
         else
         {
             unget_token(p->t);
             statement_t *statement = parse_statement(p);
-            list_insert(p->ast->statement_list, statement);
+            vector_push(p->ast->statement_list, statement);
         }
         tok = get_token(p->t);
     }
 }
+
+// a part of the source that starts with a top level function, the parts
+// lex and parse on their own and are merged in source order
+typedef struct {
+    const char *source;
+    int length;
+    int line;
+    ast_t ast;
+    bool failed;
+    int token_count;
+    double lex_seconds;
+    double parse_seconds;
+} parse_part_t;
+
+typedef struct {
+    parser_t *p;
+    parse_part_t *parts;
+    int part_count;
+    int next_part;
+    pthread_mutex_t lock;
+} parse_job_t;
+
+static void parse_part(parse_job_t *job, parse_part_t *part)
+{
+    jmp_buf trap;
+    tokenizer_t t;
+    parser_t p;
+
+    part->ast.statement_list = create_vector();
+    part->ast.function_list = create_vector();
+    part->ast.globals = 0;
+    if (setjmp(trap) != 0)
+    {
+        // the tokens of the part are lost, the serial parse reports the error
+        set_error_trap(0);
+        part->failed = true;
+        return;
+    }
+    set_error_trap(&trap);
+    double start = monotonic_seconds();
+    init_tokenizer_at(&t, part->source, part->length, part->line);
+    double lexed = monotonic_seconds();
+    part->token_count = t.token_count;
+    p.source = part->source;
+    p.source_length = part->length;
+    p.t = &t;
+    p.ast = &part->ast;
+    p.lazy = job->p->lazy;
+    p.threads = 1;
+    p.pipeline = false;
+    p.stats = false;
+    parse_items(&p);
+    part->lex_seconds = lexed - start;
+    part->parse_seconds = monotonic_seconds() - lexed;
+    set_error_trap(0);
+    release_tokenizer(&t);
+}
+
+static void *parse_worker(void *arg)
+{
+    parse_job_t *job = arg;
+    use_local_symbols();
+    for (;;)
+    {
+        pthread_mutex_lock(&job->lock);
+        int i = job->next_part++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->part_count)
+        {
+            break;
+        }
+        parse_part(job, &job->parts[i]);
+    }
+    release_local_symbols();
+    return 0;
+}
+
+// splits the source at top level functions and parses the parts on
+// p->threads threads, false when it could not be split or a part failed.
+// the serial parse then runs and reports errors the same way as always.
+static bool parse_parallel(parser_t *p)
+{
+    double start_split = monotonic_seconds();
+    int max_splits = p->source_length / PARSE_PART_SIZE + 1;
+    source_split_t *splits = (source_split_t *)malloc(max_splits * sizeof(source_split_t));
+    int split_count = split_source(p->source, p->source_length, PARSE_PART_SIZE, splits, max_splits);
+    if (split_count == 0 || (split_count == 1 && splits[0].offset == 0))
+    {
+        free(splits);
+        return false;
+    }
+
+    parse_job_t job;
+    job.p = p;
+    job.part_count = 0;
+    job.next_part = 0;
+    job.parts = (parse_part_t *)calloc(split_count + 1, sizeof(parse_part_t));
+    pthread_mutex_init(&job.lock, 0);
+    int start = 0;
+    int line = 1;
+    for (int i = 0; i <= split_count; i++)
+    {
+        int end = i < split_count ? splits[i].offset : p->source_length;
+        if (end > start)
+        {
+            parse_part_t *part = &job.parts[job.part_count++];
+            part->source = p->source + start;
+            part->length = end - start;
+            part->line = line;
+        }
+        if (i < split_count)
+        {
+            start = splits[i].offset;
+            line = splits[i].line;
+        }
+    }
+    free(splits);
+
+    double start_parts = monotonic_seconds();
+    int thread_count = p->threads < job.part_count ? p->threads : job.part_count;
+    pthread_t *threads = (pthread_t *)malloc(thread_count * sizeof(pthread_t));
+    int started = 0;
+    while (started < thread_count && pthread_create(&threads[started], 0, parse_worker, &job) == 0)
+    {
+        started++;
+    }
+    if (0 == started)
+    {
+        // no threads to be had, this thread does all the parts
+        parse_worker(&job);
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], 0);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+
+    double parsed = monotonic_seconds();
+    bool failed = false;
+    for (int i = 0; i < job.part_count; i++)
+    {
+        failed = failed || job.parts[i].failed;
+    }
+    for (int i = 0; i < job.part_count; i++)
+    {
+        ast_t *ast = &job.parts[i].ast;
+        for (int j = 0; !failed && j < vector_count(ast->statement_list); j++)
+        {
+            vector_push(p->ast->statement_list, vector_get(ast->statement_list, j));
+        }
+        for (int j = 0; !failed && j < vector_count(ast->function_list); j++)
+        {
+            vector_push(p->ast->function_list, vector_get(ast->function_list, j));
+        }
+        destroy_vector(ast->statement_list);
+        destroy_vector(ast->function_list);
+    }
+    double merged = monotonic_seconds();
+
+    if (p->stats && !failed)
+    {
+        // the lexer and parser times add up the parts, the threads ran
+        // them at the same time
+        int token_count = 1; // each part ends in an eof of its own
+        double lex_seconds = 0;
+        double parse_seconds = 0;
+        for (int i = 0; i < job.part_count; i++)
+        {
+            token_count += job.parts[i].token_count - 1;
+            lex_seconds += job.parts[i].lex_seconds;
+            parse_seconds += job.parts[i].parse_seconds;
+        }
+        fprintf(stderr, "lexer:  %d bytes, %d tokens in %.1f ms, %.1f MB/s, split into %d parts in %.1f ms\n",
+                p->source_length, token_count, lex_seconds * 1000,
+                p->source_length / lex_seconds / (1024 * 1024), job.part_count, (start_parts - start_split) * 1000);
+        fprintf(stderr, "parser: %d tokens in %.1f ms, %.1f Mtokens/s, merged in %.1f ms\n",
+                token_count, parse_seconds * 1000, token_count / parse_seconds / 1e6, (merged - parsed) * 1000);
+        fprintf(stderr, "threads: %d parts on %d threads in %.1f ms, %.1f MB/s\n",
+                job.part_count, started > 0 ? started : 1, (parsed - start_parts) * 1000,
+                p->source_length / (parsed - start_parts) / (1024 * 1024));
+    }
+    free(job.parts);
+    return !failed;
+}
+
+static void free_block(block_t *b, bool keep_functions);
+static void free_expression(expression_t *e, bool keep_functions);
+static void free_funcdef(funcdef_t *fd);
+
+static void free_value(value_t *v, bool keep_functions)
+{
+    switch (v->type)
+    {
+    case VT_FUNCCALL:
+    {
+        funccall_t *f = v->value;
+        for (int i = 0; i < vector_count(f->arguments); i++)
+        {
+            free_expression(vector_get(f->arguments, i), keep_functions);
+        }
+        destroy_vector(f->arguments);
+        free(f);
+        break;
+    }
+    case VT_INLINE_FUNC:
+        if (!keep_functions)
+        {
+            free_funcdef(v->value);
+        }
+        break;
+    case VT_INLINE_OBJ:
+    {
+        inlineobj_t *iobj = v->value;
+        for (int i = 0; i < vector_count(iobj->values); i++)
+        {
+            free_expression(vector_get(iobj->values, i), keep_functions);
+        }
+        destroy_vector(iobj->keys);
+        destroy_vector(iobj->values);
+        free(iobj);
+        break;
+    }
+    case VT_LIST:
+        for (int i = 0; i < vector_count(v->value); i++)
+        {
+            free_value(vector_get(v->value, i), keep_functions);
+        }
+        destroy_vector(v->value);
+        break;
+    case VT_LISTINDEX:
+    {
+        listindex_t *listindex = v->value;
+        free_expression(listindex->index, keep_functions);
+        free(listindex);
+        break;
+    }
+    case VT_EXPRESSION:
+        free_expression(v->value, keep_functions);
+        break;
+    default:
+        break;
+    }
+    if (v->subvalue != 0)
+    {
+        free_value(v->subvalue, keep_functions);
+    }
+    free(v->cache);
+    free(v);
+}
+
+static void free_expression(expression_t *e, bool keep_functions)
+{
+    for (int i = 0; i < vector_count(e->values); i++)
+    {
+        free_value(vector_get(e->values, i), keep_functions);
+    }
+    destroy_vector(e->values);
+    destroy_vector(e->binaryops);
+    destroy_vector(e->unaryops);
+    free(e->quick);
+    free(e);
+}
+
+static void free_statement_tree(statement_t *s, bool keep_functions)
+{
+    if (ST_IF == s->type)
+    {
+        ifstatement_t *is = s->value;
+        free_expression(is->expression, keep_functions);
+        free_block(is->block, keep_functions);
+        if (is->else_block != 0)
+        {
+            free_block(is->else_block, keep_functions);
+        }
+        free(is);
+    }
+    else if (ST_WHILE == s->type)
+    {
+        whilestatement_t *ws = s->value;
+        free_expression(ws->expression, keep_functions);
+        free_block(ws->block, keep_functions);
+        free(ws);
+    }
+    else
+    {
+        free_expression(s->value, keep_functions);
+    }
+    free(s);
+}
+
+static void free_block(block_t *b, bool keep_functions)
+{
+    for (int i = 0; i < vector_count(b->statements); i++)
+    {
+        free_statement_tree(vector_get(b->statements, i), keep_functions);
+    }
+    destroy_vector(b->statements);
+    free(b);
+}
+
+// only for functions nothing refers to
+static void free_funcdef(funcdef_t *fd)
+{
+    for (int i = 0; i < vector_count(fd->parameters); i++)
+    {
+        free(vector_get(fd->parameters, i));
+    }
+    destroy_vector(fd->parameters);
+    if (fd->block != 0)
+    {
+        free_block(fd->block, false);
+    }
+    free(fd);
+}
+
+void free_statement(statement_t *s)
+{
+    free_statement_tree(s, true);
+}
+
+bool begin_items(parser_t *p, int line, bool at_end)
+{
+    jmp_buf trap;
+    p->t = (tokenizer_t *)calloc(1, sizeof(tokenizer_t));
+    if (!at_end)
+    {
+        if (setjmp(trap) != 0)
+        {
+            // a string or comment that goes on in the rest of the input
+            set_error_trap(0);
+            free(p->t->tokens);
+            free(p->t);
+            p->t = 0;
+            return false;
+        }
+        set_error_trap(&trap);
+    }
+    init_tokenizer_at(p->t, p->source, p->source_length, line);
+    set_error_trap(0);
+    return true;
+}
+
+bool parse_item(parser_t *p, bool at_end)
+{
+    jmp_buf trap;
+    int start = p->t->position;
+    token_type_t tok = get_token(p->t);
+    unget_token(p->t);
+    if (TT_EOF == tok)
+    {
+        return false;
+    }
+    if (!at_end)
+    {
+        if (setjmp(trap) != 0)
+        {
+            // what is parsed of the item so far is lost
+            set_error_trap(0);
+            p->t->position = start;
+            return false;
+        }
+        set_error_trap(&trap);
+    }
+    vector_t *items = TT_DEF == tok ? p->ast->function_list : p->ast->statement_list;
+    vector_push(items, TT_DEF == tok ? (void *)parse_funcdef(p, false) : (void *)parse_statement(p));
+    set_error_trap(0);
+
+    // the token after the item decides where it ends, when it is not
+    // complete the item could go on in the input still to come
+    token_t *after = peek_token(p->t);
+    if (!at_end && (TT_EOF == after->type || after->offset + after->length >= p->source_length))
+    {
+        if (TT_DEF == tok)
+        {
+            free_funcdef(vector_pop(items));
+        }
+        else
+        {
+            free_statement_tree(vector_pop(items), false);
+        }
+        p->t->position = start;
+        return false;
+    }
+    return true;
+}
+
+bool parse_input(parser_t *p, bool *incomplete)
+{
+    jmp_buf trap;
+    volatile bool lexed = false;
+    p->t = (tokenizer_t *)calloc(1, sizeof(tokenizer_t));
+    if (setjmp(trap) != 0)
+    {
+        set_error_trap(0);
+        // a lexer error is most likely a string that goes on
+        *incomplete = !lexed || TT_EOF == p->t->token_type;
+        for (int i = 0; i < vector_count(p->ast->statement_list); i++)
+        {
+            free_statement_tree(vector_get(p->ast->statement_list, i), false);
+        }
+        for (int i = 0; i < vector_count(p->ast->function_list); i++)
+        {
+            free_funcdef(vector_get(p->ast->function_list, i));
+        }
+        p->ast->statement_list->count = 0;
+        p->ast->function_list->count = 0;
+        free(p->t->tokens);
+        free(p->t);
+        p->t = 0;
+        return false;
+    }
+    set_error_trap(&trap);
+    init_tokenizer(p->t, p->source, p->source_length);
+    lexed = true;
+    parse_items(p);
+    set_error_trap(0);
+    release_tokenizer(p->t);
+    free(p->t);
+    p->t = 0;
+    *incomplete = false;
+    return true;
+}
+
+int parsed_length(parser_t *p, int *line)
+{
+    token_t *after = peek_token(p->t);
+    *line = after->line;
+    return TT_EOF == after->type ? p->source_length : after->offset;
+}
+
+void end_items(parser_t *p)
+{
+    if (p->t != 0)
+    {
+        release_tokenizer(p->t);
+        free(p->t);
+        p->t = 0;
+    }
+}
+
+// the parser takes the tokens from a lexer thread as they are made. false
+// when there was no thread or either side failed, the serial parse then
+// runs and reports errors the same way as always.
+static bool parse_pipelined(parser_t *p)
+{
+    jmp_buf trap;
+    pipeline_stats_t stats;
+    double start = monotonic_seconds();
+
+    p->t = (tokenizer_t *)malloc(sizeof(tokenizer_t));
+    if (!init_tokenizer_pipelined(p->t, p->source, p->source_length))
+    {
+        free(p->t);
+        p->t = 0;
+        return false;
+    }
+    // the lexer thread interns at the same time
+    use_local_symbols();
+    if (setjmp(trap) != 0)
+    {
+        // the nodes parsed so far are dropped
+        set_error_trap(0);
+        release_local_symbols();
+        release_tokenizer(p->t);
+        free(p->t);
+        p->t = 0;
+        p->ast->statement_list->count = 0;
+        p->ast->function_list->count = 0;
+        return false;
+    }
+    set_error_trap(&trap);
+    parse_items(p);
+    set_error_trap(0);
+    release_local_symbols();
+    finish_pipeline(p->t, &stats);
+    release_tokenizer(p->t);
+    free(p->t);
+    p->t = 0;
+
+    if (p->stats)
+    {
+        double seconds = monotonic_seconds() - start;
+        fprintf(stderr, "lexer:  %d bytes, %d tokens in %.1f ms, %.1f MB/s, waited %d times for the parser\n",
+                p->source_length, stats.token_count, stats.lex_seconds * 1000,
+                p->source_length / stats.lex_seconds / (1024 * 1024), stats.full_waits);
+        fprintf(stderr, "parser: %d tokens in %.1f ms, %.1f Mtokens/s, waited %d times for the lexer\n",
+                stats.token_count, seconds * 1000, stats.token_count / seconds / 1e6, stats.empty_waits);
+    }
+    return true;
+}
+
+void parse(parser_t *p)
+{
+    if (p->pipeline && parse_pipelined(p))
+    {
+        return;
+    }
+    if (!p->pipeline && p->threads > 1 && p->source_length >= PARALLEL_PARSE_MIN && parse_parallel(p))
+    {
+        return;
+    }
+    double start = monotonic_seconds();
+    p->t = (tokenizer_t *)malloc(sizeof(tokenizer_t));
+    init_tokenizer(p->t, p->source, p->source_length);
+    double lexed = monotonic_seconds();
+    int token_count = p->t->token_count;
+    parse_items(p);
+    double parsed = monotonic_seconds();
+    // the tree holds interned names only, the tokens are not needed anymore
+    release_tokenizer(p->t);
+    free(p->t);
+    p->t = 0;
+
+    if (p->stats)
+    {
+        fprintf(stderr, "lexer:  %d bytes, %d tokens in %.1f ms, %.1f MB/s\n",
+                p->source_length, token_count, (lexed - start) * 1000,
+                p->source_length / (lexed - start) / (1024 * 1024));
+        fprintf(stderr, "parser: %d tokens in %.1f ms, %.1f Mtokens/s\n",
+                token_count, (parsed - lexed) * 1000, token_count / (parsed - lexed) / 1e6);
+    }
+}
@@ -1,6 +1,8 @@
 #ifndef parser_h
 #define parser_h
 
+#include <stdbool.h>
+
 #include "token.h"
 #include "common.h"
 
@@ -24,27 +26,76 @@ typedef enum {
     VT_LISTINDEX,
 } value_type_t;
 
+// lexical address of a variable, filled in by the resolver
+#define DEPTH_GLOBAL -1
+#define DEPTH_NONE -2 // not a variable, e.g. a builtin or a top level function
+#define DEPTH_UPVALUE -3 // slot is an index into the captures of the closure
+
 typedef struct {
-    list_t *statements;
+    int depth; // 0 for a slot of the current scope or one of the above
+    int slot;
+} address_t;
+
+// a variable of an enclosing function a closure captures when it is
+// created, either a local slot of the function that creates the closure
+// or one of that function's own captures
+typedef struct {
+    char *name;
+    bool from_local;
+    int index;
+} capture_t;
+
+// inline cache of a property access site, remembers the slot of the
+// property for the last few object shapes seen there
+#define PROPERTY_CACHE_WAYS 4
+
+typedef struct {
+    struct _shape_t *shapes[PROPERTY_CACHE_WAYS];
+    int slots[PROPERTY_CACHE_WAYS];
+} property_cache_t;
+
+typedef struct {
+    vector_t *statements;
 } block_t;
 
 typedef struct {
-    list_t *values;
-    list_t *binaryops;
-    list_t *unaryops;
+    vector_t *values;
+    vector_t *binaryops;
+    vector_t *unaryops;
+    unsigned char *quick; // quick_op_t per operator, set by the tree walker
     int line_number;
 } expression_t;
 
+// what a call is bound to, filled in by the resolver
+typedef enum {
+    CALL_DYNAMIC,  // a variable holding a function, see address
+    CALL_BUILTIN,  // builtin id
+    CALL_FUNCTION, // top level function
+} call_kind_t;
+
 typedef struct {
-    char function_name[MAX_IDENT_LENGTH];
-    list_t *arguments;
+    char *function_name;
+    vector_t *arguments;
+    address_t address;
+    call_kind_t kind;
+    int builtin;
+    struct _funcdef_t *function;
+    bool tail; // the value a function returns, the callee replaces the caller
 } funccall_t;
 
-typedef struct {
-    char name[MAX_IDENT_LENGTH];
-    list_t *parameters;
-    block_t *block;
+typedef struct _funcdef_t {
+    char *name;
+    vector_t *parameters;
+    block_t *block;   // 0 until parse_function_body ran on a scanned body
+    const char *body; // source of the body while it is not parsed
+    int body_length;
+    int body_line;
     int line_number;
+    vector_t *locals; // slot names, parameters first, 0 until resolved
+    vector_t *captures; // capture_t, what a closure of the function holds
+    vector_t *captured; // local slots closures capture, they get cells
+    int this_slot;
+    struct _chunk_t *chunk; // compiled lazily by the vm
 } funcdef_t;
 
 typedef struct {
@@ -56,11 +107,12 @@ typedef struct {
 typedef struct {
     char *name;
     expression_t *index;
+    address_t address;
 } listindex_t;
 
 typedef struct {
-    list_t *keys;
-    list_t *values;
+    vector_t *keys;
+    vector_t *values;
 } inlineobj_t;
 
 typedef struct {
@@ -72,10 +124,13 @@ typedef struct _value_t {
     value_type_t type;
     void *value;
     struct _value_t *subvalue;
+    address_t address; // VT_IDENT only
+    property_cache_t *cache; // property links after a dot only
 } value_t;
 
 typedef struct {
-    char name[MAX_IDENT_LENGTH];
+    char *name;
+    int slot;
 } vardecl_t;
 
 typedef struct {
@@ -84,17 +139,48 @@ typedef struct {
 } whilestatement_t;
 
 typedef struct {
-    list_t *statement_list;
-    list_t *function_list;
+    vector_t *statement_list;
+    vector_t *function_list;
+    vector_t *globals; // global slot names, filled in by the resolver
 } ast_t;
 
 typedef struct {
-    tokenizer_t *t;
+    const char *source; // borrowed, see init_tokenizer
+    int source_length;
+    tokenizer_t *t; // only while parse runs
     ast_t *ast;
+    bool lazy;      // only scan function bodies, off by default
+    int threads;    // parse big sources on this many threads, 1 by default
+    bool pipeline;  // lex on a thread of its own while parsing, off by default
+    bool stats;     // parse prints how long lexing and parsing took to stderr
 } parser_t;
 
-void init_parser(parser_t *p, char *source);
+void init_parser(parser_t *p, const char *source, int length);
 void release_parser(parser_t *p);
 void parse(parser_t *p);
 
+// a lazy parse only finds the end of each function body and keeps its
+// source range, the body is parsed by its first call. the source has to
+// outlive the functions then.
+void parse_function_body(funcdef_t *fd);
+
+// parsing input that arrives in pieces, like a pipe: begin_items lexes a
+// source that may stop in the middle of a top level item, parse_item then
+// parses the next item into p->ast. both return false when the source does
+// not hold enough of the item yet, unless at_end says no more input
+// follows; errors are reported as usual then. parsed_length tells how much
+// of the source the parsed items took and the line the rest starts on.
+bool begin_items(parser_t *p, int line, bool at_end);
+bool parse_item(parser_t *p, bool at_end);
+int parsed_length(parser_t *p, int *line);
+void end_items(parser_t *p);
+
+// parses the whole source like parse but returns false on a syntax error
+// instead of exiting, see run_input
+bool parse_input(parser_t *p, bool *incomplete);
+
+// frees a statement that ran and is not needed anymore, functions defined
+// inline in it stay as closures may still refer to them
+void free_statement(statement_t *s);
+
 #endif // parser_h
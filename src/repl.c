@@ -0,0 +1,89 @@
+#define _GNU_SOURCE // for getline
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "interpreter.h"
+#include "repl.h"
+
+static bool is_blank(const char *line)
+{
+    return line[strspn(line, " \t\r\n")] == '\0';
+}
+
+static bool is_command(const char *line, const char *command)
+{
+    int length = strlen(command);
+    return strncmp(line, command, length) == 0 && is_blank(line + length);
+}
+
+void run_repl(void)
+{
+    stream_t *s = open_stream();
+    char *line = 0;
+    size_t line_size = 0;
+    char *input = 0;
+    int length = 0;
+    int capacity = 0;
+    bool timing = false;
+
+    printf("betik repl\n");
+    printf("type :q to quit\n");
+    for (;;)
+    {
+        printf(0 == length ? ">> " : ".. ");
+        fflush(stdout);
+        ssize_t n = getline(&line, &line_size, stdin);
+        if (n < 0)
+        {
+            break;
+        }
+        if (0 == length && is_command(line, ":q"))
+        {
+            break;
+        }
+        if (0 == length && is_command(line, ":time"))
+        {
+            timing = !timing;
+            continue;
+        }
+        bool blank = is_blank(line);
+        if (length + n > capacity)
+        {
+            capacity = 2 * (length + n);
+            input = (char *)realloc(input, capacity);
+        }
+        memcpy(input + length, line, n);
+        length += n;
+
+        bool incomplete;
+        double start = monotonic_seconds();
+        if (run_input(s, input, length, &incomplete))
+        {
+            if (timing)
+            {
+                fflush(stdout);
+                fprintf(stderr, "%.3f ms\n", (monotonic_seconds() - start) * 1000);
+            }
+            length = 0;
+        }
+        else if (!incomplete || blank)
+        {
+            fputs(syntax_error_message(), stderr);
+            length = 0;
+        }
+    }
+    if (length > 0)
+    {
+        bool incomplete;
+        if (!run_input(s, input, length, &incomplete))
+        {
+            fputs(syntax_error_message(), stderr);
+        }
+    }
+    free(line);
+    free(input);
+    close_stream(s);
+}
@@ -0,0 +1,10 @@
+#ifndef repl_h
+#define repl_h
+
+// reads statements from stdin and runs each once it is complete, all of
+// them in one runtime. a statement may span lines, an empty line ends it
+// when it is still incomplete. ":time" toggles printing how long every
+// entry took to parse and run, ":q" or the end of input quits.
+void run_repl(void);
+
+#endif // repl_h
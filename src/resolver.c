@@ -0,0 +1,500 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "resolver.h"
+
+typedef struct _frame_t {
+    funcdef_t *fd; // 0 on the top level
+    struct _frame_t *parent;
+    bool calls_eval;
+} frame_t;
+
+typedef struct {
+    vector_t *globals;
+    vector_t *program_functions;
+    vector_t *functions;
+    frame_t *frame;
+    frame_t *fixed; // a running scope, its slots can not grow
+} resolver_t;
+
+static void resolve_block(resolver_t *r, block_t *b, bool declare);
+static void resolve_expression(resolver_t *r, expression_t *e, bool declare);
+static void resolve_function(resolver_t *r, funcdef_t *fd, frame_t *parent);
+static void resolve_statement(resolver_t *r, statement_t *s, bool declare);
+static void resolve_value(resolver_t *r, value_t *v, bool declare);
+
+static int find_name(vector_t *names, char *name)
+{
+    for (int i = 0; i < vector_count(names); i++)
+    {
+        if (vector_get(names, i) == name)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int add_name(vector_t *names, char *name)
+{
+    vector_push(names, name);
+    return vector_count(names) - 1;
+}
+
+static funcdef_t *find_function_in(vector_t *functions, char *name)
+{
+    for (int i = 0; i < vector_count(functions); i++)
+    {
+        funcdef_t *fd = vector_get(functions, i);
+        if (fd->name == name)
+        {
+            return fd;
+        }
+    }
+    return 0;
+}
+
+// top level functions of the running program come first, they are found
+// first at runtime too
+static funcdef_t *find_program_function(resolver_t *r, char *name)
+{
+    funcdef_t *fd = find_function_in(r->program_functions, name);
+    if (fd == 0 && r->program_functions != r->functions)
+    {
+        fd = find_function_in(r->functions, name);
+    }
+    return fd;
+}
+
+static bool is_function_name(resolver_t *r, char *name)
+{
+    return find_builtin(name) >= 0 || find_program_function(r, name) != 0;
+}
+
+static int find_capture(funcdef_t *fd, char *name)
+{
+    for (int i = 0; i < vector_count(fd->captures); i++)
+    {
+        capture_t *capture = vector_get(fd->captures, i);
+        if (capture->name == name)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// the slot gets a cell when its scope is created, a running scope already
+// has its cells
+static bool capture_slot(resolver_t *r, frame_t *f, int slot)
+{
+    for (int i = 0; i < vector_count(f->fd->captured); i++)
+    {
+        if ((int)(intptr_t)vector_get(f->fd->captured, i) == slot)
+        {
+            return true;
+        }
+    }
+    if (f == r->fixed)
+    {
+        return false;
+    }
+    vector_push(f->fd->captured, (void *)(intptr_t)slot);
+    return true;
+}
+
+// makes a variable of an enclosing function one of the captures of the
+// function of frame f, every function in between captures it too so its
+// closures can hand the cell down. returns the index of the capture or -1
+// when no enclosing function has the name.
+static int capture(resolver_t *r, frame_t *f, char *name)
+{
+    int index = find_capture(f->fd, name);
+    frame_t *parent = f->parent;
+    if (index >= 0 || f == r->fixed || 0 == parent || 0 == parent->fd)
+    {
+        return index;
+    }
+    int slot = find_name(parent->fd->locals, name);
+    bool from_local = slot >= 0;
+    if (from_local ? !capture_slot(r, parent, slot) : (slot = capture(r, parent, name)) < 0)
+    {
+        return -1;
+    }
+    capture_t *c = (capture_t *)malloc(sizeof(capture_t));
+    c->name = name;
+    c->from_local = from_local;
+    c->index = slot;
+    vector_push(f->fd->captures, c);
+    return vector_count(f->fd->captures) - 1;
+}
+
+// looks the name up in the current function, the functions around it and
+// the globals, depth is DEPTH_NONE when the name is not visible
+static address_t lookup(resolver_t *r, char *name)
+{
+    address_t address;
+    frame_t *f = r->frame;
+
+    if (f->fd != 0)
+    {
+        address.depth = 0;
+        address.slot = find_name(f->fd->locals, name);
+        if (address.slot >= 0)
+        {
+            return address;
+        }
+        address.depth = DEPTH_UPVALUE;
+        address.slot = capture(r, f, name);
+        if (address.slot >= 0)
+        {
+            return address;
+        }
+    }
+    address.slot = find_name(r->globals, name);
+    address.depth = address.slot >= 0 ? DEPTH_GLOBAL : DEPTH_NONE;
+    return address;
+}
+
+static bool can_add_locals(resolver_t *r)
+{
+    return r->frame->fd != 0 && r->frame != r->fixed;
+}
+
+// assignments create a variable in the current scope unless the name is
+// already visible, reading an unknown name refers to a global
+static void declare_name(resolver_t *r, char *name)
+{
+    if (lookup(r, name).depth != DEPTH_NONE)
+    {
+        return;
+    }
+    if (can_add_locals(r))
+    {
+        add_name(r->frame->fd->locals, name);
+    }
+    else
+    {
+        add_name(r->globals, name);
+    }
+}
+
+static address_t resolve_name(resolver_t *r, char *name)
+{
+    funcdef_t *fd = r->frame->fd;
+    if (fd != 0 && name == sym_this && (fd->this_slot >= 0 || can_add_locals(r)))
+    {
+        if (fd->this_slot < 0)
+        {
+            fd->this_slot = add_name(fd->locals, name);
+        }
+        address_t address = {0, fd->this_slot};
+        return address;
+    }
+    address_t address = lookup(r, name);
+    if (address.depth == DEPTH_NONE && !is_function_name(r, name))
+    {
+        address.depth = DEPTH_GLOBAL;
+        address.slot = add_name(r->globals, name);
+    }
+    return address;
+}
+
+static void resolve_arguments(resolver_t *r, vector_t *arguments, bool declare)
+{
+    for (int i = 0; i < vector_count(arguments); i++)
+    {
+        resolve_expression(r, vector_get(arguments, i), declare);
+    }
+}
+
+// links the call to a builtin or a top level function when the name is one,
+// anything else calls the variable of that name
+static void resolve_funccall(resolver_t *r, funccall_t *f, bool declare)
+{
+    resolve_arguments(r, f->arguments, declare);
+    if (!declare)
+    {
+        f->address.depth = DEPTH_NONE;
+        f->address.slot = 0;
+        f->tail = false;
+        f->builtin = find_builtin(f->function_name);
+        f->function = f->builtin < 0 ? find_program_function(r, f->function_name) : 0;
+        if (f->builtin >= 0)
+        {
+            f->kind = CALL_BUILTIN;
+            r->frame->calls_eval |= f->function_name == sym_eval;
+        }
+        else if (f->function != 0)
+        {
+            f->kind = CALL_FUNCTION;
+        }
+        else
+        {
+            f->kind = CALL_DYNAMIC;
+            f->address = resolve_name(r, f->function_name);
+        }
+    }
+}
+
+// property names after a dot are not variables
+static void resolve_property(resolver_t *r, value_t *v, bool declare)
+{
+    if (VT_FUNCCALL == v->type)
+    {
+        funccall_t *f = v->value;
+        f->address.depth = DEPTH_NONE;
+        f->kind = CALL_DYNAMIC;
+        f->tail = false;
+        resolve_arguments(r, f->arguments, declare);
+    }
+    else if (VT_LISTINDEX == v->type)
+    {
+        listindex_t *listindex = v->value;
+        listindex->address.depth = DEPTH_NONE;
+        resolve_expression(r, listindex->index, declare);
+    }
+    v->address.depth = DEPTH_NONE;
+    if (v->cache == 0)
+    {
+        v->cache = (property_cache_t *)calloc(1, sizeof(property_cache_t));
+    }
+}
+
+static void resolve_value(resolver_t *r, value_t *v, bool declare)
+{
+    if (VT_LIST == v->type)
+    {
+        vector_t *items = v->value;
+        for (int i = 0; i < vector_count(items); i++)
+        {
+            resolve_value(r, vector_get(items, i), declare);
+        }
+    }
+    else if (VT_LISTINDEX == v->type)
+    {
+        listindex_t *listindex = v->value;
+        resolve_expression(r, listindex->index, declare);
+        if (!declare)
+        {
+            listindex->address = resolve_name(r, listindex->name);
+        }
+    }
+    else if (VT_INLINE_OBJ == v->type)
+    {
+        inlineobj_t *iobj = v->value;
+        for (int i = 0; i < vector_count(iobj->values); i++)
+        {
+            resolve_expression(r, vector_get(iobj->values, i), declare);
+        }
+    }
+    else if (VT_FUNCCALL == v->type)
+    {
+        resolve_funccall(r, v->value, declare);
+    }
+    else if (VT_INLINE_FUNC == v->type)
+    {
+        // the body is resolved once the enclosing scope is complete
+        if (!declare)
+        {
+            resolve_function(r, v->value, r->frame);
+        }
+    }
+    else if (VT_EXPRESSION == v->type)
+    {
+        resolve_expression(r, v->value, declare);
+    }
+    else if (VT_IDENT == v->type)
+    {
+        if (!declare)
+        {
+            v->address = resolve_name(r, v->value);
+        }
+        for (value_t *sub = v->subvalue; sub != 0; sub = sub->subvalue)
+        {
+            resolve_property(r, sub, declare);
+        }
+    }
+}
+
+static void resolve_expression(resolver_t *r, expression_t *e, bool declare)
+{
+    if (declare && vector_count(e->values) == 2 &&
+        (token_type_t)(intptr_t)vector_get(e->binaryops, 0) == TT_OP_ASSIGN)
+    {
+        value_t *target = vector_get(e->values, 0);
+        if (VT_IDENT == target->type && target->subvalue == 0)
+        {
+            declare_name(r, target->value);
+        }
+    }
+    for (int i = 0; i < vector_count(e->values); i++)
+    {
+        resolve_value(r, vector_get(e->values, i), declare);
+    }
+}
+
+// return f(...) in a function body, code eval runs in a function has no
+// call of its own to replace
+static void mark_tail_call(expression_t *e)
+{
+    value_t *v = vector_count(e->values) == 1 ? vector_get(e->values, 0) : 0;
+    if (v != 0 && VT_FUNCCALL == v->type)
+    {
+        funccall_t *f = v->value;
+        f->tail = f->kind != CALL_BUILTIN;
+    }
+}
+
+static void resolve_statement(resolver_t *r, statement_t *s, bool declare)
+{
+    if (s->type == ST_IF)
+    {
+        ifstatement_t *is = s->value;
+        resolve_expression(r, is->expression, declare);
+        resolve_block(r, is->block, declare);
+        if (is->else_block != 0)
+        {
+            resolve_block(r, is->else_block, declare);
+        }
+    }
+    else if (s->type == ST_WHILE)
+    {
+        whilestatement_t *ws = s->value;
+        resolve_expression(r, ws->expression, declare);
+        resolve_block(r, ws->block, declare);
+    }
+    else
+    {
+        resolve_expression(r, s->value, declare);
+    }
+    if (s->type == ST_RETURN && !declare && can_add_locals(r))
+    {
+        mark_tail_call(s->value);
+    }
+}
+
+static void resolve_block(resolver_t *r, block_t *b, bool declare)
+{
+    for (int i = 0; i < vector_count(b->statements); i++)
+    {
+        resolve_statement(r, vector_get(b->statements, i), declare);
+    }
+}
+
+// eval'd code can use any variable in sight, so a function calling eval
+// captures everything the functions around it have and keeps its own
+// variables in cells
+static void capture_all(resolver_t *r, frame_t *frame)
+{
+    for (int i = 0; i < vector_count(frame->fd->locals); i++)
+    {
+        capture_slot(r, frame, i);
+    }
+    for (frame_t *f = frame->parent; f != 0 && f->fd != 0; f = f->parent)
+    {
+        for (int i = 0; i < vector_count(f->fd->locals); i++)
+        {
+            char *name = vector_get(f->fd->locals, i);
+            if (find_name(frame->fd->locals, name) < 0)
+            {
+                capture(r, frame, name);
+            }
+        }
+    }
+}
+
+static void resolve_function(resolver_t *r, funcdef_t *fd, frame_t *parent)
+{
+    frame_t frame = {fd, parent, false};
+    frame_t *saved = r->frame;
+
+    if (0 == fd->block)
+    {
+        if (0 == parent || 0 == parent->fd)
+        {
+            // not parsed yet, prepare_function handles it at the first call
+            return;
+        }
+        // what a function captures has to be known before the scope around
+        // it is created
+        parse_function_body(fd);
+    }
+
+    fd->locals = create_vector();
+    fd->captures = create_vector();
+    fd->captured = create_vector();
+    fd->this_slot = -1;
+    for (int i = 0; i < vector_count(fd->parameters); i++)
+    {
+        vardecl_t *vd = vector_get(fd->parameters, i);
+        vd->slot = add_name(fd->locals, vd->name);
+    }
+    r->frame = &frame;
+    resolve_block(r, fd->block, true);
+    resolve_block(r, fd->block, false);
+    if (frame.calls_eval)
+    {
+        capture_all(r, &frame);
+    }
+    r->frame = saved;
+}
+
+static void resolve_program(resolver_t *r, ast_t *ast, frame_t *top)
+{
+    r->frame = top;
+    for (int i = 0; i < vector_count(ast->statement_list); i++)
+    {
+        resolve_statement(r, vector_get(ast->statement_list, i), true);
+    }
+    for (int i = 0; i < vector_count(ast->statement_list); i++)
+    {
+        resolve_statement(r, vector_get(ast->statement_list, i), false);
+    }
+    for (int i = 0; i < vector_count(ast->function_list); i++)
+    {
+        resolve_function(r, vector_get(ast->function_list, i), 0);
+    }
+}
+
+void resolve(ast_t *ast)
+{
+    resolver_t r;
+    frame_t top = {0, 0, false};
+
+    ast->globals = create_vector();
+    r.globals = ast->globals;
+    r.program_functions = ast->function_list;
+    r.functions = ast->function_list;
+    r.fixed = 0;
+    resolve_program(&r, ast, &top);
+}
+
+void resolve_nested(ast_t *ast, ast_t *program, funcdef_t *enclosing)
+{
+    resolver_t r;
+    frame_t top = {0, 0, false};
+    frame_t frame = {enclosing, &top, false};
+
+    r.globals = program->globals;
+    r.program_functions = program->function_list;
+    r.functions = ast->function_list;
+    r.fixed = enclosing != 0 ? &frame : &top;
+    resolve_program(&r, ast, r.fixed);
+}
+
+void resolve_function_body(funcdef_t *fd, ast_t *program)
+{
+    resolver_t r;
+    frame_t top = {0, 0, false};
+
+    r.globals = program->globals;
+    r.program_functions = program->function_list;
+    r.functions = program->function_list;
+    r.fixed = &top;
+    r.frame = &top;
+    resolve_function(&r, fd, &top);
+}
@@ -0,0 +1,19 @@
+#ifndef resolver_h
+#define resolver_h
+
+#include "parser.h"
+
+// assigns every variable reference in a freshly parsed program a lexical
+// address and builds the global slot table in ast->globals
+void resolve(ast_t *ast);
+
+// resolves code that runs inside an existing program, such as eval'd source.
+// enclosing is the funcdef of the running scope, 0 on the top level. new
+// names become globals of the program.
+void resolve_nested(ast_t *ast, ast_t *program, funcdef_t *enclosing);
+
+// resolves a top level function whose body was parsed after the program was
+// resolved
+void resolve_function_body(funcdef_t *fd, ast_t *program);
+
+#endif // resolver_h
@@ -1,184 +1,769 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
+#include "resolver.h"
 #include "runtime.h"
 
-scope_t *create_scope(runtime_t *rt)
+char *sym_this;
+char *sym_eval;
+
+void init_symbols(void)
+{
+    sym_this = intern("this");
+    sym_eval = intern("eval");
+}
+
+static size_t scope_size(int slot_count)
+{
+    return sizeof(scope_t) + slot_count * (sizeof(variable_t *) + sizeof(variable_t));
+}
+
+void init_pools(runtime_t *rt)
+{
+    init_pool(&rt->object_pool, sizeof(object_t));
+    init_pool(&rt->variable_pool, sizeof(variable_t));
+    init_pool(&rt->upvalue_pool, sizeof(upvalue_t));
+    for (int i = 0; i < SCOPE_SIZE_CLASSES; i++)
+    {
+        init_pool(&rt->scope_pools[i], scope_size(2 << i));
+    }
+}
+
+// everything allocated from the pools goes away at once
+void destroy_pools(runtime_t *rt)
+{
+    destroy_pool(&rt->object_pool);
+    destroy_pool(&rt->variable_pool);
+    destroy_pool(&rt->upvalue_pool);
+    for (int i = 0; i < SCOPE_SIZE_CLASSES; i++)
+    {
+        destroy_pool(&rt->scope_pools[i]);
+    }
+}
+
+upvalue_t *create_upvalue(runtime_t *rt, char *name)
+{
+    upvalue_t *u = (upvalue_t *)pool_alloc(&rt->upvalue_pool);
+    u->var.name = name;
+    u->var.obj = 0;
+    u->reference_count = 1;
+    return u;
+}
+
+void release_upvalue(runtime_t *rt, variable_t *var)
+{
+    upvalue_t *u = (upvalue_t *)var;
+    u->reference_count -= 1;
+    if (u->reference_count == 0)
+    {
+        pool_free(&rt->upvalue_pool, u);
+    }
+}
+
+// a function scope is a single allocation holding the slot pointers and the
+// variables themselves, except for the captured ones which get cells. the
+// global scope grows with grow_global_scope.
+scope_t *create_scope(runtime_t *rt, funcdef_t *fd, object_t *closure)
 {
-    scope_t *scope = (scope_t *)malloc(sizeof(scope_t));
-    scope->variables = create_list();
+    int slot_count = fd != 0 ? vector_count(fd->locals) : 0;
+    int size_class = 0;
+    while (size_class < SCOPE_SIZE_CLASSES && (2 << size_class) < slot_count)
+    {
+        size_class++;
+    }
+    scope_t *scope;
+    if (size_class < SCOPE_SIZE_CLASSES)
+    {
+        scope = (scope_t *)pool_alloc(&rt->scope_pools[size_class]);
+    }
+    else
+    {
+        scope = (scope_t *)malloc(scope_size(slot_count));
+        size_class = -1;
+    }
+    variable_t *variables = (variable_t *)((variable_t **)(scope + 1) + slot_count);
+
+    scope->slots = (variable_t **)(scope + 1);
+    scope->slot_count = slot_count;
+    if (slot_count > 0)
+    {
+        for (int i = 0; i < slot_count; i++)
+        {
+            scope->slots[i] = &variables[i];
+            variables[i].name = fd->locals->items[i];
+            variables[i].obj = 0;
+        }
+    }
+    if (fd != 0)
+    {
+        for (int i = 0; i < vector_count(fd->captured); i++)
+        {
+            int slot = (int)(intptr_t)vector_get(fd->captured, i);
+            scope->slots[slot] = &create_upvalue(rt, variables[slot].name)->var;
+        }
+    }
+    scope->closure = closure;
+    scope->upvalues = closure != 0 ? closure->upvalues : 0;
+    scope->fd = fd;
     scope->reference_count = 1;
+    scope->gc_cycle = 0;
+    scope->size_class = size_class;
     return scope;
 }
 
-void destroy_scope(scope_t *s)
+void destroy_scope(runtime_t *rt, scope_t *s)
 {
-    destroy_list(s->variables);
-    free(s);
+    if (s->fd != 0)
+    {
+        for (int i = 0; i < vector_count(s->fd->captured); i++)
+        {
+            release_upvalue(rt, s->slots[(int)(intptr_t)vector_get(s->fd->captured, i)]);
+        }
+    }
+    if (s->slots != (variable_t **)(s + 1))
+    {
+        for (int i = 0; i < s->slot_count; i++)
+        {
+            pool_free(&rt->variable_pool, s->slots[i]);
+        }
+        free(s->slots);
+    }
+    if (s->size_class >= 0)
+    {
+        pool_free(&rt->scope_pools[s->size_class], s);
+    }
+    else
+    {
+        free(s);
+    }
+}
+
+#define NATIVE_STACK_MARGIN (256 * 1024)
+
+void stack_overflow(void)
+{
+    fprintf(stderr, "stack overflow\n");
+    exit(EXIT_FAILURE);
 }
 
-variable_t *get_variable(runtime_t *rt, char *variable_name)
+// the tree walker and eval'd code recurse on the C stack, they stop well
+// before it runs out. base is an address near the bottom of the stack.
+void init_native_stack(runtime_t *rt, char *base)
 {
-    int i;
-    for (i = 0; i < list_get_item_count(rt->current_scope->variables); i++)
+    size_t size = 1024 * 1024;
+#ifndef _WIN32
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0)
     {
-        variable_t *var = list_get_item(rt->current_scope->variables, i);
-        if (strcmp(variable_name, var->name) == 0)
+        size = RLIM_INFINITY == limit.rlim_cur ? rt->stack_limit : limit.rlim_cur;
+    }
+#endif
+    size = size > 2 * NATIVE_STACK_MARGIN ? size - NATIVE_STACK_MARGIN : size / 2;
+    rt->native_stack_base = base;
+    rt->native_stack_limit = size < rt->stack_limit ? size : rt->stack_limit;
+}
+
+void check_native_stack(runtime_t *rt)
+{
+    char here;
+    size_t used = rt->native_stack_base > &here ? rt->native_stack_base - &here : &here - rt->native_stack_base;
+    if (used > rt->native_stack_limit)
+    {
+        stack_overflow();
+    }
+}
+
+// variables of the global scope are allocated one by one so they keep their
+// address when eval'd code adds new globals
+void grow_global_scope(runtime_t *rt)
+{
+    scope_t *s = rt->global_scope;
+    int slot_count = vector_count(rt->ast->globals);
+
+    if (slot_count <= s->slot_count)
+    {
+        return;
+    }
+    variable_t **slots = (variable_t **)malloc(slot_count * sizeof(variable_t *));
+    for (int i = 0; i < slot_count; i++)
+    {
+        if (i < s->slot_count)
+        {
+            slots[i] = s->slots[i];
+        }
+        else
+        {
+            slots[i] = (variable_t *)pool_alloc(&rt->variable_pool);
+            slots[i]->name = vector_get(rt->ast->globals, i);
+            slots[i]->obj = 0;
+        }
+    }
+    if (s->slots != (variable_t **)(s + 1))
+    {
+        free(s->slots);
+    }
+    s->slots = slots;
+    s->slot_count = slot_count;
+}
+
+variable_t *lookup_variable(runtime_t *rt, address_t *address)
+{
+    if (DEPTH_GLOBAL == address->depth)
+    {
+        return rt->global_scope->slots[address->slot];
+    }
+    if (DEPTH_UPVALUE == address->depth)
+    {
+        return rt->current_scope->upvalues[address->slot];
+    }
+    return rt->current_scope->slots[address->slot];
+}
+
+// prepares code that will run in the current scope, like eval'd source
+void resolve_in_scope(runtime_t *rt, ast_t *ast)
+{
+    resolve_nested(ast, rt->ast, rt->current_scope->fd);
+    grow_global_scope(rt);
+
+    // merge functions to current runtime
+    for (int i = 0; i < vector_count(ast->function_list); i++)
+    {
+        vector_push(rt->ast->function_list, vector_get(ast->function_list, i));
+    }
+}
+
+// a lazily parsed function gets its body parsed and resolved by the first
+// call or, for an inline one, when its closure is created. functions inside
+// others are resolved with them, so only top level ones get here.
+void prepare_function(runtime_t *rt, funcdef_t *fd)
+{
+    if (0 == fd->block)
+    {
+        parse_function_body(fd);
+    }
+    resolve_function_body(fd, rt->ast);
+    grow_global_scope(rt);
+}
+
+// the closure shares the cells of the variables it captures with the scope
+// it is created in
+object_t *create_closure(runtime_t *rt, funcdef_t *fd)
+{
+    if (0 == fd->locals)
+    {
+        prepare_function(rt, fd);
+    }
+    object_t *obj = create_object(rt, OBJ_FUNCTION);
+    obj->data = fd;
+    int count = vector_count(fd->captures);
+    if (count > 0)
+    {
+        scope_t *s = rt->current_scope;
+        variable_t **upvalues = (variable_t **)malloc(count * sizeof(variable_t *));
+        for (int i = 0; i < count; i++)
         {
-            return var;
+            capture_t *capture = vector_get(fd->captures, i);
+            upvalues[i] = capture->from_local ? s->slots[capture->index] : s->upvalues[capture->index];
+            ((upvalue_t *)upvalues[i])->reference_count += 1;
         }
+        obj->upvalues = upvalues;
+        rt->heap_bytes += count * sizeof(variable_t *);
     }
-    for (i = 0; i < list_get_item_count(rt->global_scope->variables); i++)
+    return obj;
+}
+
+funcdef_t *find_function(runtime_t *rt, char *name)
+{
+    for (int i = 0; i < vector_count(rt->ast->function_list); i++)
     {
-        variable_t *var = list_get_item(rt->global_scope->variables, i);
-        if (strcmp(variable_name, var->name) == 0)
+        funcdef_t *fd = vector_get(rt->ast->function_list, i);
+        if (fd->name == name)
         {
-            return var;
+            return fd;
         }
     }
     return 0;
 }
 
-variable_t *create_variable(runtime_t *rt, char *variable_name)
+// temporaries live in fixed size blocks so their addresses stay valid while
+// the register file grows, rt->temp_count works as a stack pointer
+variable_t *create_temporary(runtime_t *rt, object_t *obj)
 {
-    variable_t *var = (variable_t *)malloc(sizeof(variable_t));
-    var->name = variable_name;
-    var->obj = 0;
-    list_insert(rt->current_scope->variables, var);
-
+    int block = rt->temp_count / TEMP_BLOCK_SIZE;
+    if (block == rt->temp_block_count)
+    {
+        rt->temp_blocks = (variable_t **)realloc(rt->temp_blocks, (block + 1) * sizeof(variable_t *));
+        rt->temp_blocks[block] = (variable_t *)malloc(TEMP_BLOCK_SIZE * sizeof(variable_t));
+        rt->temp_block_count++;
+    }
+    variable_t *var = &rt->temp_blocks[block][rt->temp_count % TEMP_BLOCK_SIZE];
+    rt->temp_count++;
+    var->name = "#";
+    var->obj = obj;
     return var;
 }
 
+void release_temporaries(runtime_t *rt, int mark)
+{
+    rt->temp_count = mark;
+}
+
+void destroy_temporaries(runtime_t *rt)
+{
+    for (int i = 0; i < rt->temp_block_count; i++)
+    {
+        free(rt->temp_blocks[i]);
+    }
+    free(rt->temp_blocks);
+    rt->temp_blocks = 0;
+    rt->temp_block_count = 0;
+    rt->temp_count = 0;
+}
+
+shape_t *create_shape(void)
+{
+    shape_t *shape = (shape_t *)malloc(sizeof(shape_t));
+    shape->keys = 0;
+    shape->slot_count = 0;
+    shape->transitions = 0;
+    shape->transition_count = 0;
+    return shape;
+}
+
+void destroy_shape(shape_t *shape)
+{
+    for (int i = 0; i < shape->transition_count; i++)
+    {
+        destroy_shape(shape->transitions[i]);
+    }
+    free(shape->transitions);
+    free(shape->keys);
+    free(shape);
+}
+
+static int find_slot(shape_t *shape, char *key)
+{
+    for (int i = 0; i < shape->slot_count; i++)
+    {
+        if (shape->keys[i] == key)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static shape_t *shape_transition(shape_t *shape, char *key)
+{
+    for (int i = 0; i < shape->transition_count; i++)
+    {
+        shape_t *next = shape->transitions[i];
+        if (next->keys[shape->slot_count] == key)
+        {
+            return next;
+        }
+    }
+    shape_t *next = create_shape();
+    next->slot_count = shape->slot_count + 1;
+    next->keys = (char **)malloc(next->slot_count * sizeof(char *));
+    for (int i = 0; i < shape->slot_count; i++)
+    {
+        next->keys[i] = shape->keys[i];
+    }
+    next->keys[shape->slot_count] = key;
+    shape->transitions = (shape_t **)realloc(shape->transitions, (shape->transition_count + 1) * sizeof(shape_t *));
+    shape->transitions[shape->transition_count++] = next;
+    return next;
+}
+
+// returns the slot of the new property
+static int add_property(runtime_t *rt, object_t *base, char *key)
+{
+    int slot = base->shape->slot_count;
+    if (slot == base->slot_capacity)
+    {
+        base->slot_capacity = base->slot_capacity ? base->slot_capacity * 2 : 4;
+        base->slots = (variable_t **)realloc(base->slots, base->slot_capacity * sizeof(variable_t *));
+    }
+    variable_t *prop = (variable_t *)pool_alloc(&rt->variable_pool);
+    rt->heap_bytes += sizeof(variable_t) + sizeof(variable_t *);
+    prop->name = key;
+    prop->obj = 0;
+    base->slots[slot] = prop;
+    base->shape = shape_transition(base->shape, key);
+    return slot;
+}
+
 object_t *create_object(runtime_t *rt, object_type_t obj_type)
 {
-    object_t *obj = (object_t *)malloc(sizeof(object_t));
+    object_t *obj = (object_t *)pool_alloc(&rt->object_pool);
 
     obj->type = obj_type;
-    obj->reference_count = 0;
+    obj->gc_flags = 0;
+    obj->next = rt->heap;
+    rt->heap = obj;
+    rt->heap_bytes += sizeof(object_t);
     obj->data = 0;
-    obj->scope = 0;
-    obj->properties = create_list();
+    obj->upvalues = 0;
+    obj->shape = rt->empty_shape;
+    obj->slots = 0;
+    obj->slot_capacity = 0;
+
+    return obj;
+}
+
+object_t *create_string(runtime_t *rt, char *str, int owns_data)
+{
+    object_t *obj = create_object(rt, OBJ_STRING);
+    obj->data = str;
+    if (owns_data)
+    {
+        obj->gc_flags |= GC_OWNS_DATA;
+        rt->heap_bytes += strlen(str) + 1;
+    }
+    return obj;
+}
 
+object_t *create_list_object(runtime_t *rt, int capacity)
+{
+    object_t *obj = create_object(rt, OBJ_LIST);
+    array_t *array = (array_t *)malloc(sizeof(array_t));
+    array->items = capacity > 0 ? (object_t **)malloc(capacity * sizeof(object_t *)) : 0;
+    array->count = 0;
+    array->capacity = capacity;
+    obj->data = array;
+    rt->heap_bytes += sizeof(array_t) + capacity * sizeof(object_t *);
     return obj;
 }
 
-variable_t *get_property(runtime_t *rt, variable_t *var, char *property_name)
+static void array_check_index(array_t *array, int index)
 {
-    for (int i = 0; i < list_get_item_count(var->obj->properties); i++)
+    if (index < 0 || index >= array->count)
     {
-        variable_t *p = (variable_t *)list_get_item(var->obj->properties, i);
-        if (strcmp(p->name, property_name) == 0)
+        fprintf(stderr, "list index out of range: %d\n", index);
+        exit(EXIT_FAILURE);
+    }
+}
+
+object_t *array_get(object_t *list, int index)
+{
+    array_check_index(ARRAY(list), index);
+    return ARRAY(list)->items[index];
+}
+
+void array_set(object_t *list, int index, object_t *item)
+{
+    array_check_index(ARRAY(list), index);
+    ARRAY(list)->items[index] = item;
+}
+
+static void array_reserve(runtime_t *rt, array_t *array, int capacity)
+{
+    if (capacity <= array->capacity)
+    {
+        return;
+    }
+    int new_capacity = array->capacity ? array->capacity * 2 : 4;
+    if (new_capacity < capacity)
+    {
+        new_capacity = capacity;
+    }
+    array->items = (object_t **)realloc(array->items, new_capacity * sizeof(object_t *));
+    rt->heap_bytes += (new_capacity - array->capacity) * sizeof(object_t *);
+    array->capacity = new_capacity;
+}
+
+void array_push(runtime_t *rt, object_t *list, object_t *item)
+{
+    array_t *array = ARRAY(list);
+    array_reserve(rt, array, array->count + 1);
+    array->items[array->count++] = item;
+}
+
+object_t *array_pop(object_t *list)
+{
+    array_t *array = ARRAY(list);
+    if (array->count == 0)
+    {
+        fprintf(stderr, "pop from empty list\n");
+        exit(EXIT_FAILURE);
+    }
+    return array->items[--array->count];
+}
+
+// index may be the length of the list, which appends
+void array_insert(runtime_t *rt, object_t *list, int index, object_t *item)
+{
+    array_t *array = ARRAY(list);
+    if (index < 0 || index > array->count)
+    {
+        fprintf(stderr, "list index out of range: %d\n", index);
+        exit(EXIT_FAILURE);
+    }
+    array_reserve(rt, array, array->count + 1);
+    memmove(&array->items[index + 1], &array->items[index], (array->count - index) * sizeof(object_t *));
+    array->items[index] = item;
+    array->count++;
+}
+
+// a new list with the items from start up to end, both are clamped
+object_t *array_slice(runtime_t *rt, object_t *list, int start, int end)
+{
+    array_t *array = ARRAY(list);
+    start = start < 0 ? 0 : start;
+    end = end > array->count ? array->count : end;
+    int count = end > start ? end - start : 0;
+    object_t *slice = create_list_object(rt, count);
+    if (count > 0)
+    {
+        memcpy(ARRAY(slice)->items, &array->items[start], count * sizeof(object_t *));
+    }
+    ARRAY(slice)->count = count;
+    return slice;
+}
+
+// property names are symbols, a missing property is added to the object
+variable_t *get_property(runtime_t *rt, object_t *base, char *property_name)
+{
+    int slot = find_slot(base->shape, property_name);
+    if (slot < 0)
+    {
+        slot = add_property(rt, base, property_name);
+    }
+    return base->slots[slot];
+}
+
+variable_t *cached_property(runtime_t *rt, object_t *base, char *property_name, property_cache_t *cache)
+{
+    shape_t *shape = base->shape;
+    for (int i = 0; i < PROPERTY_CACHE_WAYS; i++)
+    {
+        if (cache->shapes[i] == shape)
         {
-            return p;
+            return base->slots[cache->slots[i]];
         }
     }
-    variable_t *new_prop = (variable_t *)malloc(sizeof(variable_t));
-    new_prop->name = duplicate_string(property_name);
-    new_prop->obj = 0;
-    list_insert(var->obj->properties, new_prop);
-    return new_prop;
+    int slot = find_slot(shape, property_name);
+    if (slot < 0)
+    {
+        slot = add_property(rt, base, property_name);
+    }
+    // a full cache keeps replacing its last way
+    int way = 0;
+    while (way < PROPERTY_CACHE_WAYS - 1 && cache->shapes[way] != 0)
+    {
+        way++;
+    }
+    cache->shapes[way] = base->shape;
+    cache->slots[way] = slot;
+    return base->slots[slot];
 }
 
 void set_property(runtime_t *rt, object_t *base, char *key, variable_t *value)
 {
-    variable_t *new_prop = (variable_t *)malloc(sizeof(variable_t));
-    new_prop->name = duplicate_string(key);
-    new_prop->obj = value->obj;
-    list_insert(base->properties, new_prop);
+    get_property(rt, base, key)->obj = value->obj;
 }
 
-variable_t *call_variable_op(runtime_t *rt, variable_t *var1, variable_t *var2, token_type_t tok)
+object_t *concat_strings(runtime_t *rt, object_t *obj1, object_t *obj2)
+{
+    char *tmp = (char *)malloc(strlen(obj1->data) + strlen(obj2->data) + 1);
+    strcpy(tmp, obj1->data);
+    strcat(tmp, obj2->data);
+    return create_string(rt, tmp, true);
+}
+
+object_t *binary_op(runtime_t *rt, object_t *obj1, object_t *obj2, token_type_t tok)
 {
-    variable_t *var = create_variable(rt, "#");
-    var->obj = create_object(rt, OBJ_NUMBER);
-    var->obj->reference_count += 1;
+    if (TT_OP_ADD == tok && obj1->type == OBJ_STRING && obj2->type == OBJ_STRING)
+    {
+        return concat_strings(rt, obj1, obj2);
+    }
+    object_t *obj = create_object(rt, OBJ_NUMBER);
     if (TT_OP_ADD == tok)
     {
-        if (var1->obj->type == OBJ_NUMBER)
+        if (obj1->type == OBJ_NUMBER)
         {
-            var->obj->data = (void *)((int)var1->obj->data + (int)var2->obj->data);
+            obj->data = NUMBER_DATA(NUMBER_VALUE(obj1) + NUMBER_VALUE(obj2));
         }
-        else if (var1->obj->type == OBJ_STRING)
+        else if (obj1->type == OBJ_STRING)
         {
-            var->obj->type = OBJ_STRING;
-            if (var2->obj->type == OBJ_STRING)
-            {
-                char *tmp = (char *)malloc(strlen(var1->obj->data) + strlen(var2->obj->data) + 1);
-                strcpy(tmp, var1->obj->data);
-                strcat(tmp, var2->obj->data);
-                var->obj->data = tmp;
-            }
-            else if (var2->obj->type == OBJ_NUMBER)
+            obj->type = OBJ_STRING;
+            if (obj2->type == OBJ_NUMBER)
             {
-                char *tmp = (char *)malloc(strlen(var1->obj->data) + 16);
-                strcpy(tmp, var1->obj->data);
+                char *tmp = (char *)malloc(strlen(obj1->data) + 16);
+                strcpy(tmp, obj1->data);
                 char tmp2[16];
-                sprintf(tmp2, "%d", (int)var2->obj->data);
+                sprintf(tmp2, "%d", NUMBER_VALUE(obj2));
                 strcat(tmp, tmp2);
-                var->obj->data = tmp;
+                obj->data = tmp;
+                obj->gc_flags |= GC_OWNS_DATA;
+                rt->heap_bytes += strlen(tmp) + 1;
             }
         }
     }
     else if (TT_OP_SUB == tok)
     {
-        var->obj->data = (void *)((int)var1->obj->data - (int)var2->obj->data);
+        obj->data = NUMBER_DATA(NUMBER_VALUE(obj1) - NUMBER_VALUE(obj2));
     }
     else if (TT_OP_MUL == tok)
     {
-        var->obj->data = (void *)((int)var1->obj->data * (int)var2->obj->data);
+        obj->data = NUMBER_DATA(NUMBER_VALUE(obj1) * NUMBER_VALUE(obj2));
     }
     else if (TT_OP_DIV == tok)
     {
-        if (0 == (int)var2->obj->data)
+        if (0 == NUMBER_VALUE(obj2))
         {
             fprintf(stderr, "Division by zero\n");
             exit(EXIT_FAILURE);
         }
-        var->obj->data = (void *)((int)var1->obj->data / (int)var2->obj->data);
+        obj->data = NUMBER_DATA(NUMBER_VALUE(obj1) / NUMBER_VALUE(obj2));
     }
     else if (TT_OP_GT == tok)
     {
-        var->obj->data = (void *)((int)var1->obj->data > (int)var2->obj->data);
+        obj->data = NUMBER_DATA(NUMBER_VALUE(obj1) > NUMBER_VALUE(obj2));
     }
     else if (TT_OP_GTE == tok)
     {
-        var->obj->data = (void *)((int)var1->obj->data >= (int)var2->obj->data);
+        obj->data = NUMBER_DATA(NUMBER_VALUE(obj1) >= NUMBER_VALUE(obj2));
     }
     else if (TT_OP_LT == tok)
     {
-        var->obj->data = (void *)((int)var1->obj->data < (int)var2->obj->data);
+        obj->data = NUMBER_DATA(NUMBER_VALUE(obj1) < NUMBER_VALUE(obj2));
     }
     else if (TT_OP_LTE == tok)
     {
-        var->obj->data = (void *)((int)var1->obj->data <= (int)var2->obj->data);
+        obj->data = NUMBER_DATA(NUMBER_VALUE(obj1) <= NUMBER_VALUE(obj2));
     }
     else if (TT_OP_EQUAL == tok)
     {
-        if (var1->obj->type == OBJ_NUMBER)
+        if (obj1->type == OBJ_NUMBER)
         {
-            var->obj->data = (void *)((int)var1->obj->data == (int)var2->obj->data);
+            obj->data = NUMBER_DATA(NUMBER_VALUE(obj1) == NUMBER_VALUE(obj2));
         }
         else
         {
-            var->obj->data = (void *)(strcmp((char *)var1->obj->data, (char *)var2->obj->data) == 0);
+            obj->data = NUMBER_DATA(strcmp((char *)obj1->data, (char *)obj2->data) == 0);
         }
     }
     else if (TT_OP_NOTEQUAL == tok)
     {
-        if (var1->obj->type == OBJ_NUMBER)
+        if (obj1->type == OBJ_NUMBER)
         {
-            var->obj->data = (void *)((int)var1->obj->data != (int)var2->obj->data);
+            obj->data = NUMBER_DATA(NUMBER_VALUE(obj1) != NUMBER_VALUE(obj2));
         }
         else
         {
-            var->obj->data = (void *)(strcmp((char *)var1->obj->data, (char *)var2->obj->data) != 0);
+            obj->data = NUMBER_DATA(strcmp((char *)obj1->data, (char *)obj2->data) != 0);
+        }
+    }
+    return obj;
+}
+
+quick_op_t quicken_op(object_t *obj1, object_t *obj2, token_type_t tok)
+{
+    if (0 == obj1 || 0 == obj2 || obj1->type != obj2->type)
+    {
+        return QUICK_GENERIC;
+    }
+    if (OBJ_NUMBER == obj1->type)
+    {
+        switch (tok)
+        {
+        case TT_OP_ADD: return QUICK_NUMBER_ADD;
+        case TT_OP_SUB: return QUICK_NUMBER_SUB;
+        case TT_OP_MUL: return QUICK_NUMBER_MUL;
+        case TT_OP_GT: return QUICK_NUMBER_GT;
+        case TT_OP_GTE: return QUICK_NUMBER_GTE;
+        case TT_OP_LT: return QUICK_NUMBER_LT;
+        case TT_OP_LTE: return QUICK_NUMBER_LTE;
+        case TT_OP_EQUAL: return QUICK_NUMBER_EQUAL;
+        case TT_OP_NOTEQUAL: return QUICK_NUMBER_NOTEQUAL;
+        default: return QUICK_GENERIC;
+        }
+    }
+    if (OBJ_STRING == obj1->type)
+    {
+        switch (tok)
+        {
+        case TT_OP_ADD: return QUICK_STRING_ADD;
+        case TT_OP_EQUAL: return QUICK_STRING_EQUAL;
+        case TT_OP_NOTEQUAL: return QUICK_STRING_NOTEQUAL;
+        default: return QUICK_GENERIC;
+        }
+    }
+    return QUICK_GENERIC;
+}
+
+object_t *quick_op(runtime_t *rt, quick_op_t q, object_t *obj1, object_t *obj2)
+{
+    if (0 == obj1 || 0 == obj2)
+    {
+        return 0;
+    }
+    if (q >= QUICK_STRING_ADD)
+    {
+        if (obj1->type != OBJ_STRING || obj2->type != OBJ_STRING)
+        {
+            return 0;
         }
+        if (QUICK_STRING_ADD == q)
+        {
+            return concat_strings(rt, obj1, obj2);
+        }
+        int equal = strcmp((char *)obj1->data, (char *)obj2->data) == 0;
+        object_t *obj = create_object(rt, OBJ_NUMBER);
+        obj->data = NUMBER_DATA(QUICK_STRING_EQUAL == q ? equal : !equal);
+        return obj;
+    }
+    if (obj1->type != OBJ_NUMBER || obj2->type != OBJ_NUMBER)
+    {
+        return 0;
     }
-    else if (TT_OP_ASSIGN == tok)
+    int a = NUMBER_VALUE(obj1);
+    int b = NUMBER_VALUE(obj2);
+    int result = 0;
+    switch (q)
     {
+    case QUICK_NUMBER_ADD: result = a + b; break;
+    case QUICK_NUMBER_SUB: result = a - b; break;
+    case QUICK_NUMBER_MUL: result = a * b; break;
+    case QUICK_NUMBER_GT: result = a > b; break;
+    case QUICK_NUMBER_GTE: result = a >= b; break;
+    case QUICK_NUMBER_LT: result = a < b; break;
+    case QUICK_NUMBER_LTE: result = a <= b; break;
+    case QUICK_NUMBER_EQUAL: result = a == b; break;
+    case QUICK_NUMBER_NOTEQUAL: result = a != b; break;
+    default: return 0;
+    }
+    object_t *obj = create_object(rt, OBJ_NUMBER);
+    obj->data = NUMBER_DATA(result);
+    return obj;
+}
+
+variable_t *call_variable_op(runtime_t *rt, variable_t *var1, variable_t *var2, token_type_t tok)
+{
+    if (TT_OP_ASSIGN == tok)
+    {
+        variable_t *var = create_temporary(rt, create_object(rt, OBJ_NUMBER));
         var1->obj = var2->obj;
-        var2->obj->reference_count += 1;
+        return var;
+    }
+    return create_temporary(rt, binary_op(rt, var1->obj, var2->obj, tok));
+}
+
+void print_object(object_t *obj)
+{
+    if (OBJ_NUMBER == obj->type)
+    {
+        printf("%d", NUMBER_VALUE(obj));
+    }
+    else if (OBJ_STRING == obj->type)
+    {
+        printf("%s", (char *)obj->data);
     }
-    return var;
 }
@@ -1,6 +1,9 @@
 #ifndef runtime_h
 #define runtime_h
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "common.h"
 #include "parser.h"
 
@@ -13,42 +16,192 @@ typedef enum
     OBJ_LIST,
 } object_type_t;
 
-typedef struct
+typedef struct _scope_t
 {
-    list_t *variables;
-    int reference_count;
+    struct _variable_t **slots;
+    int slot_count;
+    struct _object_t *closure; // callee, 0 for a call by name
+    struct _variable_t **upvalues; // cells of the closure
+    funcdef_t *fd;           // layout of the slots, 0 for the global scope
+    int reference_count;     // call frames
+    unsigned gc_cycle;       // last collection that marked the scope
+    int size_class;          // scope pool it came from, -1 when malloc'd
 } scope_t;
 
-typedef struct
+// objects that got the same properties in the same order share a shape,
+// the shape maps property names to slots of the object
+typedef struct _shape_t
+{
+    char **keys; // symbols by slot
+    int slot_count;
+    struct _shape_t **transitions; // shapes with one more property
+    int transition_count;
+} shape_t;
+
+#define GC_MARKED 1
+#define GC_OWNS_DATA 2 // string data is freed with the object
+
+typedef struct _object_t
 {
     object_type_t type;
-    int reference_count;
+    unsigned char gc_flags;
+    struct _object_t *next; // all objects of the runtime, for the sweep
     void *data;
-    scope_t *scope;
-    list_t *properties;
+    struct _variable_t **upvalues; // captured variables of a closure
+    shape_t *shape;
+    struct _variable_t **slots;
+    int slot_capacity;
 } object_t;
 
+// backing store of OBJ_LIST objects
 typedef struct
+{
+    object_t **items;
+    int count;
+    int capacity;
+} array_t;
+
+#define ARRAY(obj) ((array_t *)(obj)->data)
+
+#define NUMBER_VALUE(obj) ((int)(intptr_t)(obj)->data)
+#define NUMBER_DATA(n) ((void *)(intptr_t)(n))
+
+typedef struct _variable_t
 {
     char *name;
     object_t *obj;
 } variable_t;
 
+// a local variable closures capture lives in a cell of its own, shared by
+// the scope and the closures until the last of them lets go
+typedef struct
+{
+    variable_t var;
+    int reference_count;
+} upvalue_t;
+
+typedef struct
+{
+    int collections;
+    double total_pause; // seconds
+    double max_pause;
+    size_t freed_objects;
+    size_t peak_bytes;
+} gc_stats_t;
+
+// scopes with up to 2, 4, 8, 16 or 32 slots come from pools
+#define SCOPE_SIZE_CLASSES 5
+
+// a betik call the vm is running, it keeps what the caller needs to go on
+// once the callee returns
 typedef struct
 {
+    struct _chunk_t *chunk;
+    unsigned char *ip;
+    int base;       // start of the operand stack of the caller
+    scope_t *scope; // scope of the caller
+} call_frame_t;
+
+typedef struct _runtime_t
+{
+    pool_t object_pool;
+    pool_t variable_pool;
+    pool_t upvalue_pool;
+    pool_t scope_pools[SCOPE_SIZE_CLASSES];
     btk_stack_t *scopes;
+    shape_t *empty_shape;
     scope_t *global_scope;
     scope_t *current_scope;
     ast_t *ast;
+    object_t **stack;
+    int stack_top;
+    int stack_capacity;
+    call_frame_t *frames; // calls the vm is in, the C stack does not grow with them
+    int frame_count;
+    int frame_capacity;
+    size_t stack_limit;   // bytes the frames and the operand stack may take
+    char *native_stack_base; // where the runtime started on the C stack
+    size_t native_stack_limit;
+    variable_t **temp_blocks;
+    int temp_block_count;
+    int temp_count;
+    void (*execute)(struct _runtime_t *rt, vector_t *statements); // runs eval'd code
+    list_t *chunks;       // compiled code alive, their constants are roots
+    struct _eval_cache_t *eval_cache; // see evalcache.h, 0 until the first eval
+    object_t *heap;       // every object, linked through object_t::next
+    size_t heap_bytes;    // estimate of the memory held by the objects
+    size_t next_gc;       // heap_bytes that triggers the next collection
+    size_t heap_limit;    // live bytes allowed after a collection, 0 for no limit
+    unsigned gc_cycle;
+    gc_stats_t gc_stats;
 } runtime_t;
 
-scope_t *create_scope(runtime_t *rt);
-void destroy_scope(scope_t *s);
-variable_t *get_variable(runtime_t *rt, char *variable_name);
-variable_t *create_variable(runtime_t *rt, char *variable_name);
+// names the runtime compares against, interned by init_symbols
+extern char *sym_this;
+extern char *sym_eval;
+
+void init_symbols(void);
+void init_pools(runtime_t *rt);
+void destroy_pools(runtime_t *rt);
+#define TEMP_BLOCK_SIZE 256
+
+scope_t *create_scope(runtime_t *rt, funcdef_t *fd, object_t *closure);
+void destroy_scope(runtime_t *rt, scope_t *s);
+upvalue_t *create_upvalue(runtime_t *rt, char *name);
+void release_upvalue(runtime_t *rt, variable_t *var);
+void grow_global_scope(runtime_t *rt);
+void init_native_stack(runtime_t *rt, char *base);
+void check_native_stack(runtime_t *rt);
+void stack_overflow(void);
+variable_t *lookup_variable(runtime_t *rt, address_t *address);
+void resolve_in_scope(runtime_t *rt, ast_t *ast);
+void prepare_function(runtime_t *rt, funcdef_t *fd);
+object_t *create_closure(runtime_t *rt, funcdef_t *fd);
+funcdef_t *find_function(runtime_t *rt, char *name);
+variable_t *create_temporary(runtime_t *rt, object_t *obj);
+void release_temporaries(runtime_t *rt, int mark);
+void destroy_temporaries(runtime_t *rt);
+shape_t *create_shape(void);
+void destroy_shape(shape_t *shape);
 object_t *create_object(runtime_t *rt, object_type_t obj_type);
-variable_t *get_property(runtime_t *rt, variable_t *var, char *property_name);
+object_t *create_string(runtime_t *rt, char *str, int owns_data);
+object_t *create_list_object(runtime_t *rt, int capacity);
+object_t *array_get(object_t *list, int index);
+void array_set(object_t *list, int index, object_t *item);
+void array_push(runtime_t *rt, object_t *list, object_t *item);
+object_t *array_pop(object_t *list);
+void array_insert(runtime_t *rt, object_t *list, int index, object_t *item);
+object_t *array_slice(runtime_t *rt, object_t *list, int start, int end);
+variable_t *get_property(runtime_t *rt, object_t *base, char *property_name);
+variable_t *cached_property(runtime_t *rt, object_t *base, char *property_name, property_cache_t *cache);
 void set_property(runtime_t *rt, object_t *base, char *key, variable_t *value);
+object_t *binary_op(runtime_t *rt, object_t *obj1, object_t *obj2, token_type_t tok);
+
+// specialized forms of the binary operators. an operator of the tree walker
+// becomes one once it saw the types of its operands, it goes back when a
+// guard fails and picks a form for the new types.
+typedef enum {
+    QUICK_NONE,    // not run yet or the types changed
+    QUICK_GENERIC, // no specialized form for the types seen, see binary_op
+    QUICK_NUMBER_ADD,
+    QUICK_NUMBER_SUB,
+    QUICK_NUMBER_MUL,
+    QUICK_NUMBER_GT,
+    QUICK_NUMBER_GTE,
+    QUICK_NUMBER_LT,
+    QUICK_NUMBER_LTE,
+    QUICK_NUMBER_EQUAL,
+    QUICK_NUMBER_NOTEQUAL,
+    QUICK_STRING_ADD,
+    QUICK_STRING_EQUAL,
+    QUICK_STRING_NOTEQUAL,
+} quick_op_t;
+
+quick_op_t quicken_op(object_t *obj1, object_t *obj2, token_type_t tok);
+// 0 when the operands do not have the types q is for
+object_t *quick_op(runtime_t *rt, quick_op_t q, object_t *obj1, object_t *obj2);
+object_t *concat_strings(runtime_t *rt, object_t *obj1, object_t *obj2);
 variable_t *call_variable_op(runtime_t *rt, variable_t *var1, variable_t *var2, token_type_t tok);
+void print_object(object_t *obj);
 
 #endif // runtime_h
@@ -0,0 +1,478 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "serialize.h"
+
+// fnv-1a over 8 byte words, the remaining bytes one at a time
+uint64_t hash_bytes(const char *data, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash ^= word;
+        hash *= 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < length; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void write_bytes(writer_t *w, const void *data, size_t length)
+{
+    if (w->length + length > w->capacity)
+    {
+        while (w->length + length > w->capacity)
+        {
+            w->capacity = w->capacity ? w->capacity * 2 : 4096;
+        }
+        w->data = (char *)realloc(w->data, w->capacity);
+    }
+    memcpy(w->data + w->length, data, length);
+    w->length += length;
+}
+
+void write_int(writer_t *w, int value)
+{
+    int32_t v = value;
+    write_bytes(w, &v, sizeof(v));
+}
+
+void write_symbol(writer_t *w, const char *symbol)
+{
+    int length = strlen(symbol);
+    write_int(w, length);
+    write_bytes(w, symbol, length);
+}
+
+static void write_block(writer_t *w, block_t *b);
+static void write_expression(writer_t *w, expression_t *e);
+
+static void write_funcdef(writer_t *w, funcdef_t *fd)
+{
+    if (w->funcdefs != 0)
+    {
+        vector_push(w->funcdefs, fd);
+    }
+    write_symbol(w, fd->name);
+    write_int(w, fd->line_number);
+    write_int(w, vector_count(fd->parameters));
+    for (int i = 0; i < vector_count(fd->parameters); i++)
+    {
+        vardecl_t *vd = vector_get(fd->parameters, i);
+        write_symbol(w, vd->name);
+    }
+    if (0 == fd->block && w->source != 0)
+    {
+        write_int(w, 1);
+        write_int(w, fd->body - w->source);
+        write_int(w, fd->body_length);
+        write_int(w, fd->body_line);
+        return;
+    }
+    if (0 == fd->block)
+    {
+        parse_function_body(fd);
+    }
+    write_int(w, 0);
+    write_block(w, fd->block);
+}
+
+static void write_expressions(writer_t *w, vector_t *expressions)
+{
+    write_int(w, vector_count(expressions));
+    for (int i = 0; i < vector_count(expressions); i++)
+    {
+        write_expression(w, vector_get(expressions, i));
+    }
+}
+
+static void write_value(writer_t *w, value_t *v)
+{
+    write_int(w, v->type);
+    switch (v->type)
+    {
+    case VT_CNUMBER:
+        write_int(w, (int)(intptr_t)v->value);
+        break;
+    case VT_CSTRING:
+    case VT_IDENT:
+        write_symbol(w, v->value);
+        break;
+    case VT_FUNCCALL:
+    {
+        funccall_t *f = v->value;
+        write_symbol(w, f->function_name);
+        write_expressions(w, f->arguments);
+        break;
+    }
+    case VT_INLINE_FUNC:
+        write_funcdef(w, v->value);
+        break;
+    case VT_INLINE_OBJ:
+    {
+        inlineobj_t *iobj = v->value;
+        write_int(w, vector_count(iobj->keys));
+        for (int i = 0; i < vector_count(iobj->keys); i++)
+        {
+            write_symbol(w, vector_get(iobj->keys, i));
+            write_expression(w, vector_get(iobj->values, i));
+        }
+        break;
+    }
+    case VT_LIST:
+        write_int(w, vector_count(v->value));
+        for (int i = 0; i < vector_count(v->value); i++)
+        {
+            write_value(w, vector_get(v->value, i));
+        }
+        break;
+    case VT_LISTINDEX:
+    {
+        listindex_t *listindex = v->value;
+        write_symbol(w, listindex->name);
+        write_expression(w, listindex->index);
+        break;
+    }
+    case VT_EXPRESSION:
+        write_expression(w, v->value);
+        break;
+    }
+    write_int(w, v->subvalue != 0);
+    if (v->subvalue != 0)
+    {
+        write_value(w, v->subvalue);
+    }
+}
+
+static void write_tokens(writer_t *w, vector_t *tokens)
+{
+    write_int(w, vector_count(tokens));
+    for (int i = 0; i < vector_count(tokens); i++)
+    {
+        write_int(w, (int)(intptr_t)vector_get(tokens, i));
+    }
+}
+
+static void write_expression(writer_t *w, expression_t *e)
+{
+    write_int(w, e->line_number);
+    write_int(w, vector_count(e->values));
+    for (int i = 0; i < vector_count(e->values); i++)
+    {
+        write_value(w, vector_get(e->values, i));
+    }
+    write_tokens(w, e->binaryops);
+    write_tokens(w, e->unaryops);
+}
+
+static void write_statement(writer_t *w, statement_t *s)
+{
+    write_int(w, s->type);
+    if (ST_IF == s->type)
+    {
+        ifstatement_t *is = s->value;
+        write_expression(w, is->expression);
+        write_block(w, is->block);
+        write_int(w, is->else_block != 0);
+        if (is->else_block != 0)
+        {
+            write_block(w, is->else_block);
+        }
+    }
+    else if (ST_WHILE == s->type)
+    {
+        whilestatement_t *ws = s->value;
+        write_expression(w, ws->expression);
+        write_block(w, ws->block);
+    }
+    else
+    {
+        write_expression(w, s->value);
+    }
+}
+
+static void write_statements(writer_t *w, vector_t *statements)
+{
+    write_int(w, vector_count(statements));
+    for (int i = 0; i < vector_count(statements); i++)
+    {
+        write_statement(w, vector_get(statements, i));
+    }
+}
+
+static void write_block(writer_t *w, block_t *b)
+{
+    write_statements(w, b->statements);
+}
+
+int read_int(reader_t *r)
+{
+    int32_t v = 0;
+    if (r->pos + sizeof(v) > r->length)
+    {
+        r->failed = true;
+        return 0;
+    }
+    memcpy(&v, r->data + r->pos, sizeof(v));
+    r->pos += sizeof(v);
+    return v;
+}
+
+// element counts can not exceed the bytes left, a damaged count would
+// otherwise make the reader allocate without bound
+int read_count(reader_t *r)
+{
+    int count = read_int(r);
+    if (count < 0 || count > r->length - r->pos)
+    {
+        r->failed = true;
+        return 0;
+    }
+    return count;
+}
+
+char *read_symbol(reader_t *r)
+{
+    int length = read_count(r);
+    char *symbol = intern_length(r->data + r->pos, length);
+    r->pos += length;
+    return symbol;
+}
+
+static block_t *read_block(reader_t *r);
+static expression_t *read_expression(reader_t *r);
+
+static funcdef_t *read_funcdef(reader_t *r)
+{
+    funcdef_t *fd = (funcdef_t *)malloc(sizeof(funcdef_t));
+    fd->name = read_symbol(r);
+    fd->line_number = read_int(r);
+    fd->locals = 0;
+    fd->captures = 0;
+    fd->captured = 0;
+    fd->this_slot = -1;
+    fd->chunk = 0;
+    if (r->funcdefs != 0)
+    {
+        vector_push(r->funcdefs, fd);
+    }
+    fd->parameters = create_vector();
+    int count = read_count(r);
+    for (int i = 0; i < count && !r->failed; i++)
+    {
+        vardecl_t *vd = (vardecl_t *)malloc(sizeof(vardecl_t));
+        vd->name = read_symbol(r);
+        vd->slot = 0;
+        vector_push(fd->parameters, vd);
+    }
+    fd->block = 0;
+    fd->body = 0;
+    fd->body_length = 0;
+    fd->body_line = 0;
+    if (read_int(r))
+    {
+        int offset = read_int(r);
+        int length = read_int(r);
+        fd->body_line = read_int(r);
+        if (0 == r->source || offset < 0 || length < 0 || offset > r->source_length - length)
+        {
+            r->failed = true;
+            return fd;
+        }
+        fd->body = r->source + offset;
+        fd->body_length = length;
+    }
+    else if (!r->failed)
+    {
+        fd->block = read_block(r);
+    }
+    return fd;
+}
+
+static vector_t *read_expressions(reader_t *r)
+{
+    vector_t *expressions = create_vector();
+    int count = read_count(r);
+    for (int i = 0; i < count && !r->failed; i++)
+    {
+        vector_push(expressions, read_expression(r));
+    }
+    return expressions;
+}
+
+static value_t *read_value(reader_t *r)
+{
+    value_t *v = (value_t *)malloc(sizeof(value_t));
+    v->type = read_int(r);
+    v->value = 0;
+    v->subvalue = 0;
+    v->cache = 0;
+    switch (v->type)
+    {
+    case VT_CNUMBER:
+        v->value = (void *)(intptr_t)read_int(r);
+        break;
+    case VT_CSTRING:
+    case VT_IDENT:
+        v->value = read_symbol(r);
+        break;
+    case VT_FUNCCALL:
+    {
+        funccall_t *f = (funccall_t *)malloc(sizeof(funccall_t));
+        f->function_name = read_symbol(r);
+        f->arguments = read_expressions(r);
+        v->value = f;
+        break;
+    }
+    case VT_INLINE_FUNC:
+        v->value = read_funcdef(r);
+        break;
+    case VT_INLINE_OBJ:
+    {
+        inlineobj_t *iobj = (inlineobj_t *)malloc(sizeof(inlineobj_t));
+        iobj->keys = create_vector();
+        iobj->values = create_vector();
+        int count = read_count(r);
+        for (int i = 0; i < count && !r->failed; i++)
+        {
+            vector_push(iobj->keys, read_symbol(r));
+            vector_push(iobj->values, read_expression(r));
+        }
+        v->value = iobj;
+        break;
+    }
+    case VT_LIST:
+    {
+        vector_t *items = create_vector();
+        int count = read_count(r);
+        for (int i = 0; i < count && !r->failed; i++)
+        {
+            vector_push(items, read_value(r));
+        }
+        v->value = items;
+        break;
+    }
+    case VT_LISTINDEX:
+    {
+        listindex_t *listindex = (listindex_t *)malloc(sizeof(listindex_t));
+        listindex->name = read_symbol(r);
+        listindex->index = read_expression(r);
+        v->value = listindex;
+        break;
+    }
+    case VT_EXPRESSION:
+        v->value = read_expression(r);
+        break;
+    default:
+        r->failed = true;
+        return v;
+    }
+    if (read_int(r) && !r->failed)
+    {
+        v->subvalue = read_value(r);
+    }
+    return v;
+}
+
+static vector_t *read_tokens(reader_t *r)
+{
+    vector_t *tokens = create_vector();
+    int count = read_count(r);
+    for (int i = 0; i < count && !r->failed; i++)
+    {
+        vector_push(tokens, (void *)(intptr_t)read_int(r));
+    }
+    return tokens;
+}
+
+static expression_t *read_expression(reader_t *r)
+{
+    expression_t *e = (expression_t *)malloc(sizeof(expression_t));
+    e->line_number = read_int(r);
+    e->quick = 0;
+    e->values = create_vector();
+    int count = read_count(r);
+    for (int i = 0; i < count && !r->failed; i++)
+    {
+        vector_push(e->values, read_value(r));
+    }
+    e->binaryops = read_tokens(r);
+    e->unaryops = read_tokens(r);
+    if (vector_count(e->values) == 0 || vector_count(e->binaryops) != vector_count(e->values) - 1)
+    {
+        r->failed = true;
+    }
+    return e;
+}
+
+static statement_t *read_statement(reader_t *r)
+{
+    statement_t *s = (statement_t *)malloc(sizeof(statement_t));
+    s->type = read_int(r);
+    if (ST_IF == s->type)
+    {
+        ifstatement_t *is = (ifstatement_t *)malloc(sizeof(ifstatement_t));
+        is->expression = read_expression(r);
+        is->block = read_block(r);
+        is->else_block = read_int(r) && !r->failed ? read_block(r) : 0;
+        s->value = is;
+    }
+    else if (ST_WHILE == s->type)
+    {
+        whilestatement_t *ws = (whilestatement_t *)malloc(sizeof(whilestatement_t));
+        ws->expression = read_expression(r);
+        ws->block = read_block(r);
+        s->value = ws;
+    }
+    else
+    {
+        s->value = read_expression(r);
+    }
+    return s;
+}
+
+static void read_statements(reader_t *r, vector_t *statements)
+{
+    int count = read_count(r);
+    for (int i = 0; i < count && !r->failed; i++)
+    {
+        vector_push(statements, read_statement(r));
+    }
+}
+
+static block_t *read_block(reader_t *r)
+{
+    block_t *b = (block_t *)malloc(sizeof(block_t));
+    b->statements = create_vector();
+    read_statements(r, b->statements);
+    return b;
+}
+
+void write_program(writer_t *w, ast_t *ast)
+{
+    write_statements(w, ast->statement_list);
+    write_int(w, vector_count(ast->function_list));
+    for (int i = 0; i < vector_count(ast->function_list); i++)
+    {
+        write_funcdef(w, vector_get(ast->function_list, i));
+    }
+}
+
+bool read_program(reader_t *r, ast_t *ast)
+{
+    read_statements(r, ast->statement_list);
+    int count = read_count(r);
+    for (int i = 0; i < count && !r->failed; i++)
+    {
+        vector_push(ast->function_list, read_funcdef(r));
+    }
+    return !r->failed;
+}
@@ -0,0 +1,47 @@
+#ifndef serialize_h
+#define serialize_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "parser.h"
+
+// binary encoding of parsed programs, used by the parse cache and by heap
+// snapshots. integers are 32 bit in host byte order, symbols are a length
+// followed by the bytes and are interned again when read.
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    vector_t *funcdefs; // when set, every function written is appended
+    const char *source; // when set, bodies not parsed yet are written as
+                        // ranges of it, otherwise they get parsed first
+} writer_t;
+
+typedef struct {
+    const char *data;
+    size_t length;
+    size_t pos;
+    bool failed;        // set by any read past the end or malformed node
+    vector_t *funcdefs; // when set, every function read is appended
+    const char *source; // the ranges of unparsed bodies refer to
+    int source_length;
+} reader_t;
+
+uint64_t hash_bytes(const char *data, size_t length);
+
+void write_bytes(writer_t *w, const void *data, size_t length);
+void write_int(writer_t *w, int value);
+void write_symbol(writer_t *w, const char *symbol);
+int read_int(reader_t *r);
+int read_count(reader_t *r);
+char *read_symbol(reader_t *r);
+
+// statements and top level functions of a program that is not resolved yet,
+// functions are visited in the same order by both sides
+void write_program(writer_t *w, ast_t *ast);
+bool read_program(reader_t *r, ast_t *ast);
+
+#endif // serialize_h
@@ -0,0 +1,568 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "serialize.h"
+#include "snapshot.h"
+
+// bump whenever the image layout or the program encoding changes
+#define SNAPSHOT_VERSION 3
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t payload_hash;
+    uint64_t payload_length;
+} snapshot_header_t;
+
+struct _snapshot_t {
+    const char *path;
+    char *data;
+    size_t length;
+    reader_t r;
+    vector_t *funcdefs; // by index, in the order the program was read
+};
+
+// open addressing map from addresses to the indexes they get in the image
+typedef struct {
+    const void **keys;
+    int *ids;
+    int capacity;
+    int count;
+} id_map_t;
+
+typedef struct {
+    id_map_t funcdef_ids;
+    id_map_t object_ids;
+    id_map_t cell_ids;
+    vector_t *objects;
+    vector_t *cells; // captured variables, shared by closures
+} saver_t;
+
+static void snapshot_error(const char *message, const char *detail)
+{
+    fprintf(stderr, "%s%s\n", message, detail);
+    exit(EXIT_FAILURE);
+}
+
+static int hash_pointer(const void *p, int capacity)
+{
+    uint64_t h = (uint64_t)(uintptr_t)p;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (int)(h & (capacity - 1));
+}
+
+static void init_id_map(id_map_t *m)
+{
+    m->capacity = 64;
+    m->count = 0;
+    m->keys = (const void **)calloc(m->capacity, sizeof(void *));
+    m->ids = (int *)malloc(m->capacity * sizeof(int));
+}
+
+static void release_id_map(id_map_t *m)
+{
+    free(m->keys);
+    free(m->ids);
+}
+
+static int find_id(id_map_t *m, const void *key)
+{
+    for (int i = hash_pointer(key, m->capacity); m->keys[i] != 0; i = (i + 1) & (m->capacity - 1))
+    {
+        if (m->keys[i] == key)
+        {
+            return m->ids[i];
+        }
+    }
+    return -1;
+}
+
+static void add_id(id_map_t *m, const void *key, int id)
+{
+    if ((m->count + 1) * 2 > m->capacity)
+    {
+        id_map_t grown;
+        grown.capacity = m->capacity * 2;
+        grown.count = 0;
+        grown.keys = (const void **)calloc(grown.capacity, sizeof(void *));
+        grown.ids = (int *)malloc(grown.capacity * sizeof(int));
+        for (int i = 0; i < m->capacity; i++)
+        {
+            if (m->keys[i] != 0)
+            {
+                add_id(&grown, m->keys[i], m->ids[i]);
+            }
+        }
+        release_id_map(m);
+        *m = grown;
+    }
+    int i = hash_pointer(key, m->capacity);
+    while (m->keys[i] != 0)
+    {
+        i = (i + 1) & (m->capacity - 1);
+    }
+    m->keys[i] = key;
+    m->ids[i] = id;
+    m->count++;
+}
+
+static int object_id(saver_t *s, object_t *obj)
+{
+    if (0 == obj)
+    {
+        return -1;
+    }
+    int id = find_id(&s->object_ids, obj);
+    if (id < 0)
+    {
+        id = vector_count(s->objects);
+        vector_push(s->objects, obj);
+        add_id(&s->object_ids, obj, id);
+    }
+    return id;
+}
+
+// functions of eval'd code that did not define a top level function are not
+// part of the program and can not be written
+static int funcdef_id(saver_t *s, funcdef_t *fd)
+{
+    int id = find_id(&s->funcdef_ids, fd);
+    if (id < 0)
+    {
+        snapshot_error("can not snapshot a function created by eval'd code", "");
+    }
+    return id;
+}
+
+static int upvalue_count(object_t *obj)
+{
+    return obj->upvalues != 0 ? vector_count(((funcdef_t *)obj->data)->captures) : 0;
+}
+
+static void cell_id(saver_t *s, variable_t *cell)
+{
+    if (find_id(&s->cell_ids, cell) < 0)
+    {
+        add_id(&s->cell_ids, cell, vector_count(s->cells));
+        vector_push(s->cells, cell);
+        object_id(s, cell->obj);
+    }
+}
+
+// numbers every object and cell reachable from the global scope
+static void collect_heap(saver_t *s, runtime_t *rt)
+{
+    for (int i = 0; i < rt->global_scope->slot_count; i++)
+    {
+        object_id(s, rt->global_scope->slots[i]->obj);
+    }
+    for (int i = 0; i < vector_count(s->objects); i++)
+    {
+        object_t *obj = vector_get(s->objects, i);
+        if (OBJ_LIST == obj->type)
+        {
+            for (int j = 0; j < ARRAY(obj)->count; j++)
+            {
+                object_id(s, ARRAY(obj)->items[j]);
+            }
+        }
+        else if (OBJ_FUNCTION == obj->type)
+        {
+            funcdef_id(s, obj->data);
+            for (int j = 0; j < upvalue_count(obj); j++)
+            {
+                cell_id(s, obj->upvalues[j]);
+            }
+        }
+        for (int j = 0; j < obj->shape->slot_count; j++)
+        {
+            object_id(s, obj->slots[j]->obj);
+        }
+    }
+}
+
+static void write_ref(writer_t *w, id_map_t *ids, const void *p)
+{
+    write_int(w, p != 0 ? find_id(ids, p) : -1);
+}
+
+// objects first without their references, then the references, so the
+// reader can create everything before linking it
+static void write_heap(writer_t *w, saver_t *s, runtime_t *rt)
+{
+    write_int(w, vector_count(s->objects));
+    for (int i = 0; i < vector_count(s->objects); i++)
+    {
+        object_t *obj = vector_get(s->objects, i);
+        write_int(w, obj->type);
+        if (OBJ_NUMBER == obj->type)
+        {
+            write_int(w, NUMBER_VALUE(obj));
+        }
+        else if (OBJ_STRING == obj->type)
+        {
+            write_int(w, (obj->gc_flags & GC_OWNS_DATA) != 0);
+            write_symbol(w, obj->data);
+        }
+        else if (OBJ_FUNCTION == obj->type)
+        {
+            write_int(w, funcdef_id(s, obj->data));
+        }
+    }
+    write_int(w, vector_count(s->cells));
+    for (int i = 0; i < vector_count(s->cells); i++)
+    {
+        write_symbol(w, ((variable_t *)vector_get(s->cells, i))->name);
+    }
+
+    for (int i = 0; i < vector_count(s->objects); i++)
+    {
+        object_t *obj = vector_get(s->objects, i);
+        if (OBJ_LIST == obj->type)
+        {
+            write_int(w, ARRAY(obj)->count);
+            for (int j = 0; j < ARRAY(obj)->count; j++)
+            {
+                write_ref(w, &s->object_ids, ARRAY(obj)->items[j]);
+            }
+        }
+        else if (OBJ_FUNCTION == obj->type)
+        {
+            write_int(w, upvalue_count(obj));
+            for (int j = 0; j < upvalue_count(obj); j++)
+            {
+                write_ref(w, &s->cell_ids, obj->upvalues[j]);
+            }
+        }
+        write_int(w, obj->shape->slot_count);
+        for (int j = 0; j < obj->shape->slot_count; j++)
+        {
+            write_symbol(w, obj->shape->keys[j]);
+            write_ref(w, &s->object_ids, obj->slots[j]->obj);
+        }
+    }
+    for (int i = 0; i < vector_count(s->cells); i++)
+    {
+        write_ref(w, &s->object_ids, ((variable_t *)vector_get(s->cells, i))->obj);
+    }
+
+    // globals go by name, the program may number them differently once
+    // eval'd code is part of it
+    scope_t *global = rt->global_scope;
+    int count = 0;
+    for (int i = 0; i < global->slot_count; i++)
+    {
+        count += global->slots[i]->obj != 0;
+    }
+    write_int(w, count);
+    for (int i = 0; i < global->slot_count; i++)
+    {
+        if (global->slots[i]->obj != 0)
+        {
+            write_symbol(w, global->slots[i]->name);
+            write_ref(w, &s->object_ids, global->slots[i]->obj);
+        }
+    }
+}
+
+void save_snapshot(runtime_t *rt, const char *path)
+{
+    saver_t s;
+    writer_t w = {0, 0, 0, create_vector(), 0};
+
+    write_program(&w, rt->ast);
+    init_id_map(&s.funcdef_ids);
+    init_id_map(&s.object_ids);
+    init_id_map(&s.cell_ids);
+    s.objects = create_vector();
+    s.cells = create_vector();
+    for (int i = 0; i < vector_count(w.funcdefs); i++)
+    {
+        add_id(&s.funcdef_ids, vector_get(w.funcdefs, i), i);
+    }
+    collect_heap(&s, rt);
+    write_heap(&w, &s, rt);
+
+    snapshot_header_t header;
+    memcpy(header.magic, "BTKS", 4);
+    header.version = SNAPSHOT_VERSION;
+    header.payload_hash = hash_bytes(w.data, w.length);
+    header.payload_length = w.length;
+
+    FILE *f = fopen(path, "wb");
+    if (0 == f)
+    {
+        snapshot_error("can not write snapshot ", path);
+    }
+    bool written = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                   fwrite(w.data, 1, w.length, f) == w.length;
+    if (fclose(f) != 0 || !written)
+    {
+        snapshot_error("can not write snapshot ", path);
+    }
+
+    destroy_vector(s.cells);
+    destroy_vector(s.objects);
+    release_id_map(&s.cell_ids);
+    release_id_map(&s.object_ids);
+    release_id_map(&s.funcdef_ids);
+    destroy_vector(w.funcdefs);
+    free(w.data);
+}
+
+#ifdef _WIN32
+static char *map_image(const char *path, size_t *length)
+{
+    FILE *f = fopen(path, "rb");
+    if (0 == f)
+    {
+        snapshot_error("can not open snapshot ", path);
+    }
+    fseek(f, 0, SEEK_END);
+    *length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = (char *)malloc(*length + 1);
+    if (fread(data, 1, *length, f) != *length)
+    {
+        snapshot_error("can not read snapshot ", path);
+    }
+    fclose(f);
+    return data;
+}
+
+static void unmap_image(char *data, size_t length)
+{
+    free(data);
+}
+#else
+static char *map_image(const char *path, size_t *length)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        snapshot_error("can not open snapshot ", path);
+    }
+    *length = st.st_size;
+    if (0 == st.st_size)
+    {
+        close(fd);
+        snapshot_error("empty snapshot ", path);
+    }
+    void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == data)
+    {
+        snapshot_error("can not read snapshot ", path);
+    }
+    return data;
+}
+
+static void unmap_image(char *data, size_t length)
+{
+    munmap(data, length);
+}
+#endif
+
+static void damaged(snapshot_t *s)
+{
+    snapshot_error("damaged snapshot or one of another version: ", s->path);
+}
+
+snapshot_t *open_snapshot(const char *path, ast_t *ast)
+{
+    snapshot_t *s = (snapshot_t *)malloc(sizeof(snapshot_t));
+    s->path = path;
+    s->data = map_image(path, &s->length);
+    s->funcdefs = create_vector();
+
+    snapshot_header_t header;
+    if (s->length < sizeof(header))
+    {
+        damaged(s);
+    }
+    memcpy(&header, s->data, sizeof(header));
+    if (memcmp(header.magic, "BTKS", 4) != 0 || header.version != SNAPSHOT_VERSION ||
+        header.payload_length != s->length - sizeof(header) ||
+        hash_bytes(s->data + sizeof(header), header.payload_length) != header.payload_hash)
+    {
+        damaged(s);
+    }
+    reader_t r = {s->data + sizeof(header), header.payload_length, 0, false, s->funcdefs, 0, 0};
+    s->r = r;
+    if (!read_program(&s->r, ast))
+    {
+        damaged(s);
+    }
+    return s;
+}
+
+static funcdef_t *read_funcdef_ref(snapshot_t *s)
+{
+    int id = read_int(&s->r);
+    if (id < 0 || id >= vector_count(s->funcdefs))
+    {
+        damaged(s);
+    }
+    return vector_get(s->funcdefs, id);
+}
+
+// -1 stands for no object or cell
+static void *read_ref(snapshot_t *s, void **items, int count)
+{
+    int id = read_int(&s->r);
+    if (id < -1 || id >= count)
+    {
+        damaged(s);
+    }
+    return id >= 0 ? items[id] : 0;
+}
+
+static variable_t *global_variable(runtime_t *rt, char *name)
+{
+    vector_t *globals = rt->ast->globals;
+    for (int i = 0; i < vector_count(globals); i++)
+    {
+        if (vector_get(globals, i) == name)
+        {
+            return rt->global_scope->slots[i];
+        }
+    }
+    vector_push(globals, name);
+    grow_global_scope(rt);
+    return rt->global_scope->slots[vector_count(globals) - 1];
+}
+
+void restore_snapshot(snapshot_t *s, runtime_t *rt)
+{
+    reader_t *r = &s->r;
+
+    int object_count = read_count(r);
+    object_t **objects = (object_t **)malloc((object_count + 1) * sizeof(object_t *));
+    for (int i = 0; i < object_count; i++)
+    {
+        object_type_t type = read_int(r);
+        if (OBJ_NUMBER == type)
+        {
+            objects[i] = create_object(rt, OBJ_NUMBER);
+            objects[i]->data = NUMBER_DATA(read_int(r));
+        }
+        else if (OBJ_STRING == type)
+        {
+            int owns_data = read_int(r);
+            char *str = read_symbol(r);
+            if (owns_data)
+            {
+                str = strcpy((char *)malloc(strlen(str) + 1), str);
+            }
+            objects[i] = create_string(rt, str, owns_data);
+        }
+        else if (OBJ_FUNCTION == type)
+        {
+            objects[i] = create_object(rt, OBJ_FUNCTION);
+            objects[i]->data = read_funcdef_ref(s);
+        }
+        else if (OBJ_LIST == type)
+        {
+            objects[i] = create_list_object(rt, 0);
+        }
+        else if (OBJ_BASE == type)
+        {
+            objects[i] = create_object(rt, OBJ_BASE);
+        }
+        else
+        {
+            damaged(s);
+        }
+    }
+
+    int cell_count = read_count(r);
+    variable_t **cells = (variable_t **)malloc((cell_count + 1) * sizeof(variable_t *));
+    for (int i = 0; i < cell_count; i++)
+    {
+        cells[i] = &create_upvalue(rt, read_symbol(r))->var;
+    }
+
+    for (int i = 0; i < object_count; i++)
+    {
+        object_t *obj = objects[i];
+        if (OBJ_LIST == obj->type)
+        {
+            int count = read_count(r);
+            for (int j = 0; j < count; j++)
+            {
+                array_push(rt, obj, read_ref(s, (void **)objects, object_count));
+            }
+        }
+        else if (OBJ_FUNCTION == obj->type)
+        {
+            // the program is resolved the way it was when the image was
+            // written, its functions capture the same variables
+            vector_t *captures = ((funcdef_t *)obj->data)->captures;
+            int count = read_count(r);
+            if (count != (captures != 0 ? vector_count(captures) : 0))
+            {
+                damaged(s);
+            }
+            if (count > 0)
+            {
+                obj->upvalues = (variable_t **)malloc(count * sizeof(variable_t *));
+                rt->heap_bytes += count * sizeof(variable_t *);
+            }
+            for (int j = 0; j < count; j++)
+            {
+                obj->upvalues[j] = read_ref(s, (void **)cells, cell_count);
+                if (0 == obj->upvalues[j])
+                {
+                    damaged(s);
+                }
+                ((upvalue_t *)obj->upvalues[j])->reference_count += 1;
+            }
+        }
+        int count = read_count(r);
+        for (int j = 0; j < count; j++)
+        {
+            char *key = read_symbol(r);
+            get_property(rt, obj, key)->obj = read_ref(s, (void **)objects, object_count);
+        }
+    }
+    for (int i = 0; i < cell_count; i++)
+    {
+        cells[i]->obj = read_ref(s, (void **)objects, object_count);
+    }
+    int count = read_count(r);
+    for (int i = 0; i < count; i++)
+    {
+        char *name = read_symbol(r);
+        global_variable(rt, name)->obj = read_ref(s, (void **)objects, object_count);
+    }
+    if (r->failed || r->pos != r->length)
+    {
+        damaged(s);
+    }
+
+    // the cells are held by the closures only
+    for (int i = 0; i < cell_count; i++)
+    {
+        release_upvalue(rt, cells[i]);
+    }
+    free(cells);
+    free(objects);
+}
+
+void close_snapshot(snapshot_t *s)
+{
+    unmap_image(s->data, s->length);
+    destroy_vector(s->funcdefs);
+    free(s);
+}
@@ -0,0 +1,23 @@
+#ifndef snapshot_h
+#define snapshot_h
+
+#include "parser.h"
+#include "runtime.h"
+
+// a heap snapshot holds a program together with everything reachable from
+// its global scope: objects, closures and the variables they captured.
+// objects and functions refer to each other by index so the image does not
+// depend on the addresses of the process that wrote it.
+typedef struct _snapshot_t snapshot_t;
+
+// writes the program and the heap of rt, exits on failure
+void save_snapshot(runtime_t *rt, const char *path);
+
+// maps the image and reads its program into ast, which still has to be
+// resolved. restore_snapshot then rebuilds the heap into the global scope of
+// a runtime set up for that ast.
+snapshot_t *open_snapshot(const char *path, ast_t *ast);
+void restore_snapshot(snapshot_t *s, runtime_t *rt);
+void close_snapshot(snapshot_t *s);
+
+#endif // snapshot_h
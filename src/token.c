@@ -1,40 +1,51 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 
 #include "token.h"
 
-static int is_whitespace(char c)
-{
-    return ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n'));
-}
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-static int is_alpha(char c)
-{
-    if (c < 0)
-    {
-        return 1;
-    }
-    return (((c >= 'a') && (c <= 'z')) ||
-            ((c >= 'A') && (c <= 'Z')) ||
-            (c == '_'));
-}
+enum {
+    CC_SPACE = 1,
+    CC_ALPHA = 2,
+    CC_DIGIT = 4,
+};
 
-static int is_alphanum(char c)
-{
-    return (is_alpha(c) || isdigit(c));
-}
+static unsigned char char_class[256];
 
-static int is_digit(char c)
+#define CLASS(c) (char_class[(unsigned char)(c)])
+
+static void init_char_classes(void)
 {
-    return ((c >= '0') && (c <= '9'));
+    for (int c = 0; c < 256; c++)
+    {
+        // bytes of multibyte characters may start identifiers
+        if (c >= 0x80 || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_')
+        {
+            char_class[c] = CC_ALPHA;
+        }
+        else if (c >= '0' && c <= '9')
+        {
+            char_class[c] = CC_DIGIT;
+        }
+        else if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+        {
+            char_class[c] = CC_SPACE;
+        }
+    }
 }
 
 static struct
 {
     char *str;
     token_type_t token_type;
+    char *symbol;
 } keywords[] = {
     {"and", TT_OP_AND},
     {"or", TT_OP_OR},
@@ -47,239 +58,658 @@ static struct
     {"print", TT_PRINT},
 };
 
-static struct
+// index into keywords or -1, every keyword is told apart by its length
+// and first letter
+static int find_keyword(const char *s, int length)
 {
-    char *op;
-    token_type_t token;
-} operators[] = {
-    {"+", TT_OP_ADD},
-    {"-", TT_OP_SUB},
-    {"*", TT_OP_MUL},
-    {"/", TT_OP_DIV},
-    {".", TT_OP_DOT},
-    {",", TT_OP_COMMA},
-    {"(", TT_OP_POPEN},
-    {")", TT_OP_PCLOSE},
-    {"[", TT_OP_BOPEN},
-    {"]", TT_OP_BCLOSE},
-    {"{", TT_OP_COPEN},
-    {"}", TT_OP_CCLOSE},
-    {"==", TT_OP_EQUAL},
-    {"<>", TT_OP_NOTEQUAL},
-    {"=", TT_OP_ASSIGN},
-    {">=", TT_OP_GTE},
-    {">", TT_OP_GT},
-    {"<=", TT_OP_LTE},
-    {"<", TT_OP_LT},
-    {":", TT_OP_COLON},
-};
-
-void init_tokenizer(tokenizer_t *t, char *source)
-{
-    t->source = duplicate_string(source);
-    t->source_index = 0;
-    t->index_stack = create_stack(sizeof(int));
-    t->token_type = TT_NONE;
-    t->line_number = 1;
+    int k = -1;
+    switch (length)
+    {
+    case 2:
+        k = s[0] == 'o' ? 1 : s[0] == 'i' ? 2 : -1;
+        break;
+    case 3:
+        k = s[0] == 'a' ? 0 : s[0] == 'e' ? 5 : s[0] == 'd' ? 6 : -1;
+        break;
+    case 4:
+        k = s[0] == 'e' ? 3 : -1;
+        break;
+    case 5:
+        k = s[0] == 'w' ? 4 : s[0] == 'p' ? 8 : -1;
+        break;
+    case 6:
+        k = s[0] == 'r' ? 7 : -1;
+        break;
+    }
+    return k >= 0 && memcmp(s, keywords[k].str, length) == 0 ? k : -1;
 }
 
-void release_tokenizer(tokenizer_t *t)
+typedef struct {
+    const char *source;
+    int length;
+    int index;
+    int line;
+} lexer_t;
+
+// the source is not terminated, reading past its end gives '\0'
+#define PEEK(l, offset) ((l)->index + (offset) < (l)->length ? (l)->source[(l)->index + (offset)] : '\0')
+
+#ifdef __SSE2__
+// bit i is set when byte i of the block is c
+#define BYTES_EQUAL(block, c) _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)))
+#endif
+
+// moves to the first of the bytes a, b and c or to the end of the source.
+// newlines skipped on the way are counted.
+static void skip_until(lexer_t *l, char a, char b, char c)
 {
-    free(t->source);
-    destroy_stack(t->index_stack);
-    memset(t, 0, sizeof(tokenizer_t));
+#ifdef __SSE2__
+    while (l->index + 16 <= l->length)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(l->source + l->index));
+        int mask = BYTES_EQUAL(block, a) | BYTES_EQUAL(block, b) | BYTES_EQUAL(block, c);
+        int newlines = BYTES_EQUAL(block, '\n');
+        if (mask != 0)
+        {
+            int n = __builtin_ctz(mask);
+            l->line += __builtin_popcount(newlines & ((1 << n) - 1));
+            l->index += n;
+            return;
+        }
+        l->line += __builtin_popcount(newlines);
+        l->index += 16;
+    }
+#endif
+    for (; l->index < l->length; l->index++)
+    {
+        char ch = l->source[l->index];
+        if (ch == a || ch == b || ch == c)
+        {
+            return;
+        }
+        if (ch == '\n')
+        {
+            l->line++;
+        }
+    }
 }
 
-static void eatwhitespace(tokenizer_t *t)
+static void skip_spaces(lexer_t *l)
 {
-eatwhitespace_begin:
-
-    while (is_whitespace(t->source[t->source_index]))
+#ifdef __SSE2__
+    // runs between tokens are mostly a single space, the vector loop only
+    // pays off for indentation and blank lines
+    while ((CLASS(PEEK(l, 0)) & CLASS(PEEK(l, 1)) & CC_SPACE) && l->index + 16 <= l->length)
     {
-        if ('\n' == t->source[t->source_index])
+        __m128i block = _mm_loadu_si128((const __m128i *)(l->source + l->index));
+        int newlines = BYTES_EQUAL(block, '\n');
+        int spaces = BYTES_EQUAL(block, ' ') | BYTES_EQUAL(block, '\t') | BYTES_EQUAL(block, '\r') | newlines;
+        if (spaces != 0xffff)
         {
-            t->line_number++;
+            int n = __builtin_ctz(~spaces);
+            l->line += __builtin_popcount(newlines & ((1 << n) - 1));
+            l->index += n;
+            return;
         }
-        t->source_index++;
+        l->line += __builtin_popcount(newlines);
+        l->index += 16;
     }
-
-    // single line comments
-    if (t->source[t->source_index] == '#')
+#endif
+    while (CLASS(PEEK(l, 0)) & CC_SPACE)
     {
-        while (t->source[t->source_index] != '\n')
+        if ('\n' == PEEK(l, 0))
         {
-            // incase there is a comment on the last line
-            // or the only line is a comment line then
-            // we should check for an EOF
-            if (t->source[t->source_index] == '\0')
-            {
-                printf("eol\n");
-                break;
-            }
-            t->source_index++;
+            l->line++;
         }
-        goto eatwhitespace_begin;
+        l->index++;
     }
+}
 
-    // multi line comments
-    if (('/' == t->source[t->source_index]) &&
-        ('*' == t->source[t->source_index + 1]))
+static void eatwhitespace(lexer_t *l)
+{
+    for (;;)
     {
-        t->source_index += 2;
-        while (t->source[t->source_index] != '\0')
+        skip_spaces(l);
+
+        // single line comments
+        if (PEEK(l, 0) == '#')
         {
-            if (('*' == t->source[t->source_index]) &&
-                ('/' == t->source[t->source_index + 1]))
+            skip_until(l, '\n', '\0', '\n');
+            continue;
+        }
+
+        // multi line comments
+        if (('/' == PEEK(l, 0)) && ('*' == PEEK(l, 1)))
+        {
+            l->index += 2;
+            for (;;)
             {
-                t->source_index += 2;
-                break;
+                skip_until(l, '*', '*', '*');
+                if (l->index >= l->length)
+                {
+                    break;
+                }
+                l->index++;
+                if ('/' == PEEK(l, 0))
+                {
+                    l->index++;
+                    break;
+                }
             }
-            t->source_index++;
+            continue;
         }
-        goto eatwhitespace_begin;
+        return;
     }
 }
 
-static void tokenize_number(tokenizer_t *t)
+static void tokenize_number(lexer_t *l, token_t *tok)
 {
-    t->token_type = TT_NUMBER;
-    t->token_value.int_val = t->source[t->source_index++] - '0';
-    while (is_digit(t->source[t->source_index]))
+    tok->type = TT_NUMBER;
+    tok->value.int_val = 0;
+    while (CLASS(PEEK(l, 0)) & CC_DIGIT)
     {
-        t->token_value.int_val *= 10;
-        t->token_value.int_val += t->source[t->source_index] - '0';
-        t->source_index++;
+        tok->value.int_val *= 10;
+        tok->value.int_val += PEEK(l, 0) - '0';
+        l->index++;
     }
 }
 
-static void tokenize_identifier(tokenizer_t *t)
+static void tokenize_identifier(lexer_t *l, token_t *tok)
 {
-    int i = 0;
+    int start = l->index++;
 
-    t->token_value.str_val[i++] = t->source[t->source_index++];
-    while (is_alphanum(t->source[t->source_index]))
+    while (CLASS(PEEK(l, 0)) & (CC_ALPHA | CC_DIGIT))
     {
-        t->token_value.str_val[i++] = t->source[t->source_index++];
-        if (MAX_IDENT_LENGTH == i)
+        l->index++;
+        if (MAX_IDENT_LENGTH == l->index - start)
         {
-            fprintf(stderr, "MAX_IDENT_LENGTH reached :%d\n", t->line_number);
-            exit(1);
+            syntax_error("MAX_IDENT_LENGTH reached :%d\n", l->line);
         }
     }
-    t->token_value.str_val[i] = '\0';
-    for (i = 0; i < sizeof(keywords) / sizeof(keywords[0]); ++i)
+    int k = find_keyword(&l->source[start], l->index - start);
+    if (k >= 0)
     {
-        if (strcmp(t->token_value.str_val, keywords[i].str) == 0)
-        {
-            t->token_type = keywords[i].token_type;
-            return;
-        }
+        tok->type = keywords[k].token_type;
+        tok->value.symbol = keywords[k].symbol;
+        return;
     }
-    t->token_type = TT_IDENT;
+    tok->value.symbol = intern_length(&l->source[start], l->index - start);
+    tok->type = TT_IDENT;
 }
 
-static void tokenize_string(tokenizer_t *t)
+// decodes the escapes of a string literal body into buf
+static int decode_string(const char *src, int length, char *buf)
 {
     int i = 0;
-
-    t->source_index++;
-    while (t->source[t->source_index] != '"')
+    for (int j = 0; j < length; j++)
     {
-        if (t->source[t->source_index] == '\\')
+        if (src[j] == '\\' && j + 1 < length &&
+            (src[j + 1] == 'n' || src[j + 1] == '"' || src[j + 1] == '\\'))
         {
-            if (t->source[t->source_index + 1] == 'n')
-            {
-                t->token_value.str_val[i++] = '\n';
-                t->source_index += 2;
-            }
-            else if (t->source[t->source_index + 1] == '"')
-            {
-                t->token_value.str_val[i++] = '\"';
-                t->source_index += 2;
-            }
-            else if (t->source[t->source_index + 1] == '\\')
-            {
-                t->token_value.str_val[i++] = '\\';
-                t->source_index += 2;
-            }
-            else
-            {
-                t->token_value.str_val[i++] = '\\';
-                t->source_index++;
-            }
+            j++;
+            buf[i++] = src[j] == 'n' ? '\n' : src[j];
         }
         else
         {
-            t->token_value.str_val[i++] = t->source[t->source_index++];
+            buf[i++] = src[j];
+        }
+    }
+    return i;
+}
+
+// literals without escapes are interned straight from the source
+static void tokenize_string(lexer_t *l, token_t *tok)
+{
+    bool has_escapes = false;
+    int start = ++l->index;
+
+    for (;;)
+    {
+        skip_until(l, '"', '\\', '"');
+        if (l->index >= l->length)
+        {
+            syntax_error("unterminated string on line %d\n", tok->line);
         }
-        if (i >= MAX_STRING_LENGTH)
+        if (PEEK(l, 0) == '"')
         {
-            fprintf(stderr, "max inline string length reached\n");
-            exit(EXIT_FAILURE);
+            break;
         }
+        has_escapes = true;
+        l->index += PEEK(l, 1) == '"' || PEEK(l, 1) == '\\' ? 2 : 1;
     }
-    t->token_value.str_val[i] = '\0';
-    t->source_index++; // eat last "
-    t->token_type = TT_STRING;
+    int length = l->index - start;
+    if (has_escapes)
+    {
+        char *buf = (char *)malloc(length);
+        tok->value.symbol = intern_length(buf, decode_string(&l->source[start], length, buf));
+        free(buf);
+    }
+    else
+    {
+        tok->value.symbol = intern_length(&l->source[start], length);
+    }
+    l->index++; // eat last "
+    tok->type = TT_STRING;
 }
 
-token_type_t get_token(tokenizer_t *t)
+// longest match, the two character operators all start with one of = < >
+static token_type_t tokenize_operator(lexer_t *l)
+{
+    char c = PEEK(l, 0);
+    char next = PEEK(l, 1);
+    token_type_t type = TT_UNKNOWN;
+    int length = 1;
+
+    switch (c)
+    {
+    case '+': type = TT_OP_ADD; break;
+    case '-': type = TT_OP_SUB; break;
+    case '*': type = TT_OP_MUL; break;
+    case '/': type = TT_OP_DIV; break;
+    case '.': type = TT_OP_DOT; break;
+    case ',': type = TT_OP_COMMA; break;
+    case '(': type = TT_OP_POPEN; break;
+    case ')': type = TT_OP_PCLOSE; break;
+    case '[': type = TT_OP_BOPEN; break;
+    case ']': type = TT_OP_BCLOSE; break;
+    case '{': type = TT_OP_COPEN; break;
+    case '}': type = TT_OP_CCLOSE; break;
+    case ':': type = TT_OP_COLON; break;
+    case '=':
+        type = next == '=' ? TT_OP_EQUAL : TT_OP_ASSIGN;
+        length = next == '=' ? 2 : 1;
+        break;
+    case '<':
+        type = next == '>' ? TT_OP_NOTEQUAL : next == '=' ? TT_OP_LTE : TT_OP_LT;
+        length = next == '>' || next == '=' ? 2 : 1;
+        break;
+    case '>':
+        type = next == '=' ? TT_OP_GTE : TT_OP_GT;
+        length = next == '=' ? 2 : 1;
+        break;
+    }
+    if (type != TT_UNKNOWN)
+    {
+        l->index += length;
+    }
+    return type;
+}
+
+static void next_token(lexer_t *l, token_t *tok)
 {
-    eatwhitespace(t);
+    eatwhitespace(l);
 
-    stack_push(t->index_stack, (void *)&t->source_index);
+    tok->offset = l->index;
+    tok->line = l->line;
+    tok->value.symbol = 0;
 
-    if ('\0' == t->source[t->source_index])
+    char c = PEEK(l, 0);
+    if ('\0' == c)
     {
-        t->token_type = TT_EOF;
-        return TT_EOF;
+        tok->type = TT_EOF;
     }
+    else if (CLASS(c) & CC_DIGIT)
+    {
+        tokenize_number(l, tok);
+    }
+    else if (CLASS(c) & CC_ALPHA)
+    {
+        tokenize_identifier(l, tok);
+    }
+    else if ('"' == c)
+    {
+        tokenize_string(l, tok);
+    }
+    else
+    {
+        tok->type = tokenize_operator(l);
+    }
+    tok->length = l->index - tok->offset;
+}
+
+static void tokenize(tokenizer_t *t, int line)
+{
+    lexer_t l = {t->source, t->source_length, 0, line};
+    int capacity = 256;
 
-    if (is_digit(t->source[t->source_index]))
+    t->tokens = (token_t *)malloc(capacity * sizeof(token_t));
+    t->token_count = 0;
+    for (;;)
     {
-        tokenize_number(t);
-        return TT_NUMBER;
+        if (t->token_count == capacity)
+        {
+            capacity *= 2;
+            t->tokens = (token_t *)realloc(t->tokens, capacity * sizeof(token_t));
+        }
+        token_t *tok = &t->tokens[t->token_count++];
+        next_token(&l, tok);
+        // the lexer can not continue past an unknown character, get_token
+        // keeps returning the last token
+        if (TT_EOF == tok->type || TT_UNKNOWN == tok->type)
+        {
+            break;
+        }
     }
+}
+
+void init_lexer(void)
+{
+    if (0 != char_class['a'])
+    {
+        return;
+    }
+    for (int i = 0; i < sizeof(keywords) / sizeof(keywords[0]); ++i)
+    {
+        keywords[i].symbol = intern(keywords[i].str);
+    }
+    init_char_classes();
+}
+
+void init_tokenizer(tokenizer_t *t, const char *source, int length)
+{
+    init_tokenizer_at(t, source, length, 1);
+}
+
+void init_tokenizer_at(tokenizer_t *t, const char *source, int length, int line)
+{
+    init_lexer();
+    t->source = source;
+    t->source_length = length;
+    t->ring = 0;
+    tokenize(t, line);
+    t->position = 0;
+    t->int_val = 0;
+    t->symbol = 0;
+    t->token_type = TT_NONE;
+    t->line_number = line;
+}
+
+// the lexer thread and the parser share a ring of tokens. head counts the
+// tokens the lexer made and tail the ones the parser took, each side only
+// writes its own counter and the two live on separate cache lines. the
+// lexer publishes head every few tokens and the parser reads it only when
+// it ran out, waiting on the other side yields the processor.
+#define TOKEN_RING_SIZE 4096 // a power of two
+#define TOKEN_BATCH 64
+// tokens the parser keeps of what it took from the ring, enough for the
+// one token unget_token goes back
+#define TOKEN_WINDOW 4
+
+typedef struct _token_ring_t {
+    token_t tokens[TOKEN_RING_SIZE];
+    unsigned head;
+    char head_pad[64];
+    unsigned tail;
+    char tail_pad[64];
+    unsigned cached_head; // parser side copy of head
+    int closed;           // set by the parser when it stops early
+    int failed;           // set by the lexer on an error
+    lexer_t lexer;
+    pthread_t thread;
+    int full_waits;
+    int empty_waits;
+    double lex_start;
+    double lex_end;
+} token_ring_t;
 
-    if (is_alpha(t->source[t->source_index]))
+static void *lexer_thread(void *arg)
+{
+    token_ring_t *r = arg;
+    jmp_buf trap;
+    unsigned head = 0;
+    unsigned tail = 0;
+
+    use_local_symbols();
+    if (setjmp(trap) != 0)
+    {
+        set_error_trap(0);
+        __atomic_store_n(&r->failed, 1, __ATOMIC_RELEASE);
+        release_local_symbols();
+        return 0;
+    }
+    set_error_trap(&trap);
+    r->lex_start = monotonic_seconds();
+    for (;;)
     {
-        tokenize_identifier(t);
-        return t->token_type;
+        if (head - tail == TOKEN_RING_SIZE)
+        {
+            __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+            while ((tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) == head - TOKEN_RING_SIZE)
+            {
+                if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+                {
+                    set_error_trap(0);
+                    release_local_symbols();
+                    return 0;
+                }
+                r->full_waits++;
+                sched_yield();
+            }
+        }
+        token_t *tok = &r->tokens[head & (TOKEN_RING_SIZE - 1)];
+        next_token(&r->lexer, tok);
+        head++;
+        bool last = TT_EOF == tok->type || TT_UNKNOWN == tok->type;
+        if (last || 0 == (head & (TOKEN_BATCH - 1)))
+        {
+            __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+        }
+        if (last)
+        {
+            break;
+        }
     }
+    r->lex_end = monotonic_seconds();
+    set_error_trap(0);
+    release_local_symbols();
+    return 0;
+}
 
-    if ('"' == t->source[t->source_index])
+bool init_tokenizer_pipelined(tokenizer_t *t, const char *source, int length)
+{
+    init_lexer();
+    token_ring_t *r = (token_ring_t *)calloc(1, sizeof(token_ring_t));
+    r->lexer.source = source;
+    r->lexer.length = length;
+    r->lexer.line = 1;
+    if (pthread_create(&r->thread, 0, lexer_thread, r) != 0)
     {
-        tokenize_string(t);
-        return TT_STRING;
+        free(r);
+        return false;
     }
+    t->source = source;
+    t->source_length = length;
+    t->ring = r;
+    t->tokens = (token_t *)malloc(TOKEN_WINDOW * sizeof(token_t));
+    t->token_count = 0;
+    t->position = 0;
+    t->int_val = 0;
+    t->symbol = 0;
+    t->token_type = TT_NONE;
+    t->line_number = 1;
+    return true;
+}
 
-    for (int i = 0; i < sizeof(operators) / sizeof(operators[0]); i++)
+// moves the next token of the ring into the window, a lexer error shows up
+// as a syntax error of the parser
+static void pull_token(tokenizer_t *t)
+{
+    token_ring_t *r = t->ring;
+    unsigned tail = r->tail;
+    if (tail == r->cached_head)
     {
-        if (strncmp(operators[i].op, &t->source[t->source_index], strlen(operators[i].op)) == 0)
+        while ((r->cached_head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == tail)
         {
-            t->source_index += strlen(operators[i].op);
-            t->token_type = operators[i].token;
-            return operators[i].token;
+            if (__atomic_load_n(&r->failed, __ATOMIC_ACQUIRE))
+            {
+                syntax_error("lexer failed\n");
+            }
+            r->empty_waits++;
+            sched_yield();
         }
     }
+    t->tokens[t->token_count++ & (TOKEN_WINDOW - 1)] = r->tokens[tail & (TOKEN_RING_SIZE - 1)];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
 
-    return TT_UNKNOWN;
+// the token at index i, the last one for indexes past the end
+static token_t *token_at(tokenizer_t *t, int i)
+{
+    if (0 == t->ring)
+    {
+        return &t->tokens[i < t->token_count ? i : t->token_count - 1];
+    }
+    while (i >= t->token_count)
+    {
+        token_type_t last = t->token_count > 0 ? t->tokens[(t->token_count - 1) & (TOKEN_WINDOW - 1)].type : TT_NONE;
+        if (TT_EOF == last || TT_UNKNOWN == last)
+        {
+            i = t->token_count - 1;
+            break;
+        }
+        pull_token(t);
+    }
+    return &t->tokens[i & (TOKEN_WINDOW - 1)];
 }
 
-void unget_token(tokenizer_t *t)
+void finish_pipeline(tokenizer_t *t, pipeline_stats_t *stats)
 {
-    int prev_source_index = *(int *)stack_pop(t->index_stack);
-    if (t->source_index <= prev_source_index)
+    token_ring_t *r = t->ring;
+    __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+    pthread_join(r->thread, 0);
+    if (stats != 0)
     {
-        t->source_index = prev_source_index;
-        return;
+        stats->token_count = r->tail;
+        stats->lex_seconds = r->lex_end - r->lex_start;
+        stats->full_waits = r->full_waits;
+        stats->empty_waits = r->empty_waits;
+    }
+    free(r);
+    t->ring = 0;
+}
+
+void release_tokenizer(tokenizer_t *t)
+{
+    if (t->ring != 0)
+    {
+        finish_pipeline(t, 0);
     }
-    do
+    free(t->tokens);
+    memset(t, 0, sizeof(tokenizer_t));
+}
+
+token_type_t get_token(tokenizer_t *t)
+{
+    token_t *tok = token_at(t, t->position);
+
+    t->position++;
+    t->token_type = tok->type;
+    t->line_number = tok->line;
+    t->int_val = TT_NUMBER == tok->type ? tok->value.int_val : 0;
+    t->symbol = TT_NUMBER == tok->type ? 0 : tok->value.symbol;
+    return tok->type;
+}
+
+// rewinds to the previous token, the fields keep describing the token
+// returned last except for the line number
+void unget_token(tokenizer_t *t)
+{
+    t->position--;
+    t->line_number = token_at(t, t->position)->line;
+}
+
+token_t *peek_token(tokenizer_t *t)
+{
+    return token_at(t, t->position);
+}
+
+token_t *last_token(tokenizer_t *t)
+{
+    return token_at(t, t->position - 1);
+}
+
+// walks the source with the rules of the lexer without building tokens.
+// a def that follows the end of a value on the top level starts a named
+// function, an inline function always follows an operator or a keyword.
+int split_source(const char *source, int length, int min_gap, source_split_t *splits, int max_count)
+{
+    lexer_t l = {source, length, 0, 1};
+    int count = 0;
+    int depth = 0;
+    int last = 0;
+    bool after_value = true; // an item may start here
+
+    init_lexer();
+    while (count < max_count)
     {
-        t->source_index--;
-        if ('\n' == t->source[t->source_index])
+        eatwhitespace(&l);
+        char c = PEEK(&l, 0);
+        int start = l.index;
+        if ('\0' == c)
+        {
+            break;
+        }
+        else if (CLASS(c) & CC_DIGIT)
         {
-            t->line_number--;
+            while (CLASS(PEEK(&l, 0)) & CC_DIGIT)
+            {
+                l.index++;
+            }
+            after_value = true;
+        }
+        else if (CLASS(c) & CC_ALPHA)
+        {
+            while (CLASS(PEEK(&l, 0)) & (CC_ALPHA | CC_DIGIT))
+            {
+                l.index++;
+            }
+            int k = find_keyword(&source[start], l.index - start);
+            token_type_t type = k >= 0 ? keywords[k].token_type : TT_IDENT;
+            if (TT_DEF == type && 0 == depth && after_value && start - last >= min_gap)
+            {
+                splits[count].offset = start;
+                splits[count].line = l.line;
+                count++;
+                last = start;
+            }
+            if (TT_DEF == type || TT_IF == type || TT_WHILE == type)
+            {
+                depth++;
+            }
+            else if (TT_END == type && depth > 0)
+            {
+                depth--;
+            }
+            after_value = TT_IDENT == type || TT_END == type;
+        }
+        else if ('"' == c)
+        {
+            l.index++;
+            for (;;)
+            {
+                skip_until(&l, '"', '\\', '"');
+                if (l.index >= l.length || PEEK(&l, 0) == '"')
+                {
+                    break;
+                }
+                l.index += PEEK(&l, 1) == '"' || PEEK(&l, 1) == '\\' ? 2 : 1;
+            }
+            if (l.index >= l.length)
+            {
+                break;
+            }
+            l.index++;
+            after_value = true;
         }
-    } while (t->source_index > prev_source_index);
+        else
+        {
+            token_type_t type = tokenize_operator(&l);
+            if (TT_UNKNOWN == type)
+            {
+                break;
+            }
+            after_value = TT_OP_PCLOSE == type || TT_OP_BCLOSE == type || TT_OP_CCLOSE == type;
+        }
+    }
+    return count;
 }
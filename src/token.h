@@ -1,10 +1,11 @@
 #ifndef token_h
 #define token_h
 
+#include <stdbool.h>
+
 #include "common.h"
 
 #define MAX_IDENT_LENGTH 64
-#define MAX_STRING_LENGTH 1024
 
 typedef enum {
     TT_NONE = 0,
@@ -57,20 +58,72 @@ typedef enum {
 #define TOK_IS_UNARY_OP(t) ((((t) >= 30) && ((t) < 40)) || ((t) == TT_OP_SUB))
 
 typedef struct {
-    char *source;
-    int source_index;
-    btk_stack_t *index_stack;
+    token_type_t type;
+    int offset; // into the source
+    int length;
+    int line;
     union {
-        int int_val;
-        char str_val[MAX_STRING_LENGTH];
-    } token_value;
+        int int_val;  // numbers
+        char *symbol; // interned text of identifiers, keywords and strings
+    } value;
+} token_t;
+
+// the whole source is lexed up front into tokens, get_token and unget_token
+// move through that array. the fields below the array describe the token
+// get_token returned last. the source is borrowed, it does not have to be
+// terminated and must outlive the tokenizer.
+//
+// a pipelined tokenizer lexes on a thread of its own instead and tokens
+// only holds the last few get_token handed out, use peek_token and
+// last_token rather than the array then.
+typedef struct {
+    const char *source;
+    int source_length;
+    struct _token_ring_t *ring; // only when pipelined
+    token_t *tokens; // ends with TT_EOF, or TT_UNKNOWN on a bad character
+    int token_count;
+    int position; // index of the token get_token returns next
+    int int_val;
+    char *symbol;
     token_type_t token_type;
     int line_number;
 } tokenizer_t;
 
-void init_tokenizer(tokenizer_t *t, char *source);
+void init_lexer(void);
+void init_tokenizer(tokenizer_t *t, const char *source, int length);
+// for a slice of a bigger source, line is the line the slice starts on
+void init_tokenizer_at(tokenizer_t *t, const char *source, int length, int line);
 void release_tokenizer(tokenizer_t *t);
 token_type_t get_token(tokenizer_t *t);
 void unget_token(tokenizer_t *t);
+// the token get_token returns next and the one it returned last
+token_t *peek_token(tokenizer_t *t);
+token_t *last_token(tokenizer_t *t);
+
+typedef struct {
+    int token_count;
+    double lex_seconds;
+    int full_waits;  // times the lexer found the ring full
+    int empty_waits; // times the parser found it empty
+} pipeline_stats_t;
+
+// starts lexing on a thread, false when there is no thread to be had. a
+// lexer error makes get_token raise a syntax error without the message,
+// init_tokenizer reports it properly. finish_pipeline stops the thread
+// early if needed and fills stats when it is not 0, release_tokenizer
+// calls it too.
+bool init_tokenizer_pipelined(tokenizer_t *t, const char *source, int length);
+void finish_pipeline(tokenizer_t *t, pipeline_stats_t *stats);
+
+// where a top level named function starts, see split_source
+typedef struct {
+    int offset;
+    int line;
+} source_split_t;
+
+// finds up to max_count top level function definitions at least min_gap
+// bytes apart, the source can be lexed and parsed separately at each of
+// them. init_lexer has to run first when threads call it.
+int split_source(const char *source, int length, int min_gap, source_split_t *splits, int max_count);
 
 #endif // token_h
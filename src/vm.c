@@ -0,0 +1,607 @@
+#define _GNU_SOURCE // for getline
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtins.h"
+#include "gc.h"
+#include "vm.h"
+
+// initial sizes, both grow until they reach the stack limit
+#define VM_STACK_SIZE 1024
+#define VM_FRAMES 64
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (int)(ip[-2] | (ip[-1] << 8)))
+#define READ_NAME() ((char *)constants[READ_SHORT()]->data)
+#define READ_CACHE() (&chunk->caches[READ_SHORT()])
+#define PUSH(o)                \
+    do                         \
+    {                          \
+        if (sp == stack_end)   \
+        {                      \
+            SYNC();            \
+            grow_stack(rt);    \
+            RELOAD_STACK(0);   \
+        }                      \
+        *sp++ = (o);           \
+    } while (0)
+#define POP() (*--sp)
+#define PEEK(n) (sp[-1 - (n)])
+#define SYNC() (rt->stack_top = (int)(sp - rt->stack))
+// a quickened operator whose guard failed turns back into the generic one
+// and runs again, which picks a form for the new operand types
+#define DEOPTIMIZE()                \
+    {                               \
+        ip--;                       \
+        *ip = generic_opcodes[*ip]; \
+        break;                      \
+    }
+#define NUMBER_OP(op)                                                           \
+    {                                                                           \
+        object_t *a = PEEK(1);                                                  \
+        object_t *b = PEEK(0);                                                  \
+        if (0 == a || 0 == b || a->type != OBJ_NUMBER || b->type != OBJ_NUMBER) \
+        {                                                                       \
+            DEOPTIMIZE();                                                       \
+        }                                                                       \
+        object_t *result = create_object(rt, OBJ_NUMBER);                       \
+        result->data = NUMBER_DATA(NUMBER_VALUE(a) op NUMBER_VALUE(b));         \
+        sp--;                                                                   \
+        PEEK(0) = result;                                                       \
+        break;                                                                  \
+    }
+// the operand stack moves when it grows, also in the runs eval starts
+#define RELOAD_STACK(n) (sp = rt->stack + rt->stack_top - (n), stack_end = rt->stack + rt->stack_capacity)
+
+// the opcode each specialized form of an operator is run by
+static const opcode_t quickened[] = {
+    [QUICK_NUMBER_ADD] = OP_ADD_NUMBER,
+    [QUICK_NUMBER_SUB] = OP_SUB_NUMBER,
+    [QUICK_NUMBER_MUL] = OP_MUL_NUMBER,
+    [QUICK_NUMBER_GT] = OP_GT_NUMBER,
+    [QUICK_NUMBER_GTE] = OP_GTE_NUMBER,
+    [QUICK_NUMBER_LT] = OP_LT_NUMBER,
+    [QUICK_NUMBER_LTE] = OP_LTE_NUMBER,
+    [QUICK_NUMBER_EQUAL] = OP_EQUAL_NUMBER,
+    [QUICK_NUMBER_NOTEQUAL] = OP_NOTEQUAL_NUMBER,
+    [QUICK_STRING_ADD] = OP_ADD_STRING,
+    [QUICK_STRING_EQUAL] = OP_EQUAL_STRING,
+    [QUICK_STRING_NOTEQUAL] = OP_NOTEQUAL_STRING,
+};
+
+static const unsigned char generic_opcodes[] = {
+    [OP_ADD_NUMBER] = OP_ADD,
+    [OP_SUB_NUMBER] = OP_SUB,
+    [OP_MUL_NUMBER] = OP_MUL,
+    [OP_GT_NUMBER] = OP_GT,
+    [OP_GTE_NUMBER] = OP_GTE,
+    [OP_LT_NUMBER] = OP_LT,
+    [OP_LTE_NUMBER] = OP_LTE,
+    [OP_EQUAL_NUMBER] = OP_EQUAL,
+    [OP_NOTEQUAL_NUMBER] = OP_NOTEQUAL,
+    [OP_ADD_STRING] = OP_ADD,
+    [OP_EQUAL_STRING] = OP_EQUAL,
+    [OP_NOTEQUAL_STRING] = OP_NOTEQUAL,
+};
+
+static void runtime_error(const char *message, const char *detail)
+{
+    fprintf(stderr, "%s%s\n", message, detail);
+    exit(EXIT_FAILURE);
+}
+
+void init_vm(runtime_t *rt)
+{
+    rt->stack = (object_t **)malloc(VM_STACK_SIZE * sizeof(object_t *));
+    rt->stack_top = 0;
+    rt->stack_capacity = VM_STACK_SIZE;
+    rt->frames = (call_frame_t *)malloc(VM_FRAMES * sizeof(call_frame_t));
+    rt->frame_count = 0;
+    rt->frame_capacity = VM_FRAMES;
+}
+
+void release_vm(runtime_t *rt)
+{
+    free(rt->stack);
+    free(rt->frames);
+    rt->stack = 0;
+    rt->stack_top = 0;
+    rt->frames = 0;
+}
+
+// doubles a capacity of the operand stack or the frames, less when that
+// would go past the stack limit
+static int grow_capacity(runtime_t *rt, int capacity, size_t item_size)
+{
+    size_t used = rt->stack_capacity * sizeof(object_t *) + rt->frame_capacity * sizeof(call_frame_t);
+    size_t room = rt->stack_limit > used ? (rt->stack_limit - used) / item_size : 0;
+    if (0 == room)
+    {
+        stack_overflow();
+    }
+    return capacity + (room < (size_t)capacity ? (int)room : capacity);
+}
+
+static void grow_stack(runtime_t *rt)
+{
+    rt->stack_capacity = grow_capacity(rt, rt->stack_capacity, sizeof(object_t *));
+    rt->stack = (object_t **)realloc(rt->stack, rt->stack_capacity * sizeof(object_t *));
+}
+
+static call_frame_t *push_frame(runtime_t *rt)
+{
+    if (rt->frame_count == rt->frame_capacity)
+    {
+        rt->frame_capacity = grow_capacity(rt, rt->frame_capacity, sizeof(call_frame_t));
+        rt->frames = (call_frame_t *)realloc(rt->frames, rt->frame_capacity * sizeof(call_frame_t));
+    }
+    return &rt->frames[rt->frame_count++];
+}
+
+static object_t *get_value(variable_t *var)
+{
+    if (0 == var->obj)
+    {
+        runtime_error("undefined variable: ", var->name);
+    }
+    return var->obj;
+}
+
+static int is_truthy(object_t *obj)
+{
+    if (0 == obj)
+    {
+        runtime_error("condition has no value", "");
+    }
+    return obj->data != 0;
+}
+
+// the scope of a call with its arguments bound
+static scope_t *enter_function(runtime_t *rt, funcdef_t *fd, object_t *closure, object_t *this_obj, object_t **args, int argc)
+{
+    if (vector_count(fd->parameters) != argc)
+    {
+        runtime_error("argument count mismatch", "");
+    }
+    if (0 == fd->locals)
+    {
+        prepare_function(rt, fd);
+    }
+    if (0 == fd->chunk)
+    {
+        fd->chunk = compile_function(rt, fd);
+    }
+
+    scope_t *sc = create_scope(rt, fd, closure);
+    for (int i = 0; i < argc; i++)
+    {
+        vardecl_t *vd = vector_get(fd->parameters, i);
+        sc->slots[vd->slot]->obj = args[i];
+    }
+    if (this_obj != 0 && fd->this_slot >= 0)
+    {
+        sc->slots[fd->this_slot]->obj = this_obj;
+    }
+    return sc;
+}
+
+static void leave_scope(runtime_t *rt, scope_t *sc)
+{
+    sc->reference_count -= 1;
+    if (sc->reference_count == 0)
+    {
+        destroy_scope(rt, sc);
+    }
+    stack_pop(rt->scopes);
+}
+
+// betik calls do not recurse here, they push a frame and go on with the
+// code of the callee. only eval runs code on a new level of the C stack.
+object_t *vm_execute(runtime_t *rt, chunk_t *chunk)
+{
+    unsigned char *ip = chunk->code;
+    object_t **constants = chunk->constants;
+    int base = rt->stack_top; // operands of the running function start here
+    object_t **sp = rt->stack + base;
+    object_t **stack_end = rt->stack + rt->stack_capacity;
+    variable_t **slots = rt->current_scope->slots; // reloaded after calls
+    variable_t **upvalues = rt->current_scope->upvalues;
+    int entry = rt->frame_count; // frames below belong to the runs further up
+    // the call being set up
+    funcdef_t *fd;
+    object_t *callee;
+    object_t *this_obj;
+    object_t **args;
+    object_t **result_slot;
+    int argc;
+    char *name;
+
+    check_native_stack(rt);
+
+    for (;;)
+    {
+        switch (READ_BYTE())
+        {
+        case OP_CONST:
+            PUSH(constants[READ_SHORT()]);
+            break;
+        case OP_POP:
+            sp--;
+            break;
+        case OP_GET_LOCAL:
+            PUSH(get_value(slots[READ_SHORT()]));
+            break;
+        case OP_SET_LOCAL:
+            slots[READ_SHORT()]->obj = PEEK(0);
+            break;
+        case OP_GET_UPVALUE:
+            PUSH(get_value(upvalues[READ_SHORT()]));
+            break;
+        case OP_SET_UPVALUE:
+            upvalues[READ_SHORT()]->obj = PEEK(0);
+            break;
+        case OP_GET_GLOBAL:
+        {
+            variable_t *var = rt->global_scope->slots[READ_SHORT()];
+            if (0 == var->obj)
+            {
+                // a function defined by eval after this code was resolved
+                funcdef_t *fd = find_function(rt, var->name);
+                if (0 != fd)
+                {
+                    PUSH(create_closure(rt, fd));
+                    break;
+                }
+            }
+            PUSH(get_value(var));
+            break;
+        }
+        case OP_SET_GLOBAL:
+            rt->global_scope->slots[READ_SHORT()]->obj = PEEK(0);
+            break;
+        case OP_GET_FUNCTION:
+        {
+            char *name = READ_NAME();
+            funcdef_t *fd = find_function(rt, name);
+            if (0 == fd)
+            {
+                runtime_error("undefined variable: ", name);
+            }
+            PUSH(create_closure(rt, fd));
+            break;
+        }
+        case OP_GET_PROP:
+        {
+            char *name = READ_NAME();
+            variable_t *prop = cached_property(rt, PEEK(0), name, READ_CACHE());
+            if (0 == prop->obj)
+            {
+                runtime_error("undefined property: ", name);
+            }
+            PEEK(0) = prop->obj;
+            break;
+        }
+        case OP_SET_PROP:
+        {
+            char *name = READ_NAME();
+            object_t *value = POP();
+            cached_property(rt, PEEK(0), name, READ_CACHE())->obj = value;
+            PEEK(0) = value;
+            break;
+        }
+        case OP_INIT_PROP:
+        {
+            char *name = READ_NAME();
+            object_t *value = POP();
+            get_property(rt, PEEK(0), name)->obj = value;
+            break;
+        }
+        case OP_INDEX:
+        case OP_SET_INDEX:
+        {
+            int is_store = ip[-1] == OP_SET_INDEX;
+            object_t *value = is_store ? POP() : 0;
+            object_t *index = POP();
+            object_t *list = PEEK(0);
+            if (OBJ_LIST != list->type || OBJ_NUMBER != index->type)
+            {
+                runtime_error("invalid list index", "");
+            }
+            if (is_store)
+            {
+                array_set(list, NUMBER_VALUE(index), value);
+                PEEK(0) = value;
+            }
+            else
+            {
+                PEEK(0) = array_get(list, NUMBER_VALUE(index));
+            }
+            break;
+        }
+        case OP_NEW_OBJECT:
+        {
+            PUSH(create_object(rt, OBJ_BASE));
+            break;
+        }
+        case OP_NEW_LIST:
+        {
+            int count = READ_SHORT();
+            object_t *obj = create_list_object(rt, count);
+            for (int i = count; i > 0; i--)
+            {
+                array_push(rt, obj, PEEK(i - 1));
+            }
+            sp -= count;
+            PUSH(obj);
+            break;
+        }
+        case OP_CLOSURE:
+            PUSH(create_closure(rt, constants[READ_SHORT()]->data));
+            break;
+        case OP_CALL_BUILTIN:
+        {
+            int id = READ_SHORT();
+            argc = READ_BYTE();
+            SYNC();
+            object_t *result = call_builtin(rt, id, sp - argc, argc);
+            RELOAD_STACK(argc);
+            slots = rt->current_scope->slots;
+            PUSH(result);
+            break;
+        }
+        case OP_CALL_FUNCTION:
+            fd = constants[READ_SHORT()]->data;
+            argc = READ_BYTE();
+            args = sp - argc;
+            result_slot = args;
+            callee = 0;
+            this_obj = 0;
+            goto call;
+        case OP_CALL_VALUE:
+            argc = READ_BYTE();
+            args = sp - argc;
+            result_slot = args - 1;
+            callee = args[-1];
+            this_obj = 0;
+            name = "value";
+            goto call_value;
+        case OP_INVOKE:
+        {
+            name = READ_NAME();
+            property_cache_t *cache = READ_CACHE();
+            argc = READ_BYTE();
+            args = sp - argc;
+            result_slot = args - 1;
+            this_obj = args[-1];
+            callee = cached_property(rt, this_obj, name, cache)->obj;
+            goto call_value;
+        }
+        call_value:
+            if (0 == callee || OBJ_FUNCTION != callee->type)
+            {
+                runtime_error("not a function: ", name);
+            }
+            fd = callee->data;
+        call:
+        {
+            if (fd->chunk != 0 && JIT_TICK(&fd->chunk->calls))
+            {
+                int result_index = (int)(result_slot - rt->stack);
+                object_t *result;
+                SYNC();
+                bool native = jit_call(rt, fd, this_obj, args, argc, &result);
+                RELOAD_STACK(0);
+                if (native)
+                {
+                    sp = rt->stack + result_index;
+                    PUSH(result);
+                    break;
+                }
+                args = sp - argc;
+                result_slot = rt->stack + result_index;
+            }
+            scope_t *sc = enter_function(rt, fd, callee, this_obj, args, argc);
+            call_frame_t *frame = push_frame(rt);
+            frame->chunk = chunk;
+            frame->ip = ip;
+            frame->base = base;
+            frame->scope = rt->current_scope;
+            stack_push(rt->scopes, &sc);
+            rt->current_scope = sc;
+            // the operands of the callee start where its result goes
+            base = (int)(result_slot - rt->stack);
+            sp = result_slot;
+            chunk = fd->chunk;
+            ip = chunk->code;
+            constants = chunk->constants;
+            slots = sc->slots;
+            upvalues = sc->upvalues;
+            SYNC();
+            GC_SAFE_POINT(rt);
+            break;
+        }
+        case OP_TAIL_CALL_FUNCTION:
+        case OP_TAIL_CALL_VALUE:
+        {
+            callee = 0;
+            fd = OP_TAIL_CALL_FUNCTION == ip[-1] ? constants[READ_SHORT()]->data : 0;
+            argc = READ_BYTE();
+            args = sp - argc;
+            if (0 == fd)
+            {
+                callee = args[-1];
+                if (0 == callee || OBJ_FUNCTION != callee->type)
+                {
+                    runtime_error("not a function: ", "value");
+                }
+                fd = callee->data;
+            }
+            if (fd->chunk != 0 && JIT_TICK(&fd->chunk->calls))
+            {
+                object_t *result;
+                SYNC();
+                bool native = jit_call(rt, fd, 0, args, argc, &result);
+                RELOAD_STACK(0);
+                if (native)
+                {
+                    PUSH(result);
+                    goto return_result;
+                }
+                args = sp - argc;
+            }
+            // the callee takes over the frame and the scope stack entry of
+            // this call
+            scope_t *sc = enter_function(rt, fd, callee, 0, args, argc);
+            leave_scope(rt, rt->current_scope);
+            stack_push(rt->scopes, &sc);
+            rt->current_scope = sc;
+            chunk = fd->chunk;
+            ip = chunk->code;
+            constants = chunk->constants;
+            slots = sc->slots;
+            upvalues = sc->upvalues;
+            sp = rt->stack + base;
+            SYNC();
+            GC_SAFE_POINT(rt);
+            break;
+        }
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_GT:
+        case OP_GTE:
+        case OP_LT:
+        case OP_LTE:
+        case OP_EQUAL:
+        case OP_NOTEQUAL:
+        case OP_BINARY:
+        {
+            static const token_type_t tokens[] = {
+                [OP_ADD] = TT_OP_ADD,
+                [OP_SUB] = TT_OP_SUB,
+                [OP_MUL] = TT_OP_MUL,
+                [OP_DIV] = TT_OP_DIV,
+                [OP_GT] = TT_OP_GT,
+                [OP_GTE] = TT_OP_GTE,
+                [OP_LT] = TT_OP_LT,
+                [OP_LTE] = TT_OP_LTE,
+                [OP_EQUAL] = TT_OP_EQUAL,
+                [OP_NOTEQUAL] = TT_OP_NOTEQUAL,
+            };
+            token_type_t tok = ip[-1] == OP_BINARY ? (token_type_t)READ_BYTE() : tokens[ip[-1]];
+            if (ip[-1] != OP_BINARY)
+            {
+                quick_op_t q = quicken_op(PEEK(1), PEEK(0), tok);
+                if (q > QUICK_GENERIC)
+                {
+                    ip[-1] = quickened[q];
+                }
+            }
+            object_t *result = binary_op(rt, PEEK(1), PEEK(0), tok);
+            sp--;
+            PEEK(0) = result;
+            break;
+        }
+        case OP_ADD_NUMBER:
+            NUMBER_OP(+);
+        case OP_SUB_NUMBER:
+            NUMBER_OP(-);
+        case OP_MUL_NUMBER:
+            NUMBER_OP(*);
+        case OP_GT_NUMBER:
+            NUMBER_OP(>);
+        case OP_GTE_NUMBER:
+            NUMBER_OP(>=);
+        case OP_LT_NUMBER:
+            NUMBER_OP(<);
+        case OP_LTE_NUMBER:
+            NUMBER_OP(<=);
+        case OP_EQUAL_NUMBER:
+            NUMBER_OP(==);
+        case OP_NOTEQUAL_NUMBER:
+            NUMBER_OP(!=);
+        case OP_ADD_STRING:
+        case OP_EQUAL_STRING:
+        case OP_NOTEQUAL_STRING:
+        {
+            static const quick_op_t forms[] = {
+                [OP_ADD_STRING] = QUICK_STRING_ADD,
+                [OP_EQUAL_STRING] = QUICK_STRING_EQUAL,
+                [OP_NOTEQUAL_STRING] = QUICK_STRING_NOTEQUAL,
+            };
+            object_t *result = quick_op(rt, forms[ip[-1]], PEEK(1), PEEK(0));
+            if (0 == result)
+            {
+                DEOPTIMIZE();
+            }
+            sp--;
+            PEEK(0) = result;
+            break;
+        }
+        case OP_JUMP:
+        {
+            int offset = READ_SHORT();
+            ip += offset;
+            break;
+        }
+        case OP_JUMP_IF_FALSE:
+        {
+            int offset = READ_SHORT();
+            if (!is_truthy(POP()))
+            {
+                ip += offset;
+            }
+            break;
+        }
+        case OP_LOOP:
+        {
+            jit_site_t *site = &chunk->loops[READ_SHORT()];
+            int offset = READ_SHORT();
+            ip -= offset;
+            if (JIT_TICK(site))
+            {
+                ip = jit_loop(rt, chunk, site, ip, ip + offset, slots, upvalues);
+            }
+            SYNC();
+            GC_SAFE_POINT(rt);
+            break;
+        }
+        case OP_PRINT:
+            print_object(POP());
+            break;
+        case OP_RETURN:
+        return_result:
+        {
+            object_t *result = POP();
+            if (rt->frame_count == entry)
+            {
+                rt->stack_top = base;
+                return result;
+            }
+            leave_scope(rt, rt->current_scope);
+            call_frame_t *frame = &rt->frames[--rt->frame_count];
+            rt->current_scope = frame->scope;
+            sp = rt->stack + base;
+            base = frame->base;
+            chunk = frame->chunk;
+            ip = frame->ip;
+            constants = chunk->constants;
+            slots = rt->current_scope->slots;
+            upvalues = rt->current_scope->upvalues;
+            PUSH(result);
+            break;
+        }
+        default:
+            runtime_error("invalid opcode", "");
+        }
+    }
+}
+
+void vm_run(runtime_t *rt, vector_t *statements)
+{
+    chunk_t *chunk = compile_script(rt, statements);
+    vm_execute(rt, chunk);
+    destroy_chunk(rt, chunk);
+}
@@ -0,0 +1,12 @@
+#ifndef vm_h
+#define vm_h
+
+#include "compiler.h"
+#include "runtime.h"
+
+void init_vm(runtime_t *rt);
+void release_vm(runtime_t *rt);
+object_t *vm_execute(runtime_t *rt, chunk_t *chunk);
+void vm_run(runtime_t *rt, vector_t *statements);
+
+#endif // vm_h